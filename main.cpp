@@ -1,22 +1,76 @@
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <format>
+#include <fstream>
 #include <functional>
 #include <future>
 #include <iostream>
+#include <memory>
+#include <limits>
 #include <map>
 #include <mutex>
 #include <numeric>
+#include <optional>
 #include <queue>
+#include <random>
 #include <ranges>
+#include <set>
+#include <span>
 #include <string>
+#include <string_view>
 #include <syncstream>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define FILE_FINDER_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(FILE_FINDER_POSIX)
+#include <csignal>
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+// Compressed files are searched through when the codec's macro is defined
+// and its library is linked (-lz, -llzma, -lzstd).
+#if defined(FILE_FINDER_ZLIB) && __has_include(<zlib.h>)
+#include <zlib.h>
+#else
+#undef FILE_FINDER_ZLIB
+#endif
+#if defined(FILE_FINDER_LZMA) && __has_include(<lzma.h>)
+#include <lzma.h>
+#else
+#undef FILE_FINDER_LZMA
+#endif
+#if defined(FILE_FINDER_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#else
+#undef FILE_FINDER_ZSTD
+#endif
+
 namespace fs = std::filesystem;
+using namespace std::string_view_literals;
 
 struct Logger {
   enum struct Level {
@@ -77,35 +131,466 @@ private:
 };
 Logger logger{Logger::Level::Info};
 
-struct SearchResult {
-  SearchResult(fs::directory_entry entry, std::string substring,
-               std::thread::id id)
-      : entry(entry), substring(substring), id(id) {}
+#pragma region Storage
+
+struct IndexException : std::runtime_error {
+  IndexException(std::string message) : std::runtime_error(message.c_str()) {}
+};
+
+/// @brief Read-only view of a file's bytes. Uses mmap where available so that
+/// opening an index doesn't copy it into memory.
+struct MappedFile {
+  MappedFile(const fs::path &path) {
+#if defined(FILE_FINDER_POSIX)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw IndexException(
+          std::format("Unable to open \"{}\"", path.string()));
+    }
+    struct stat info {};
+    ::fstat(fd, &info);
+    this->size = static_cast<size_t>(info.st_size);
+    if (this->size > 0) {
+      this->address = ::mmap(nullptr, this->size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (this->address == MAP_FAILED) {
+      this->address = nullptr;
+      throw IndexException(std::format("Unable to map \"{}\"", path.string()));
+    }
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw IndexException(
+          std::format("Unable to open \"{}\"", path.string()));
+    }
+    this->buffer.assign(std::istreambuf_iterator<char>(file), {});
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+#if defined(FILE_FINDER_POSIX)
+    if (this->address != nullptr) {
+      ::munmap(this->address, this->size);
+    }
+#endif
+  }
+
+  std::string_view bytes() const {
+#if defined(FILE_FINDER_POSIX)
+    return {static_cast<const char *>(this->address), this->size};
+#else
+    return this->buffer;
+#endif
+  }
+
+private:
+#if defined(FILE_FINDER_POSIX)
+  void *address = nullptr;
+  size_t size = 0;
+#else
+  std::string buffer;
+#endif
+};
+
+/// @brief Appends fixed width integers (native byte order), LEB128 varints and
+/// length-prefixed strings to a buffer.
+struct ByteWriter {
+  template <typename T> void fixed(T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    this->out.append(bytes, sizeof(T));
+  }
+
+  void varint(uint64_t value) {
+    while (value >= 0x80) {
+      this->out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    this->out.push_back(static_cast<char>(value));
+  }
+
+  void string(std::string_view value) {
+    this->fixed<uint32_t>(static_cast<uint32_t>(value.size()));
+    this->out.append(value);
+  }
+
+  std::string out;
+};
+
+/// @brief Counterpart of ByteWriter. Throws IndexException when reading past
+/// the end of the data.
+struct ByteReader {
+  ByteReader(std::string_view data) : data(data) {}
+
+  template <typename T> T fixed() {
+    T value;
+    std::memcpy(&value, this->take(sizeof(T)).data(), sizeof(T));
+    return value;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = static_cast<uint8_t>(this->take(1)[0]);
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    throw IndexException("Malformed varint in index");
+  }
+
+  std::string_view string() { return this->take(this->fixed<uint32_t>()); }
+
+  std::string_view take(size_t count) {
+    if (count > this->data.size() - this->pos) {
+      throw IndexException("Unexpected end of index data");
+    }
+    std::string_view bytes = this->data.substr(this->pos, count);
+    this->pos += count;
+    return bytes;
+  }
+
+  bool done() const { return this->pos == this->data.size(); }
+
+  std::string_view data;
+  size_t pos = 0;
+};
+
+inline int64_t to_nanoseconds(fs::file_time_type time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+/// @brief Returns a stable (across runs and platforms) 64-bit FNV-1a hash.
+inline uint64_t fnv1a(std::string_view bytes) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : bytes) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/// @brief Writes `parts` to a temporary file and renames it over `path`, so
+/// that readers see either the old or the new file, never a partial one.
+inline void
+write_file_atomically(const fs::path &path,
+                      const std::vector<std::string_view> &parts) {
+  fs::path temporary = path;
+  temporary += ".tmp";
+  {
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    for (std::string_view part : parts) {
+      stream.write(part.data(), part.size());
+    }
+    if (!stream) {
+      throw IndexException(
+          std::format("Unable to write \"{}\"", temporary.string()));
+    }
+  }
+  std::error_code error;
+  fs::rename(temporary, path, error);
+  if (error) {
+    throw IndexException(std::format("Unable to replace \"{}\": {}",
+                                     path.string(), error.message()));
+  }
+}
+
+#pragma endregion Storage
+
+#pragma region Throttle
+
+/// @brief Limits the rate of file system operations (a token bucket holding
+/// up to one second's worth) and the CPU time used by the whole process.
+/// Limits can be changed while a search runs; 0 means unlimited. A search can
+/// also be paused altogether.
+struct Throttle {
+  /// @brief Parks every thread that calls wait_while_paused until resume().
+  void pause() {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->paused = true;
+  }
+
+  void resume() {
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->paused = false;
+    }
+    this->resumed.notify_all();
+  }
+
+  bool is_paused() const { return this->paused; }
+
+  /// @brief Blocks (without polling) while the search is paused. Called by
+  /// every pipeline thread between units of work, so that a paused search
+  /// uses no CPU or I/O and resumes exactly where it stopped.
+  void wait_while_paused() {
+    if (!this->paused) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->resumed.wait(lock, [this]() { return !this->paused; });
+  }
 
-  fs::directory_entry entry;
-  std::string substring;
-  std::thread::id id;
+  void set_ops_per_second(uint64_t rate) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->refill();
+    this->ops_per_second = rate;
+    this->tokens = std::min(this->tokens, this->burst());
+  }
+
+  void set_cpu_percent(uint64_t percent) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->cpu_percent = percent;
+    this->start_cpu_window();
+  }
+
+  /// @brief Blocks until one more file system operation may proceed.
+  void acquire() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (this->ops_per_second != 0) {
+      this->refill();
+      if (this->tokens >= 1.0) {
+        this->tokens -= 1.0;
+        return;
+      }
+      // Wake up at least every 100ms, to pick up a changed rate.
+      auto wait = std::min<std::chrono::duration<double>>(
+          std::chrono::duration<double>((1.0 - this->tokens) /
+                                        this->ops_per_second),
+          std::chrono::milliseconds{100});
+      lock.unlock();
+      std::this_thread::sleep_for(wait);
+      lock.lock();
+    }
+  }
+
+  /// @brief Sleeps the calling thread while the process has used more than
+  /// its share of CPU time in the current (one second) window. Called by the
+  /// walker and the processors between units of work.
+  void check_cpu() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (this->cpu_percent == 0) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> wall = now - this->window_start;
+    double cpu = this->process_cpu_seconds() - this->window_cpu;
+    // Wall time the CPU time used so far is allowed to take.
+    double allowed = cpu * 100.0 / static_cast<double>(this->cpu_percent);
+    if (wall.count() > 1.0) {
+      this->start_cpu_window();
+    }
+    lock.unlock();
+    if (allowed > wall.count()) {
+      std::this_thread::sleep_for(std::min<std::chrono::duration<double>>(
+          std::chrono::duration<double>(allowed - wall.count()),
+          std::chrono::milliseconds{100}));
+    }
+  }
+
+private:
+  double burst() const {
+    return std::max(1.0, static_cast<double>(this->ops_per_second));
+  }
+
+  void refill() {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - this->last_refill;
+    this->last_refill = now;
+    this->tokens = std::min(
+        this->burst(), this->tokens + elapsed.count() * this->ops_per_second);
+  }
+
+  void start_cpu_window() {
+    this->window_start = std::chrono::steady_clock::now();
+    this->window_cpu = this->process_cpu_seconds();
+  }
+
+  /// @brief CPU time used by all threads of the process.
+  double process_cpu_seconds() const {
+#if defined(FILE_FINDER_POSIX)
+    timespec time{};
+    ::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return static_cast<double>(time.tv_sec) + time.tv_nsec / 1e9;
+#else
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+  }
+
+  std::mutex mutex;
+  std::condition_variable resumed;
+  std::atomic_bool paused = false;
+  uint64_t ops_per_second = 0;
+  double tokens = 1.0;
+  std::chrono::steady_clock::time_point last_refill =
+      std::chrono::steady_clock::now();
+  uint64_t cpu_percent = 0; // Of one core.
+  std::chrono::steady_clock::time_point window_start;
+  double window_cpu = 0;
+};
+
+/// @brief Moves the calling thread, and the threads it starts afterwards, to
+/// the idle I/O class: its reads are only served when the disk is otherwise
+/// idle.
+/// @return false where I/O priorities aren't supported (outside Linux).
+inline bool set_idle_io_priority() {
+#if defined(__linux__)
+  constexpr int ioprio_who_process = 1;
+  constexpr int ioprio_class_idle = 3;
+  constexpr int ioprio_class_shift = 13;
+  return ::syscall(SYS_ioprio_set, ioprio_who_process, 0,
+                   ioprio_class_idle << ioprio_class_shift) == 0;
+#else
+  return false;
+#endif
+}
+
+#pragma endregion Throttle
+
+/// @brief Which of the substrings matched a path, as a bitmask of substring
+/// positions (pattern ids). The first 64 fit in one word; searches for more
+/// substrings keep the other bits in words on the heap, which smaller
+/// searches never allocate.
+class PatternMask {
+public:
+  PatternMask() = default;
+  explicit PatternMask(uint64_t low) : low(low) {}
+
+  void set(size_t pattern) {
+    if (pattern < 64) {
+      this->low |= uint64_t{1} << pattern;
+      return;
+    }
+    size_t word = pattern / 64 - 1;
+    if (this->high.size() <= word) {
+      this->high.resize(word + 1);
+    }
+    this->high[word] |= uint64_t{1} << (pattern % 64);
+  }
+
+  bool test(size_t pattern) const {
+    if (pattern < 64) {
+      return (this->low >> pattern & 1) != 0;
+    }
+    size_t word = pattern / 64 - 1;
+    return word < this->high.size() &&
+           (this->high[word] >> (pattern % 64) & 1) != 0;
+  }
+
+  // High words only exist once one of their bits was set.
+  bool any() const { return this->low != 0 || !this->high.empty(); }
+  bool none() const { return !this->any(); }
+
+  size_t count() const {
+    size_t count = std::popcount(this->low);
+    for (uint64_t word : this->high) {
+      count += std::popcount(word);
+    }
+    return count;
+  }
+
+  /// @brief The number of pattern ids the mask holds bits for.
+  size_t size() const { return 64 * (1 + this->high.size()); }
+
+  /// @brief Appends the mask as a varint count of words and the words.
+  void write(ByteWriter &out) const {
+    out.varint(1 + this->high.size());
+    out.fixed<uint64_t>(this->low);
+    for (uint64_t word : this->high) {
+      out.fixed<uint64_t>(word);
+    }
+  }
+
+  static PatternMask read(ByteReader &in) {
+    uint64_t words = in.varint();
+    if (words == 0 || words > (in.data.size() - in.pos) / sizeof(uint64_t)) {
+      throw IndexException("Malformed pattern mask");
+    }
+    PatternMask mask(in.fixed<uint64_t>());
+    mask.high.resize(words - 1);
+    for (uint64_t &word : mask.high) {
+      word = in.fixed<uint64_t>();
+    }
+    while (!mask.high.empty() && mask.high.back() == 0) {
+      mask.high.pop_back();
+    }
+    return mask;
+  }
+
+  bool operator==(const PatternMask &) const = default;
+
+private:
+  uint64_t low = 0;
+  std::vector<uint64_t> high; // Patterns 64 and up, without trailing zeros.
+};
+
+// Entries are numbered in the order the finder reaches them.
+using EntryId = uint64_t;
+
+// Distinct file names are numbered in the order they are interned (see
+// NameDictionary).
+using NameId = uint32_t;
+constexpr NameId no_name = std::numeric_limits<NameId>::max();
+
+struct SearchResult {
+  EntryId entry;
+  size_t pattern;
 };
 
 struct SearchResultContainer {
-  SearchResultContainer(){};
-  void push(SearchResult result) {
+  SearchResultContainer(std::vector<std::string> patterns = {})
+      : patterns(patterns), threads(patterns.size()) {}
+
+  /// @brief Records the thread matching `pattern`, for output.
+  void set_thread(size_t pattern, std::thread::id id) {
     std::scoped_lock<std::mutex> lock(store_mutex);
-    logger.debug(std::format("push \"{}\"", result.entry.path().string()));
-    this->store[result.entry.path()].emplace_back(result.substring, result.id);
+    this->threads.at(pattern) = id;
+  }
+
+  /// @brief Adds a match. The name is only copied the first time an entry is
+  /// matched, and its folder's path once per folder; later matches of other
+  /// patterns set a bit of the same record.
+  void push(SearchResult result, const fs::path &path) {
+    std::scoped_lock<std::mutex> lock(store_mutex);
+    logger.debug(std::format("push \"{}\"", path.string()));
+    auto [itr, inserted] = this->store.try_emplace(result.entry);
+    if (inserted) {
+      auto [folder, added] = this->folder_ids.try_emplace(
+          path.parent_path(), static_cast<uint32_t>(this->folders.size()));
+      if (added) {
+        this->folders.push_back(folder->first);
+      }
+      itr->second.folder = folder->second;
+      itr->second.name = path.filename().string();
+    }
+    itr->second.patterns.set(result.pattern);
+    if (this->on_push) {
+      this->on_push(result, path);
+    }
   }
 
   void dump() {
     std::scoped_lock<std::mutex> lock(store_mutex);
     logger.info("dump start", true, true);
     std::stringstream ss;
-    for (auto &[key, values] : this->store) {
-      ss << key << "\n";
-      for (const ResultValue &result : values) {
-        ss << "\t\"" << result.first << "\"\t(" << result.second << ")\n";
+    for (auto &[id, match] : this->store) {
+      ss << this->path(match) << "\n";
+      for (size_t pattern = 0; pattern < this->patterns.size(); ++pattern) {
+        if (match.patterns.test(pattern)) {
+          ss << "\t\"" << this->patterns[pattern] << "\"\t("
+             << this->threads[pattern] << ")\n";
+        }
       }
     }
     this->store.clear();
+    this->folders.clear();
+    this->folder_ids.clear();
     std::osyncstream(std::cout) << ss.str();
     std::osyncstream(std::cout).flush();
   }
@@ -116,6 +601,9 @@ struct SearchResultContainer {
     this->should_continue = true;
     auto start = std::chrono::high_resolution_clock::now();
     while (this->should_continue) {
+      if (this->throttle != nullptr) {
+        this->throttle->wait_while_paused();
+      }
       auto finish = std::chrono::high_resolution_clock::now();
       std::chrono::duration<double, std::milli> elapsed = finish - start;
       if (elapsed > ms) {
@@ -129,446 +617,8298 @@ struct SearchResultContainer {
   }
 
   std::atomic_bool should_continue = false;
+  // Called (under the store lock) for every match, e.g. to record it in a
+  // ResultCache.
+  std::function<void(SearchResult, const fs::path &)> on_push;
+  Throttle *throttle = nullptr; // Pauses periodic dumps.
 
 protected:
-  using ResultValue = std::pair<std::string, std::thread::id>;
-  std::unordered_map<fs::path, std::vector<ResultValue>> store;
+  struct Match {
+    uint32_t folder; // In `folders`.
+    std::string name;
+    PatternMask patterns;
+  };
+
+  fs::path path(const Match &match) const {
+    return this->folders[match.folder] / match.name;
+  }
+
+  // Pattern names and threads are only looked up when dumping.
+  std::vector<std::string> patterns;
+  std::vector<std::thread::id> threads;
+  std::map<EntryId, Match> store; // Dumped in the order entries were found.
+  // Paths of the folders of the matches, each kept once.
+  std::vector<fs::path> folders;
+  std::unordered_map<fs::path, uint32_t> folder_ids;
   std::mutex store_mutex;
 };
 
-struct Processor {
-  Processor(SearchResultContainer *container, std::string search_string)
-      : target(search_string), container(container) {}
+#pragma region Contents
 
-  Processor(Processor &&processor)
-      : target(std::move(processor.target)), queue(std::move(processor.queue)),
-        container(processor.container) {}
+/// @brief Checks a batch of files by their contents and returns a verdict
+/// for each.
+using FileCheck =
+    std::function<std::vector<char>(const std::vector<fs::path> &)>;
 
-  std::queue<fs::directory_entry> queue;
-  SearchResultContainer *container;
+/// @brief Returns a check that only passes the files that pass both `first`
+/// and `second`. `second` only sees the files that passed `first`.
+inline FileCheck both_checks(FileCheck first, FileCheck second) {
+  return [first, second](const std::vector<fs::path> &paths) {
+    std::vector<char> verdicts = first(paths);
+    std::vector<fs::path> passed;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (verdicts[i]) {
+        passed.push_back(paths[i]);
+      }
+    }
+    std::vector<char> second_verdicts = second(passed);
+    for (size_t i = 0, next = 0; i < paths.size(); ++i) {
+      if (verdicts[i]) {
+        verdicts[i] = second_verdicts[next++];
+      }
+    }
+    return verdicts;
+  };
+}
 
-  void push(fs::directory_entry entry) {
-    std::scoped_lock<std::mutex> lock(queue_mutex);
-    logger.debug(std::format("push {}", entry.path().string()));
-    this->queue.push(entry);
+/// @brief Sits between the processors and the container and only lets
+/// through matches whose file passes a check of its contents. Only files
+/// whose names matched are checked, and only once however many substrings
+/// they matched, as long as the matches are posted before the check is done:
+/// a file is forgotten once checked, so a later match checks it again. A
+/// pool of threads checks them in batches.
+struct FileFilter {
+  static constexpr size_t batch_size = 64;
+
+  FileFilter(SearchResultContainer *container, FileCheck check,
+             size_t threads = std::max(1U,
+                                       std::thread::hardware_concurrency()))
+      : container(container), check(std::move(check)) {
+    for (size_t i = 0; i < threads; ++i) {
+      this->threads.emplace_back([this]() { this->loop(); });
+    }
   }
 
-  size_t queue_size() {
-    std::scoped_lock<std::mutex> lock(queue_mutex);
-    return queue.size();
+  ~FileFilter() {
+    this->stop();
+    for (std::thread &thread : this->threads) {
+      thread.join();
+    }
   }
 
-  int run(std::chrono::milliseconds resolution = std::chrono::milliseconds{
-              500}) {
-    this->should_continue = true;
-    logger.debug("processor start");
-    while (this->should_continue) {
-      logger.debug(std::format("proc size: {}", this->queue_size()));
-      this->process();
-      std::this_thread::sleep_for(std::chrono::milliseconds(resolution));
+  /// @brief Passes `result` on to the container once its file has passed
+  /// the check, or drops it.
+  void post(SearchResult result, const fs::path &path) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    auto [itr, inserted] = this->candidates.try_emplace(result.entry);
+    Candidate &candidate = itr->second;
+    candidate.patterns.set(result.pattern);
+    if (inserted) {
+      candidate.path = path;
+      this->queue.push_back(result.entry);
+      lock.unlock();
+      this->changed.notify_all();
     }
-    logger.debug("processor end");
-    return 0;
   }
 
-  void process() {
-    std::scoped_lock<std::mutex> lock(queue_mutex);
-    while (this->queue.size() > 0) {
-      fs::directory_entry &entry = this->queue.front();
-      logger.debug(std::format("processing entry: \"{0}\" vs \"{1}\"",
-                               entry.path().filename().string(), this->target));
-      if (entry.path().filename().string().find(this->target) !=
-          std::string::npos) {
-        logger.debug(std::format("found {}", entry.path().filename().string()));
-        this->container->push(
-            SearchResult(entry, target, std::this_thread::get_id()));
-      }
-      this->queue.pop();
+  /// @brief Files posted and not checked yet.
+  size_t pending() {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    return this->candidates.size();
+  }
+
+  /// @brief Waits until every file posted so far has been checked, or the
+  /// filter was stopped.
+  void finish() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [this]() {
+      return this->stopped || (this->queue.empty() && this->busy == 0);
+    });
+  }
+
+  void stop() {
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->stopped = true;
+      this->queue.clear();
     }
+    this->changed.notify_all();
   }
 
-  const std::string target;
-  std::atomic_bool should_continue{false};
+  Throttle *throttle = nullptr; // Optional CPU limit and pause.
+  std::atomic_size_t files_checked = 0;
+  std::atomic_size_t files_accepted = 0;
 
 private:
-  std::mutex queue_mutex;
-};
+  struct Candidate {
+    fs::path path;
+    PatternMask patterns; // Substrings it matched so far.
+  };
 
-struct PathFinder {
-  int list_paths(std::filesystem::path path, std::vector<Processor> *processors,
-                 std::filesystem::directory_options &&options) {
-    logger.debug("find start");
-    this->should_continue = true;
-    for (const fs::directory_entry &entry :
-         fs::recursive_directory_iterator(path, options)) {
-      if (!this->should_continue) {
-        logger.debug("end_find (stop)");
-        return 1;
+  void loop() {
+    while (true) {
+      std::vector<EntryId> batch;
+      std::vector<fs::path> paths;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() {
+          return this->stopped || !this->queue.empty();
+        });
+        if (this->stopped) {
+          return;
+        }
+        while (!this->queue.empty() && batch.size() < batch_size) {
+          batch.push_back(this->queue.front());
+          paths.push_back(this->candidates[batch.back()].path);
+          this->queue.pop_front();
+        }
+        ++this->busy;
       }
-      for (Processor &proc : *processors) {
-        if (entry.is_directory() == false) { // Ignore folders.
-          proc.push(entry);
+      if (this->throttle != nullptr) {
+        this->throttle->wait_while_paused();
+        this->throttle->check_cpu();
+      }
+      std::vector<char> verdicts = this->check(paths);
+      this->files_checked += batch.size();
+
+      std::vector<std::pair<SearchResult, fs::path>> accepted;
+      {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        for (size_t i = 0; i < batch.size(); ++i) {
+          auto itr = this->candidates.find(batch[i]);
+          const Candidate &candidate = itr->second;
+          for (size_t pattern = 0; pattern < candidate.patterns.size();
+               ++pattern) {
+            if (verdicts[i] && candidate.patterns.test(pattern)) {
+              accepted.emplace_back(SearchResult{batch[i], pattern},
+                                    candidate.path);
+            }
+          }
+          this->candidates.erase(itr);
+          this->files_accepted += verdicts[i] != 0;
         }
       }
+      for (const auto &[result, path] : accepted) {
+        this->container->push(result, path);
+      }
+      {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        --this->busy;
+      }
+      this->changed.notify_all();
     }
-
-    logger.debug("find end");
-    return 0;
   }
 
-  std::atomic_bool should_continue = false;
-};
-
-struct SearchSettings {
-  fs::path root_dir;         // Root directory to begin traversing from.
-  bool follow_links = false; // todo: Flags for different kinds of links
-                             // (hardlink, symlink, shortcut, etc)
-  std::vector<std::string> substrings; // Substring to look for in filenames
-};
-
-struct ArgumentException : std::runtime_error {
-  ArgumentException(std::string message)
-      : std::runtime_error(message.c_str()) {}
+  SearchResultContainer *container;
+  FileCheck check;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::unordered_map<EntryId, Candidate> candidates;
+  std::deque<EntryId> queue; // Candidates still to check.
+  size_t busy = 0;
+  bool stopped = false;
 };
 
-// Ordinarily we would use a test framework.
-// Since the problem specified no external libraries, we'll add it here.
-struct TestCommand {};
+/// @brief Identity and version of a file's contents.
+struct FileKey {
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  int64_t mtime = 0; // In nanoseconds.
 
-struct HelpCommand {
-  HelpCommand(std::string help_message) : message(help_message) {}
-  HelpCommand(const HelpCommand &command) : message(command.message) {}
-  std::string to_string() { return this->message; }
-  std::string message;
+  auto operator<=>(const FileKey &) const = default;
 };
 
-struct ArgParser {
-  std::string get_help_string(std::string exe_name = "file-finder") const {
-    return std::format(
-        "Usage: {0} <dir> <substring1>[<substring2> [<substring3>]...]\n"
-        "Traverses a directory tree and prints out any paths whose "
-        "filenames "
-        "contain the given substrings.\n"
-        R"(Example: {0} D:\\Documents\\Alice report book draft )"
-        "\n"
-        "Options\n"
-        "--help           Output usage message and exit.\n"
-        "--test           Run tests.\n"
-        "<dir>            Root directory to begin traversing.\n"
-        "<substring1..n>  Substring to search for in file names.",
-        exe_name);
+/// @brief Stats `path`, or returns nothing if it isn't a regular file.
+inline std::optional<FileKey> key_file(const fs::path &path) {
+#if defined(FILE_FINDER_POSIX)
+  struct stat info {};
+  if (::stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+    return std::nullopt;
+  }
+#if defined(__APPLE__)
+  const struct timespec &mtime = info.st_mtimespec;
+#else
+  const struct timespec &mtime = info.st_mtim;
+#endif
+  return FileKey{static_cast<uint64_t>(info.st_dev),
+                 static_cast<uint64_t>(info.st_ino),
+                 static_cast<uint64_t>(info.st_size),
+                 mtime.tv_sec * 1'000'000'000LL + mtime.tv_nsec};
+#else
+  std::error_code error;
+  if (!fs::is_regular_file(path, error)) {
+    return std::nullopt;
   }
+  // Without inodes, the path stands in for the file's identity.
+  FileKey key{0, fnv1a(fs::absolute(path).generic_string()),
+              fs::file_size(path, error),
+              to_nanoseconds(fs::last_write_time(path, error))};
+  if (error) {
+    return std::nullopt;
+  }
+  return key;
+#endif
+}
 
-  /// @brief Parses CLI arguments and returns SearchSettings (or other
-  /// command as appropriate).
-  /// @param args CLI arguments. The first argument is expected to be the
-  /// executable name.
-  /// @return If the second argument is --help or --test, returns the
-  /// corresponding command. Otherwise, returns settings for search as
-  /// derived from given arguments.
-  std::variant<SearchSettings, TestCommand, HelpCommand>
-  parse_args(const std::vector<std::string> &args) {
-    if (args.size() == 2) {
-      if (args[1] == "--help") {
-        return HelpCommand{this->get_help_string(args[0])};
-      } else if (args[1] == "--test") {
-        return TestCommand{};
+/// @brief Outcomes of content searches per file, keyed by the file's device,
+/// inode, size and modification time, with one cache file per searched
+/// text. The file is a sorted array of fixed size records, which lookups
+/// binary search in place in its memory mapping without taking a lock.
+/// Outcomes of files that weren't in it are collected under a lock and
+/// merged in by save(), which drops the records that weren't looked up.
+struct ContentCache {
+  static constexpr std::string_view magic = "FFCONT01";
+
+  ContentCache(const fs::path &cache_dir, std::string_view text) {
+    fs::create_directories(cache_dir);
+    this->path =
+        cache_dir / std::format("{:016x}.content", fnv1a(text));
+    if (!fs::exists(this->path)) {
+      return;
+    }
+    try {
+      this->file = std::make_unique<MappedFile>(this->path);
+      ByteReader reader(this->file->bytes());
+      if (reader.data.substr(0, magic.size()) != magic) {
+        throw IndexException("not a content cache");
+      }
+      reader.take(magic.size());
+      this->count = reader.fixed<uint64_t>();
+      if (this->count > (reader.data.size() - reader.pos) / sizeof(Record)) {
+        throw IndexException("truncated content cache");
       }
+      this->records = reader.take(this->count * sizeof(Record));
+      this->used = std::make_unique<std::atomic<uint8_t>[]>(this->count);
+    } catch (const IndexException &e) {
+      logger.info(std::format("ignoring cache \"{}\": {}",
+                              this->path.string(), e.what()));
+      this->count = 0;
+      this->records = {};
     }
+  }
 
-    if (args.size() < 3) {
-      if (args.size() == 0) {
-        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
-                                            this->get_help_string()));
+  /// @brief Returns whether the text was found in the file with `key`, or
+  /// nothing if that version of the file isn't cached.
+  std::optional<bool> find(const FileKey &key) {
+    size_t first = 0;
+    size_t last = this->count;
+    while (first < last) {
+      size_t middle = first + (last - first) / 2;
+      Record record = this->record(middle);
+      if (record.key < key) {
+        first = middle + 1;
       } else {
-        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
-                                            this->get_help_string(args[0])));
+        last = middle;
       }
     }
-
-    fs::path root = args[1];
-    if (!fs::exists(root)) {
-      throw ArgumentException(
-          std::format("Root path doesn't exist! (\"{}\")", root.string()));
+    if (first < this->count && this->record(first).key == key) {
+      this->used[first].store(1, std::memory_order_relaxed);
+      ++this->hits;
+      return this->record(first).found != 0;
     }
+    ++this->misses;
+    return std::nullopt;
+  }
 
-    SearchSettings settings{};
-    settings.root_dir = root;
-    for (auto itr : std::views::iota(std::begin(args) + 2, std::end(args))) {
-      settings.substrings.emplace_back(*itr);
-    }
+  void add(const FileKey &key, bool found) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->added.push_back({key, found});
+  }
 
-    return settings;
+  /// @brief Replaces the cache file with the records looked up or added.
+  void save() {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    std::vector<Record> records = this->added;
+    for (size_t i = 0; i < this->count; ++i) {
+      if (this->used[i].load(std::memory_order_relaxed)) {
+        records.push_back(this->record(i));
+      }
+    }
+    std::ranges::sort(records, {}, &Record::key);
+    auto duplicates = std::ranges::unique(records, {}, &Record::key);
+    records.erase(duplicates.begin(), duplicates.end());
+    ByteWriter header;
+    header.out.append(magic);
+    header.fixed<uint64_t>(records.size());
+    write_file_atomically(
+        this->path,
+        {header.out,
+         std::string_view(reinterpret_cast<const char *>(records.data()),
+                          records.size() * sizeof(Record))});
   }
-};
 
-int do_main(SearchSettings settings) {
-  logger.debug("do_main");
+  std::atomic_size_t hits = 0;
+  std::atomic_size_t misses = 0;
 
-  SearchResultContainer *container = new SearchResultContainer();
+private:
+  struct Record {
+    FileKey key;
+    uint64_t found = 0;
+  };
+  static_assert(sizeof(Record) == 40);
 
-  auto dump_period = std::chrono::milliseconds(9500); // ms_delay between dumps
-  std::function<int()> dump_func = [container, dump_period]() {
-    return container->periodic_dump(dump_period);
+  Record record(size_t i) const {
+    Record record;
+    std::memcpy(&record, this->records.data() + i * sizeof(Record),
+                sizeof(Record));
+    return record;
+  }
+
+  fs::path path;
+  std::unique_ptr<MappedFile> file;
+  std::string_view records; // Sorted by key.
+  size_t count = 0;
+  std::unique_ptr<std::atomic<uint8_t>[]> used; // Per record.
+  std::mutex mutex;
+  std::vector<Record> added;
+};
+
+/// @brief A compression format that content searches see through.
+enum struct Codec { None, Gzip, Xz, Zstd };
+
+/// @brief Reads a file in buffers, decompressing it on the way. Codec::None
+/// passes the bytes through. Each codec is only built in when its macro
+/// (FILE_FINDER_ZLIB, FILE_FINDER_LZMA or FILE_FINDER_ZSTD) is defined.
+struct DecompressedFile {
+  /// @brief Returns the codec of a file that starts with `head`, or None if
+  /// it isn't compressed with a codec that's built in.
+  static Codec detect([[maybe_unused]] std::string_view head) {
+#if defined(FILE_FINDER_ZLIB)
+    if (head.starts_with("\x1f\x8b"sv)) {
+      return Codec::Gzip;
+    }
+#endif
+#if defined(FILE_FINDER_LZMA)
+    if (head.starts_with("\xfd"
+                         "7zXZ\0"sv)) {
+      return Codec::Xz;
+    }
+#endif
+#if defined(FILE_FINDER_ZSTD)
+    if (head.starts_with("\x28\xb5\x2f\xfd"sv)) {
+      return Codec::Zstd;
+    }
+#endif
+    return Codec::None;
+  }
+
+  DecompressedFile(const fs::path &path, Codec codec)
+      : file(path, std::ios::binary), codec(codec), input(input_size) {
+    if (!this->file) {
+      throw IndexException(std::format("Unable to open \"{}\"", path.string()));
+    }
+    bool started = true;
+    switch (this->codec) {
+#if defined(FILE_FINDER_ZLIB)
+    case Codec::Gzip:
+      // 15 + 32: the largest window, with the gzip header detected.
+      started = inflateInit2(&this->gzip, 15 + 32) == Z_OK;
+      break;
+#endif
+#if defined(FILE_FINDER_LZMA)
+    case Codec::Xz:
+      started = lzma_stream_decoder(&this->xz, UINT64_MAX,
+                                    LZMA_CONCATENATED) == LZMA_OK;
+      break;
+#endif
+#if defined(FILE_FINDER_ZSTD)
+    case Codec::Zstd:
+      this->zstd = ZSTD_createDStream();
+      started = this->zstd != nullptr &&
+                !ZSTD_isError(ZSTD_initDStream(this->zstd));
+      break;
+#endif
+    default:
+      break;
+    }
+    if (!started) {
+      throw IndexException(
+          std::format("Unable to decompress \"{}\"", path.string()));
+    }
+  }
+
+  DecompressedFile(const DecompressedFile &) = delete;
+  DecompressedFile &operator=(const DecompressedFile &) = delete;
+
+  ~DecompressedFile() {
+    switch (this->codec) {
+#if defined(FILE_FINDER_ZLIB)
+    case Codec::Gzip:
+      inflateEnd(&this->gzip);
+      break;
+#endif
+#if defined(FILE_FINDER_LZMA)
+    case Codec::Xz:
+      lzma_end(&this->xz);
+      break;
+#endif
+#if defined(FILE_FINDER_ZSTD)
+    case Codec::Zstd:
+      ZSTD_freeDStream(this->zstd);
+      break;
+#endif
+    default:
+      break;
+    }
+  }
+
+  /// @brief Fills the start of `out` with the next bytes of the file and
+  /// returns how many; 0 once the file is done. A truncated file ends where
+  /// its data does. Throws IndexException on corrupt data.
+  size_t read(std::span<char> out) {
+    while (!this->finished) {
+      if (this->pending.empty() && !this->end_of_input) {
+        this->file.read(this->input.data(), this->input.size());
+        this->pending = std::span(this->input).first(this->file.gcount());
+        this->end_of_input = this->pending.size() < this->input.size();
+      }
+      size_t produced = this->decode(out);
+      if (produced > 0) {
+        return produced;
+      }
+      if (this->pending.empty() && this->end_of_input) {
+        this->finished = true;
+      }
+    }
+    return 0;
+  }
+
+private:
+  static constexpr size_t input_size = 64 * 1024;
+
+  /// @brief Decodes some of `pending` into `out` and returns the size of the
+  /// output.
+  size_t decode(std::span<char> out) {
+    switch (this->codec) {
+#if defined(FILE_FINDER_ZLIB)
+    case Codec::Gzip: {
+      this->gzip.next_in = reinterpret_cast<Bytef *>(this->pending.data());
+      this->gzip.avail_in = static_cast<uInt>(this->pending.size());
+      this->gzip.next_out = reinterpret_cast<Bytef *>(out.data());
+      this->gzip.avail_out = static_cast<uInt>(out.size());
+      int status = inflate(&this->gzip, Z_NO_FLUSH);
+      this->pending = this->pending.last(this->gzip.avail_in);
+      if (status == Z_STREAM_END) {
+        inflateReset(&this->gzip); // Another member may follow.
+      } else if (status != Z_OK && status != Z_BUF_ERROR) {
+        throw IndexException("Corrupt gzip data");
+      }
+      return out.size() - this->gzip.avail_out;
+    }
+#endif
+#if defined(FILE_FINDER_LZMA)
+    case Codec::Xz: {
+      this->xz.next_in = reinterpret_cast<uint8_t *>(this->pending.data());
+      this->xz.avail_in = this->pending.size();
+      this->xz.next_out = reinterpret_cast<uint8_t *>(out.data());
+      this->xz.avail_out = out.size();
+      lzma_ret status =
+          lzma_code(&this->xz, this->end_of_input ? LZMA_FINISH : LZMA_RUN);
+      this->pending = this->pending.last(this->xz.avail_in);
+      if (status == LZMA_STREAM_END) {
+        this->finished = true;
+      } else if (status != LZMA_OK && status != LZMA_BUF_ERROR) {
+        throw IndexException("Corrupt xz data");
+      }
+      return out.size() - this->xz.avail_out;
+    }
+#endif
+#if defined(FILE_FINDER_ZSTD)
+    case Codec::Zstd: {
+      ZSTD_inBuffer in{this->pending.data(), this->pending.size(), 0};
+      ZSTD_outBuffer decoded{out.data(), out.size(), 0};
+      size_t status = ZSTD_decompressStream(this->zstd, &decoded, &in);
+      if (ZSTD_isError(status)) {
+        throw IndexException(std::format("Corrupt zstd data: {}",
+                                         ZSTD_getErrorName(status)));
+      }
+      this->pending = this->pending.subspan(in.pos);
+      return decoded.pos;
+    }
+#endif
+    default: {
+      size_t size = std::min(out.size(), this->pending.size());
+      std::memcpy(out.data(), this->pending.data(), size);
+      this->pending = this->pending.subspan(size);
+      return size;
+    }
+    }
+  }
+
+  std::ifstream file;
+  Codec codec;
+  std::vector<char> input;
+  std::span<char> pending; // Read from the file, not yet decoded.
+  bool end_of_input = false;
+  bool finished = false;
+#if defined(FILE_FINDER_ZLIB)
+  z_stream gzip{};
+#endif
+#if defined(FILE_FINDER_LZMA)
+  lzma_stream xz = LZMA_STREAM_INIT;
+#endif
+#if defined(FILE_FINDER_ZSTD)
+  ZSTD_DStream *zstd = nullptr;
+#endif
+};
+
+/// @brief Returns whether the bytes read from `file` contain `text`. The file
+/// is decompressed a chunk at a time on the calling thread, and reading stops
+/// as soon as `text` is found.
+inline bool stream_contains(DecompressedFile &file, std::string_view text) {
+  constexpr size_t chunk_size = 256 * 1024;
+  std::boyer_moore_horspool_searcher searcher(text.begin(), text.end());
+  // The last text.size() - 1 bytes of a chunk are kept in front of the next
+  // one, to find `text` where it crosses between them.
+  size_t overlap = text.empty() ? 0 : text.size() - 1;
+  std::vector<char> buffer(overlap + chunk_size);
+  size_t carried = 0;
+  while (size_t size = file.read(std::span(buffer).subspan(carried))) {
+    auto end = buffer.begin() + carried + size;
+    if (std::search(buffer.begin(), end, searcher) != end) {
+      return true;
+    }
+    size_t kept = std::min(overlap, carried + size);
+    std::memmove(buffer.data(), std::to_address(end - kept), kept);
+    carried = kept;
+  }
+  return false;
+}
+
+/// @brief Returns a check that passes the files containing `text`, answered
+/// from `cache` (if any) for files that didn't change since they were last
+/// searched.
+inline FileCheck content_check(std::string text, ContentCache *cache) {
+  return [text = std::move(text), cache](const std::vector<fs::path> &paths) {
+    std::boyer_moore_horspool_searcher searcher(text.begin(), text.end());
+    std::vector<char> verdicts(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      std::optional<FileKey> key = key_file(paths[i]);
+      if (!key) {
+        continue;
+      }
+      if (cache != nullptr) {
+        if (std::optional<bool> found = cache->find(*key)) {
+          verdicts[i] = *found;
+          continue;
+        }
+      }
+      try {
+        MappedFile file(paths[i]);
+        std::string_view bytes = file.bytes();
+        if (Codec codec = DecompressedFile::detect(bytes);
+            codec != Codec::None) {
+          DecompressedFile decompressed(paths[i], codec);
+          verdicts[i] = stream_contains(decompressed, text);
+        } else {
+          verdicts[i] =
+              std::search(bytes.begin(), bytes.end(), searcher) != bytes.end();
+        }
+      } catch (const IndexException &) {
+        continue; // Unreadable files don't match, and aren't cached.
+      }
+      // A file that changed while it was read is searched again next time.
+      if (cache != nullptr && key_file(paths[i]) == key) {
+        cache->add(*key, verdicts[i]);
+      }
+    }
+    return verdicts;
   };
-  std::packaged_task<int()> dump(dump_func);
-  std::thread dump_thread(std::move(dump));
+}
 
-  std::vector<std::thread> processor_threads;
-  std::vector<Processor> *processors = new std::vector<Processor>();
-  uint32_t index = 0;
-  for (std::string substring : settings.substrings) {
-    processors->emplace_back(container, substring);
-    std::function<int()> fun = [processors, index]() {
-      return (*processors)[index].run();
+#pragma endregion Contents
+
+#pragma region Magic
+
+/// @brief A file signature: `bytes` at `offset` from the start of the file.
+struct MagicSignature {
+  std::string_view type; // Short name, e.g. "pdf".
+  std::string_view mime;
+  size_t offset;
+  std::string_view bytes;
+};
+
+inline constexpr MagicSignature magic_signatures[] = {
+    {"pdf", "application/pdf", 0, "%PDF-"sv},
+    {"png", "image/png", 0, "\x89PNG\r\n\x1A\n"sv},
+    {"jpeg", "image/jpeg", 0, "\xFF\xD8\xFF"sv},
+    {"gif", "image/gif", 0, "GIF87a"sv},
+    {"gif", "image/gif", 0, "GIF89a"sv},
+    {"webp", "image/webp", 8, "WEBPVP8"sv},
+    {"tiff", "image/tiff", 0, "II*\0"sv},
+    {"tiff", "image/tiff", 0, "MM\0*"sv},
+    {"bmp", "image/bmp", 0, "BM"sv},
+    {"mp4", "video/mp4", 4, "ftyp"sv},
+    {"mp3", "audio/mpeg", 0, "ID3"sv},
+    {"ogg", "audio/ogg", 0, "OggS"sv},
+    {"zip", "application/zip", 0, "PK\x03\x04"sv},
+    {"zip", "application/zip", 0, "PK\x05\x06"sv},
+    {"gzip", "application/gzip", 0, "\x1F\x8B"sv},
+    {"bzip2", "application/x-bzip2", 0, "BZh"sv},
+    {"xz", "application/x-xz", 0, "\xFD" "7zXZ\0"sv},
+    {"zstd", "application/zstd", 0, "\x28\xB5\x2F\xFD"sv},
+    {"7z", "application/x-7z-compressed", 0, "7z\xBC\xAF\x27\x1C"sv},
+    {"rar", "application/vnd.rar", 0, "Rar!\x1A\x07"sv},
+    {"tar", "application/x-tar", 257, "ustar"sv},
+    {"elf", "application/x-executable", 0, "\x7F" "ELF"sv},
+    {"pe", "application/vnd.microsoft.portable-executable", 0, "MZ"sv},
+    {"sqlite", "application/vnd.sqlite3", 0, "SQLite format 3\0"sv},
+    {"ole", "application/x-ole-storage", 0,
+     "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1"sv},
+};
+
+/// @brief Classifies the head of a file by the signatures above, with one
+/// byte trie per signature offset. The longest signature that matches wins.
+struct MagicClassifier {
+  /// @brief Bytes of a file needed to classify it.
+  static constexpr size_t head_size = 264;
+
+  MagicClassifier() {
+    for (size_t i = 0; i < std::size(magic_signatures); ++i) {
+      const MagicSignature &signature = magic_signatures[i];
+      auto trie = std::ranges::find(this->tries, signature.offset,
+                                    &Trie::offset);
+      if (trie == this->tries.end()) {
+        trie = this->tries.insert(trie, Trie{signature.offset});
+      }
+      trie->add(signature.bytes, static_cast<int>(i));
+    }
+  }
+
+  /// @brief Returns the signature that `head` starts with, or nullptr.
+  const MagicSignature *classify(std::string_view head) const {
+    const MagicSignature *best = nullptr;
+    for (const Trie &trie : this->tries) {
+      if (trie.offset >= head.size()) {
+        continue;
+      }
+      int found = trie.match(head.substr(trie.offset));
+      if (found >= 0 && (best == nullptr ||
+                         magic_signatures[found].bytes.size() >
+                             best->bytes.size())) {
+        best = &magic_signatures[found];
+      }
+    }
+    return best;
+  }
+
+  /// @brief Whether `type` names a known type, by short name or MIME type.
+  static bool is_type(std::string_view type) {
+    return std::ranges::any_of(magic_signatures,
+                               [type](const MagicSignature &signature) {
+                                 return signature.type == type ||
+                                        signature.mime == type;
+                               });
+  }
+
+  /// @brief Reads the first bytes of each of `paths`; "" for files that
+  /// can't be read.
+  static std::vector<std::string> read_heads(
+      const std::vector<fs::path> &paths) {
+    std::vector<std::string> heads(paths.size());
+#if defined(FILE_FINDER_POSIX)
+    std::vector<int> fds(paths.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      fds[i] = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+#if defined(POSIX_FADV_WILLNEED)
+      if (fds[i] >= 0) {
+        ::posix_fadvise(fds[i], 0, MagicClassifier::head_size,
+                        POSIX_FADV_WILLNEED);
+      }
+#endif
+    }
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (fds[i] < 0) {
+        continue;
+      }
+      heads[i].resize(MagicClassifier::head_size);
+      ssize_t size = ::pread(fds[i], heads[i].data(), heads[i].size(), 0);
+      heads[i].resize(size > 0 ? static_cast<size_t>(size) : 0);
+      ::close(fds[i]);
+    }
+#else
+    for (size_t i = 0; i < paths.size(); ++i) {
+      std::ifstream file(paths[i], std::ios::binary);
+      heads[i].resize(MagicClassifier::head_size);
+      file.read(heads[i].data(), heads[i].size());
+      heads[i].resize(static_cast<size_t>(file.gcount()));
+    }
+#endif
+    return heads;
+  }
+
+
+  /// @brief Returns a check that passes the files of one of `types` (short
+  /// names or MIME types).
+  static FileCheck check(std::vector<std::string> types) {
+    auto classifier = std::make_shared<const MagicClassifier>();
+    return [types = std::move(types),
+            classifier](const std::vector<fs::path> &paths) {
+      std::vector<std::string> heads = read_heads(paths);
+      std::vector<char> verdicts(paths.size());
+      for (size_t i = 0; i < paths.size(); ++i) {
+        const MagicSignature *signature = classifier->classify(heads[i]);
+        verdicts[i] =
+            signature != nullptr &&
+            std::ranges::any_of(types, [signature](const std::string &type) {
+              return signature->type == type || signature->mime == type;
+            });
+      }
+      return verdicts;
     };
-    std::thread processor_thread(std::move(fun));
-    processor_threads.emplace_back(std::move(processor_thread));
-    ++index;
   }
 
-  PathFinder *path_finder = new PathFinder();
-  std::function<int()> search_func = [path_finder, settings, processors]() {
-    using DirOptions = fs::directory_options;
-    return path_finder->list_paths(settings.root_dir, processors,
-                                   (settings.follow_links
-                                        ? DirOptions::follow_directory_symlink
-                                        : DirOptions::none) |
-                                       DirOptions::skip_permission_denied);
+private:
+  struct Trie {
+    struct Node {
+      std::vector<std::pair<uint8_t, uint32_t>> children; // Sorted by byte.
+      int signature = -1;
+    };
+
+    void add(std::string_view bytes, int signature) {
+      uint32_t node = 0;
+      for (char c : bytes) {
+        uint8_t byte = static_cast<uint8_t>(c);
+        auto &children = this->nodes[node].children;
+        auto child = std::ranges::lower_bound(
+            children, byte, {}, &std::pair<uint8_t, uint32_t>::first);
+        if (child == children.end() || child->first != byte) {
+          uint32_t next = static_cast<uint32_t>(this->nodes.size());
+          children.insert(child, {byte, next});
+          this->nodes.emplace_back();
+          node = next;
+        } else {
+          node = child->second;
+        }
+      }
+      this->nodes[node].signature = signature;
+    }
+
+    /// @brief Returns the longest signature that `data` starts with, or -1.
+    int match(std::string_view data) const {
+      int found = -1;
+      uint32_t node = 0;
+      for (char c : data) {
+        const auto &children = this->nodes[node].children;
+        auto child = std::ranges::lower_bound(
+            children, static_cast<uint8_t>(c), {},
+            &std::pair<uint8_t, uint32_t>::first);
+        if (child == children.end() ||
+            child->first != static_cast<uint8_t>(c)) {
+          break;
+        }
+        node = child->second;
+        if (this->nodes[node].signature >= 0) {
+          found = this->nodes[node].signature;
+        }
+      }
+      return found;
+    }
+
+    size_t offset = 0;
+    std::vector<Node> nodes{1};
   };
-  std::packaged_task<int()> search_task(search_func);
-  std::future search_future = search_task.get_future();
-  std::thread search_thread(std::move(search_task));
 
-  std::atomic_bool should_continue = true;
+  std::vector<Trie> tries; // Sorted by offset.
+};
 
-  auto stop_func = [&should_continue, &path_finder, &processors, &container]() {
-    logger.info("ending");
-    should_continue = false;
-    path_finder->should_continue = false;
-    for (Processor &processor : *processors) {
-      processor.should_continue = false;
+#pragma endregion Magic
+
+/// @brief File names packed one after another, to be matched together by a
+/// BatchMatcher.
+struct NameChunk {
+  void add(std::string_view name) {
+    this->bytes.append(name);
+    this->ends.push_back(this->bytes.size());
+  }
+
+  void clear() {
+    this->bytes.clear();
+    this->ends.clear();
+  }
+
+  size_t size() const { return this->ends.size(); }
+
+  std::string bytes;
+  std::vector<size_t> ends; // End of each name in `bytes`.
+};
+
+/// @brief Finds which of a run of packed names contain a substring. Rather
+/// than searching name by name, it scans the packed bytes for positions where
+/// both the first and the last byte of the substring line up, 16 positions per
+/// SSE2 compare (so many short names at once), then confirms each candidate
+/// within the name it starts in. Without SSE2 the same scan is done a byte at
+/// a time.
+struct BatchMatcher {
+  BatchMatcher(std::string pattern) : pattern(std::move(pattern)) {}
+
+  /// @brief Matches the names whose ends are `ends`, packed in `bytes` from
+  /// `begin` on. Bit i of the result is set if name i contains the pattern.
+  std::vector<uint64_t> match(std::string_view bytes,
+                              std::span<const size_t> ends,
+                              size_t begin = 0) const {
+    std::vector<uint64_t> matches((ends.size() + 63) / 64);
+    size_t length = this->pattern.size();
+    if (ends.empty()) {
+      return matches;
+    } else if (length == 0) {
+      for (size_t name = 0; name < ends.size(); ++name) {
+        matches[name / 64] |= uint64_t{1} << (name % 64);
+      }
+      return matches;
     }
-    container->should_continue = false;
+    const char *data = bytes.data();
+    size_t end = ends.back();
+    size_t name = 0;          // Name holding the latest candidate.
+    size_t skip_until = 0;    // Rest of a name that already matched.
+    auto candidate = [&](size_t start) {
+      if (start < skip_until) {
+        return;
+      }
+      while (ends[name] <= start) {
+        ++name;
+      }
+      if (start + length <= ends[name] &&
+          std::memcmp(data + start, this->pattern.data(), length) == 0) {
+        matches[name / 64] |= uint64_t{1} << (name % 64);
+        skip_until = ends[name];
+      }
+    };
+
+    size_t start = begin;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(this->pattern.front());
+    const __m128i last = _mm_set1_epi8(this->pattern.back());
+    for (; start + length - 1 + 16 <= end; start += 16) {
+      __m128i heads = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(data + start));
+      __m128i tails = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(data + start + length - 1));
+      unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(
+          _mm_cmpeq_epi8(heads, first), _mm_cmpeq_epi8(tails, last))));
+      for (; mask != 0; mask &= mask - 1) {
+        candidate(start + std::countr_zero(mask));
+      }
+    }
+#endif
+    for (; start + length <= end; ++start) {
+      if (data[start] == this->pattern.front() &&
+          data[start + length - 1] == this->pattern.back()) {
+        candidate(start);
+      }
+    }
+    return matches;
+  }
+
+  /// @brief Matches the names of `chunk`.
+  std::vector<uint64_t> match(const NameChunk &chunk) const {
+    return this->match(chunk.bytes, chunk.ends);
+  }
+
+private:
+  std::string pattern;
+};
+
+/// @brief Stores every distinct file name once under a dense id, which
+/// entries carry instead of a copy of their name. For each name it also
+/// remembers which patterns were matched against it and which of them
+/// matched, so a name that repeats (index.js, __init__.py, .DS_Store) is only
+/// scanned once per pattern however many files have it. The walker keeps a
+/// second dictionary for the paths of the files' folders. Thread safe.
+struct NameDictionary {
+  /// @param capacity Names it holds at most (rounded up to whole chunks).
+  explicit NameDictionary(size_t capacity = max_names)
+      : capacity(std::min(capacity, max_names)),
+        chunks((this->capacity + chunk_size - 1) / chunk_size) {}
+  NameDictionary(const NameDictionary &) = delete;
+  NameDictionary &operator=(const NameDictionary &) = delete;
+
+  ~NameDictionary() {
+    for (std::atomic<Name *> &chunk : this->chunks) {
+      delete[] chunk.load();
+    }
+  }
+
+  /// @brief Returns the id of `name`, adding it if it's new, or no_name once
+  /// the dictionary is full.
+  NameId intern(std::string_view name) {
+    Shard &shard =
+        this->shards[std::hash<std::string_view>{}(name) % shard_count];
+    std::scoped_lock<std::mutex> lock(shard.mutex);
+    if (auto found = shard.ids.find(name); found != shard.ids.end()) {
+      return found->second;
+    }
+    // Shards take ids concurrently, so the limit is checked on the id taken.
+    size_t taken = this->next_id.fetch_add(1);
+    if (taken >= this->capacity) {
+      return no_name;
+    }
+    NameId id = static_cast<NameId>(taken);
+    std::atomic<Name *> &chunk = this->chunks[id / chunk_size];
+    if (chunk.load(std::memory_order_acquire) == nullptr) {
+      std::scoped_lock<std::mutex> chunk_lock(this->chunk_mutex);
+      if (chunk.load(std::memory_order_relaxed) == nullptr) {
+        chunk.store(new Name[chunk_size], std::memory_order_release);
+      }
+    }
+    Name &entry = this->entry(id);
+    entry.text = name;
+    shard.ids.emplace(entry.text, id);
+    return id;
+  }
+
+  /// @brief The name interned as `id`.
+  std::string_view name(NameId id) const { return this->entry(id).text; }
+
+  /// @brief Returns whether name `id` contains `target`, which is pattern
+  /// `pattern`. Only the first call for a name and pattern scans the name.
+  bool contains(NameId id, size_t pattern, std::string_view target) {
+    Name &name = this->entry(id);
+    if (pattern >= 64) { // Beyond the masks: scanned every time.
+      ++this->scans;
+      return name.text.find(target) != std::string::npos;
+    }
+    uint64_t bit = uint64_t{1} << pattern;
+    if ((name.evaluated.load(std::memory_order_acquire) & bit) == 0) {
+      ++this->scans;
+      if (name.text.find(target) != std::string::npos) {
+        name.matched.fetch_or(bit, std::memory_order_relaxed);
+      }
+      // Published after `matched`, so that readers of the bit see it.
+      name.evaluated.fetch_or(bit, std::memory_order_release);
+    }
+    return (name.matched.load(std::memory_order_relaxed) & bit) != 0;
+  }
+
+  size_t size() const {
+    return std::min(this->next_id.load(), this->capacity);
+  }
+
+  std::atomic_size_t scans = 0; // Names actually matched against a pattern.
+
+private:
+  static constexpr size_t shard_count = 64;
+  static constexpr size_t chunk_size = 4096;
+  static constexpr size_t max_names = size_t{1} << 26;
+
+  struct Name {
+    std::string text;
+    std::atomic<uint64_t> evaluated = 0; // Patterns matched against it.
+    std::atomic<uint64_t> matched = 0;   // Patterns it contains.
   };
 
-  // Wait until all threads have started.
-  bool ready = false;
-  while (!ready) {
-    ready = should_continue;
-    ready &= path_finder->should_continue;
-    for (Processor &processor : *processors) {
-      ready &= processor.should_continue;
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<std::string_view, NameId> ids; // Views of Name::text.
+  };
+
+  Name &entry(NameId id) const {
+    return this->chunks[id / chunk_size].load(
+        std::memory_order_acquire)[id % chunk_size];
+  }
+
+  size_t capacity;
+  std::array<Shard, shard_count> shards;
+  // Names are allocated a chunk at a time and never move.
+  std::vector<std::atomic<Name *>> chunks;
+  std::mutex chunk_mutex;
+  std::atomic<size_t> next_id = 0;
+};
+
+struct Processor {
+  /// @param pattern Id of `search_string` in the container's patterns.
+  Processor(SearchResultContainer *container, size_t pattern,
+            std::string search_string)
+      : target(search_string), pattern(pattern), container(container),
+        matcher(search_string) {}
+
+  Processor(Processor &&processor)
+      : target(std::move(processor.target)), pattern(processor.pattern),
+        queue(std::move(processor.queue)),
+        interned(std::move(processor.interned)),
+        container(processor.container), throttle(processor.throttle),
+        filter(processor.filter), names(processor.names),
+        folders(processor.folders), matcher(processor.matcher) {}
+
+  std::deque<std::pair<EntryId, fs::directory_entry>> queue;
+  // Entries pushed as ids: (entry, name in `names`, parent in `folders`).
+  std::deque<std::tuple<EntryId, NameId, NameId>> interned;
+  SearchResultContainer *container;
+  Throttle *throttle = nullptr; // Optional CPU limit and pause.
+  FileFilter *filter = nullptr; // Optional check of the matches' contents.
+  // Dictionaries of the file names and folder paths of the interned entries.
+  // Required to push them.
+  NameDictionary *names = nullptr;
+  NameDictionary *folders = nullptr;
+
+  void push(EntryId id, fs::directory_entry entry) {
+    std::scoped_lock<std::mutex> lock(queue_mutex);
+    logger.debug(std::format("push {}", entry.path().string()));
+    this->queue.emplace_back(id, entry);
+  }
+
+  /// @brief Queues an entry by the ids of its name and its folder's path. Its
+  /// path is only put together again if the name matches.
+  void push(EntryId id, NameId name, NameId folder) {
+    std::scoped_lock<std::mutex> lock(queue_mutex);
+    this->interned.emplace_back(id, name, folder);
+  }
+
+  size_t queue_size() {
+    std::scoped_lock<std::mutex> lock(queue_mutex);
+    return queue.size() + interned.size();
+  }
+
+  int run(std::chrono::milliseconds resolution = std::chrono::milliseconds{
+              500}) {
+    this->should_continue = true;
+    this->container->set_thread(this->pattern, std::this_thread::get_id());
+    logger.debug("processor start");
+    while (this->should_continue) {
+      if (this->throttle != nullptr) {
+        this->throttle->wait_while_paused();
+      }
+      logger.debug(std::format("proc size: {}", this->queue_size()));
+      this->process();
+      if (this->throttle != nullptr) {
+        this->throttle->check_cpu();
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(resolution));
+    }
+    logger.debug("processor end");
+    return 0;
+  }
+
+  /// @brief Matches the queued entries a chunk at a time. The names of a
+  /// chunk are packed together and matched in one pass by the BatchMatcher.
+  /// Interned entries are answered by the dictionary instead.
+  void process() {
+    std::scoped_lock<std::mutex> lock(queue_mutex);
+    while (this->queue.size() > 0) {
+      size_t count = std::min(this->queue.size(), chunk_size);
+      logger.debug(std::format("processing {} entries vs \"{}\"", count,
+                               this->target));
+      this->chunk.clear();
+      for (size_t i = 0; i < count; ++i) {
+        this->chunk.add(this->queue[i].second.path().filename().string());
+      }
+      std::vector<uint64_t> matches = this->matcher.match(this->chunk);
+      for (size_t i = 0; i < count; ++i) {
+        if ((matches[i / 64] >> (i % 64) & 1) != 0) {
+          this->found(this->queue[i].first, this->queue[i].second.path());
+        }
+      }
+      this->queue.erase(this->queue.begin(), this->queue.begin() + count);
+    }
+    for (const auto &[id, name, folder] : this->interned) {
+      if (this->names->contains(name, this->pattern, this->target)) {
+        this->found(id, fs::path(this->folders->name(folder)) /
+                            this->names->name(name));
+      }
+    }
+    this->interned.clear();
+  }
+
+  const std::string target;
+  const size_t pattern;
+  std::atomic_bool should_continue{false};
+
+private:
+  static constexpr size_t chunk_size = 256; // Entries matched together.
+
+  void found(EntryId id, const fs::path &path) {
+    logger.debug(std::format("found {}", path.string()));
+    if (this->filter != nullptr) {
+      this->filter->post(SearchResult{id, this->pattern}, path);
+    } else {
+      this->container->push(SearchResult{id, this->pattern}, path);
+    }
+  }
+
+  std::mutex queue_mutex;
+  BatchMatcher matcher;
+  NameChunk chunk; // Names of the chunk being matched, reused.
+};
+
+#pragma region ResultCache
+
+/// @brief Identity and modification stamp of a folder. It changes whenever an
+/// entry is added to, removed from or renamed within the folder (mtime), the
+/// folder's own metadata changes (ctime) or the folder is replaced (inode).
+struct FolderStamp {
+  int64_t mtime = 0;
+  int64_t ctime = 0;
+  uint64_t inode = 0;
+
+  bool operator==(const FolderStamp &) const = default;
+};
+
+/// @brief Stats `path` without reading it, or returns nothing if it can't be.
+inline std::optional<FolderStamp> stamp_folder(const fs::path &path) {
+#if defined(__linux__) && defined(STATX_INO)
+  struct statx info {};
+  if (::statx(AT_FDCWD, path.c_str(), 0,
+              STATX_MTIME | STATX_CTIME | STATX_INO, &info) != 0) {
+    return std::nullopt;
+  }
+  return FolderStamp{info.stx_mtime.tv_sec * 1'000'000'000LL +
+                         info.stx_mtime.tv_nsec,
+                     info.stx_ctime.tv_sec * 1'000'000'000LL +
+                         info.stx_ctime.tv_nsec,
+                     info.stx_ino};
+#else
+  std::error_code error;
+  fs::file_time_type mtime = fs::last_write_time(path, error);
+  if (error) {
+    return std::nullopt;
+  }
+  FolderStamp stamp{to_nanoseconds(mtime)};
+#if defined(FILE_FINDER_POSIX)
+  struct stat info {};
+  if (::stat(path.c_str(), &info) != 0) {
+    return std::nullopt;
+  }
+  stamp.ctime = static_cast<int64_t>(info.st_ctime);
+  stamp.inode = static_cast<uint64_t>(info.st_ino);
+#endif
+  return stamp;
+#endif
+}
+
+/// @brief Matches of a previous search, per folder, stored in a cache folder.
+/// A search with the same root, substrings (in any order) and options only
+/// reads the folders whose stamp changed since; the matches of the others are
+/// replayed from the cache. Matching is by name only, so a folder's matches
+/// can't change without its stamp changing.
+struct ResultCache {
+  struct Folder {
+    FolderStamp stamp;
+    std::vector<std::string> folders; // Names of the subfolders to descend.
+    // File name -> matched substrings, by position in the sorted substrings.
+    std::map<std::string, PatternMask> matches;
+  };
+
+  ResultCache(const fs::path &cache_dir, const fs::path &root,
+              const std::vector<std::string> &patterns,
+              std::string_view options, SearchResultContainer *container)
+      : container(container) {
+    std::vector<std::string> sorted = patterns;
+    std::ranges::sort(sorted);
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    for (const std::string &pattern : patterns) {
+      this->normalized.push_back(
+          std::ranges::lower_bound(sorted, pattern) - sorted.begin());
+    }
+    this->key = fs::absolute(root).lexically_normal().generic_string();
+    this->key.append(1, '\0').append(options);
+    for (const std::string &pattern : sorted) {
+      this->key.append(1, '\0').append(pattern);
+    }
+    fs::create_directories(cache_dir);
+    this->path = cache_dir / std::format("{:016x}.cache", fnv1a(this->key));
+    try {
+      this->load();
+    } catch (const IndexException &e) {
+      logger.info(std::format("ignoring cache \"{}\": {}",
+                              this->path.string(), e.what()));
+      this->previous.clear();
+    }
+  }
+
+  /// @brief Returns the cached record of `folder` (relative to the root) if
+  /// the folder is unchanged, otherwise nullptr.
+  const Folder *find(const std::string &folder,
+                     const FolderStamp &stamp) const {
+    auto itr = this->previous.find(folder);
+    if (itr == this->previous.end() || itr->second.stamp != stamp) {
+      return nullptr;
+    }
+    return &itr->second;
+  }
+
+  /// @brief Carries an unchanged folder over to the next cache and pushes its
+  /// cached matches to the container, numbering them from `next_id`.
+  void replay(const std::string &folder, const Folder &cached,
+              const fs::path &folder_path, std::atomic<EntryId> &next_id) {
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->next.emplace_back(folder, cached);
+      ++this->folders_reused;
+    }
+    for (const auto &[name, mask] : cached.matches) {
+      EntryId id = next_id++;
+      for (size_t pattern = 0; pattern < this->normalized.size(); ++pattern) {
+        if (mask.test(this->normalized[pattern])) {
+          this->container->push(SearchResult{id, pattern}, folder_path / name);
+        }
+      }
+    }
+  }
+
+  /// @brief Starts the record of a folder that was read again.
+  /// @return Id to assign the folder's files to.
+  uint32_t add(const std::string &folder, FolderStamp stamp,
+               std::vector<std::string> folders) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->next.emplace_back(folder, Folder{stamp, std::move(folders)});
+    ++this->folders_read;
+    return static_cast<uint32_t>(this->next.size() - 1);
+  }
+
+  /// @brief Notes that entry `id` is a file of folder record `record`.
+  void assign(EntryId id, uint32_t record) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    if (this->entry_records.size() <= id) {
+      this->entry_records.resize(id + 1, unassigned);
+    }
+    this->entry_records[id] = record;
+  }
+
+  /// @brief Records a match of a file assigned to a folder record. Replayed
+  /// matches aren't assigned and are ignored.
+  void record(SearchResult result, const fs::path &path) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    if (result.entry >= this->entry_records.size() ||
+        this->entry_records[result.entry] == unassigned) {
+      return;
+    }
+    Folder &folder = this->next[this->entry_records[result.entry]].second;
+    folder.matches[path.filename().string()].set(
+        this->normalized[result.pattern]);
+  }
+
+  /// @brief Replaces the cache file with the folders seen by this search.
+  /// Only call this after a search that ran to completion.
+  void save() {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    ByteWriter file;
+    file.out.append(magic);
+    file.string(this->key);
+    file.fixed<uint32_t>(static_cast<uint32_t>(this->next.size()));
+    for (const auto &[name, folder] : this->next) {
+      file.string(name);
+      file.fixed<int64_t>(folder.stamp.mtime);
+      file.fixed<int64_t>(folder.stamp.ctime);
+      file.fixed<uint64_t>(folder.stamp.inode);
+      file.fixed<uint32_t>(static_cast<uint32_t>(folder.folders.size()));
+      for (const std::string &child : folder.folders) {
+        file.string(child);
+      }
+      file.fixed<uint32_t>(static_cast<uint32_t>(folder.matches.size()));
+      for (const auto &[match, mask] : folder.matches) {
+        file.string(match);
+        mask.write(file);
+      }
+    }
+    write_file_atomically(this->path, {file.out});
+  }
+
+  size_t folders_reused = 0;
+  size_t folders_read = 0;
+
+private:
+  void load() {
+    if (!fs::exists(this->path)) {
+      return;
+    }
+    MappedFile file(this->path);
+    ByteReader reader(file.bytes());
+    if (reader.take(magic.size()) != magic || reader.string() != this->key) {
+      throw IndexException("not a cache of this search");
+    }
+    uint32_t folder_count = reader.fixed<uint32_t>();
+    for (uint32_t i = 0; i < folder_count; ++i) {
+      std::string name(reader.string());
+      Folder &folder = this->previous[name];
+      folder.stamp.mtime = reader.fixed<int64_t>();
+      folder.stamp.ctime = reader.fixed<int64_t>();
+      folder.stamp.inode = reader.fixed<uint64_t>();
+      uint32_t child_count = reader.fixed<uint32_t>();
+      for (uint32_t j = 0; j < child_count; ++j) {
+        folder.folders.emplace_back(reader.string());
+      }
+      uint32_t match_count = reader.fixed<uint32_t>();
+      for (uint32_t j = 0; j < match_count; ++j) {
+        std::string match(reader.string());
+        folder.matches[match] = PatternMask::read(reader);
+      }
+    }
+  }
+
+  static constexpr std::string_view magic = "FFCACHE2";
+  static constexpr uint32_t unassigned = std::numeric_limits<uint32_t>::max();
+
+  fs::path path;
+  std::string key; // Root, options and sorted substrings.
+  std::vector<size_t> normalized; // Substring position -> sorted position.
+  SearchResultContainer *container;
+  std::unordered_map<std::string, Folder> previous;
+  std::vector<std::pair<std::string, Folder>> next;
+  std::vector<uint32_t> entry_records; // Entry id -> index into `next`.
+  std::mutex mutex;
+};
+
+#pragma endregion ResultCache
+
+/// @brief The files and the names of the subfolders to descend into of one
+/// folder.
+struct FolderListing {
+  std::vector<fs::directory_entry> files;
+  std::vector<std::string> folders;
+};
+
+inline FolderListing list_folder(const fs::path &path,
+                                 fs::directory_options options) {
+  bool follow_links =
+      (options & fs::directory_options::follow_directory_symlink) !=
+      fs::directory_options::none;
+  FolderListing listing;
+  std::error_code error;
+  for (fs::directory_iterator itr(path, options, error), end;
+       !error && itr != end; itr.increment(error)) {
+    std::error_code entry_error;
+    if (itr->is_directory(entry_error)) { // Ignore folders.
+      if (follow_links || !itr->is_symlink(entry_error)) {
+        listing.folders.push_back(itr->path().filename().string());
+      }
+      continue;
+    }
+    listing.files.push_back(*itr);
+  }
+  return listing;
+}
+
+/// @brief Runs file system operations on expendable worker threads, each
+/// with a deadline. A worker that misses it (e.g. stuck on a dead network
+/// mount) is abandoned, so the caller can skip the operation and carry on.
+/// Callers on different threads get different workers.
+struct FolderReader {
+  FolderReader(std::chrono::milliseconds deadline) : deadline(deadline) {}
+  FolderReader(const FolderReader &) = delete;
+  FolderReader &operator=(const FolderReader &) = delete;
+  ~FolderReader() {
+    for (std::shared_ptr<Worker> &worker : this->idle) {
+      worker->retire();
+    }
+  }
+
+  /// @return The result of `operation`, or nothing if it missed the deadline
+  /// or `should_continue` turned false while waiting for it.
+  template <typename T>
+  std::optional<T> run(std::function<T()> operation,
+                       const std::atomic_bool &should_continue) {
+    std::shared_ptr<Worker> worker;
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      if (this->idle.empty()) {
+        worker = Worker::start();
+      } else {
+        worker = std::move(this->idle.back());
+        this->idle.pop_back();
+      }
+    }
+    auto task = std::make_shared<std::packaged_task<T()>>(std::move(operation));
+    std::future<T> result = task->get_future();
+    worker->post([task]() { (*task)(); });
+    auto deadline = std::chrono::steady_clock::now() + this->deadline;
+    while (result.wait_for(std::chrono::milliseconds{50}) !=
+           std::future_status::ready) {
+      if (!should_continue || std::chrono::steady_clock::now() >= deadline) {
+        // The worker may never return. It only holds on to its own state.
+        worker->retire();
+        ++this->abandoned;
+        return std::nullopt;
+      }
+    }
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->idle.push_back(std::move(worker));
+    }
+    return result.get();
+  }
+
+  std::atomic_size_t abandoned = 0; // Workers abandoned so far.
+
+private:
+  struct Worker {
+    static std::shared_ptr<Worker> start() {
+      auto worker = std::make_shared<Worker>();
+      std::thread([worker]() { worker->loop(); }).detach();
+      return worker;
+    }
+
+    void post(std::function<void()> job) {
+      {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        this->jobs.push(std::move(job));
+      }
+      this->wake.notify_one();
+    }
+
+    /// @brief Lets the thread end once its current job (if any) returns.
+    void retire() {
+      {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        this->retired = true;
+      }
+      this->wake.notify_one();
+    }
+
+    void loop() {
+      while (true) {
+        std::function<void()> job;
+        {
+          std::unique_lock<std::mutex> lock(this->mutex);
+          this->wake.wait(lock, [this]() {
+            return this->retired || !this->jobs.empty();
+          });
+          if (this->retired) {
+            return;
+          }
+          job = std::move(this->jobs.front());
+          this->jobs.pop();
+        }
+        job();
+      }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::queue<std::function<void()>> jobs;
+    bool retired = false;
+  };
+
+  std::chrono::milliseconds deadline;
+  std::mutex mutex;
+  std::vector<std::shared_ptr<Worker>> idle;
+};
+
+/// @brief What the previous search of a root learned about its folders: file
+/// counts, read times and which subtrees had matches. Walkers use it to start
+/// the most expensive subtrees first, so that no huge subtree is left for
+/// last, and optionally the subtrees that had matches before. The current
+/// search's numbers replace it once the search completes.
+struct TraversalProfile {
+  struct Folder {
+    uint64_t files = 0;
+    uint64_t read_micros = 0;
+    std::vector<std::string> folders; // Subfolders, relative to the root.
+    // Totals over the folder and everything below it.
+    uint64_t subtree_entries = 0;
+    uint64_t subtree_micros = 0;
+    bool subtree_matched = false;
+  };
+
+  TraversalProfile(const fs::path &path, const fs::path &root)
+      : path(path), root(fs::absolute(root).lexically_normal()) {
+    try {
+      this->load();
+    } catch (const IndexException &e) {
+      logger.info(std::format("ignoring profile \"{}\": {}",
+                              this->path.string(), e.what()));
+      this->previous.clear();
+    }
+  }
+
+  /// @brief Scheduling priority of `folder`, higher first: whether it had
+  /// matches (with `matched_first`), then its expected cost. Folders the
+  /// profile doesn't know come last.
+  std::pair<uint64_t, uint64_t> priority(const std::string &folder) const {
+    auto itr = this->previous.find(folder);
+    if (itr == this->previous.end()) {
+      return {0, 0};
+    }
+    const Folder &known = itr->second;
+    // Roughly a microsecond per entry, on top of the time spent reading.
+    return {this->matched_first && known.subtree_matched,
+            known.subtree_entries + known.subtree_micros};
+  }
+
+  void record_folder(const std::string &folder,
+                     const std::vector<std::string> &folders, uint64_t files,
+                     uint64_t read_micros) {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    Folder &record = this->current[folder];
+    record.files = files;
+    record.read_micros = read_micros;
+    record.folders = folders;
+  }
+
+  /// @brief Records a folder that wasn't read (its results came from a
+  /// cache), keeping what the previous profile knew about it.
+  void record_unread(const std::string &folder,
+                     const std::vector<std::string> &folders) {
+    auto itr = this->previous.find(folder);
+    bool known = itr != this->previous.end();
+    this->record_folder(folder, folders, known ? itr->second.files : 0,
+                        known ? itr->second.read_micros : 0);
+  }
+
+  void record_match(const fs::path &match) {
+    // `root` is absolute, so the match has to be too.
+    std::string folder = fs::absolute(match)
+                             .lexically_normal()
+                             .parent_path()
+                             .lexically_relative(this->root)
+                             .generic_string();
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    this->current[folder == "." ? "" : folder].subtree_matched = true;
+  }
+
+  /// @brief Replaces the profile file with this search's folders. Only call
+  /// this after a search that ran to completion.
+  void save() {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    // Deepest folders first, so every folder is complete before it is added
+    // to its parent.
+    std::vector<std::pair<size_t, std::string>> by_depth;
+    for (auto &[name, folder] : this->current) {
+      folder.subtree_entries = folder.files + folder.folders.size();
+      folder.subtree_micros = folder.read_micros;
+      by_depth.emplace_back(
+          name.empty() ? 0 : std::ranges::count(name, '/') + 1, name);
+    }
+    std::ranges::sort(by_depth, std::greater<>{});
+    for (const auto &[depth, name] : by_depth) {
+      if (depth == 0) {
+        continue;
+      }
+      size_t slash = name.rfind('/');
+      auto parent = this->current.find(
+          slash == std::string::npos ? "" : name.substr(0, slash));
+      if (parent != this->current.end()) {
+        const Folder &folder = this->current[name];
+        parent->second.subtree_entries += folder.subtree_entries;
+        parent->second.subtree_micros += folder.subtree_micros;
+        parent->second.subtree_matched |= folder.subtree_matched;
+      }
+    }
+
+    ByteWriter file;
+    file.out.append(magic);
+    file.string(this->root.generic_string());
+    file.fixed<uint32_t>(static_cast<uint32_t>(this->current.size()));
+    for (const auto &[name, folder] : this->current) {
+      file.string(name);
+      file.fixed<uint64_t>(folder.files);
+      file.fixed<uint64_t>(folder.read_micros);
+      file.fixed<uint64_t>(folder.subtree_entries);
+      file.fixed<uint64_t>(folder.subtree_micros);
+      file.fixed<uint8_t>(folder.subtree_matched);
+    }
+    write_file_atomically(this->path, {file.out});
+  }
+
+  bool matched_first = false;
+
+private:
+  void load() {
+    if (!fs::exists(this->path)) {
+      return;
+    }
+    MappedFile file(this->path);
+    ByteReader reader(file.bytes());
+    if (reader.take(magic.size()) != magic ||
+        reader.string() != this->root.generic_string()) {
+      throw IndexException("not a profile of this root");
+    }
+    uint32_t folder_count = reader.fixed<uint32_t>();
+    for (uint32_t i = 0; i < folder_count; ++i) {
+      Folder &folder = this->previous[std::string(reader.string())];
+      folder.files = reader.fixed<uint64_t>();
+      folder.read_micros = reader.fixed<uint64_t>();
+      folder.subtree_entries = reader.fixed<uint64_t>();
+      folder.subtree_micros = reader.fixed<uint64_t>();
+      folder.subtree_matched = reader.fixed<uint8_t>() != 0;
+    }
+  }
+
+  static constexpr std::string_view magic = "FFPROF01";
+
+  fs::path path;
+  fs::path root;
+  std::unordered_map<std::string, Folder> previous;
+  std::unordered_map<std::string, Folder> current;
+  std::mutex mutex;
+};
+
+#pragma region Archives
+
+/// @brief A file read through explicit seeks, so that the parts of an archive
+/// that hold no names are never read.
+struct ArchiveFile {
+  ArchiveFile(const fs::path &path) {
+#if defined(FILE_FINDER_POSIX)
+    this->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info {};
+    if (this->fd >= 0 && ::fstat(this->fd, &info) != 0) {
+      ::close(this->fd);
+      this->fd = -1;
+    }
+    if (this->fd < 0) {
+      throw IndexException(
+          std::format("Unable to open \"{}\"", path.string()));
+    }
+    this->size = static_cast<uint64_t>(info.st_size);
+#else
+    this->file.open(path, std::ios::binary);
+    if (!this->file) {
+      throw IndexException(
+          std::format("Unable to open \"{}\"", path.string()));
+    }
+    this->size = fs::file_size(path);
+#endif
+  }
+
+  ArchiveFile(const ArchiveFile &) = delete;
+  ArchiveFile &operator=(const ArchiveFile &) = delete;
+
+  ~ArchiveFile() {
+#if defined(FILE_FINDER_POSIX)
+    if (this->fd >= 0) {
+      ::close(this->fd);
+    }
+#endif
+  }
+
+  /// @brief Reads up to `count` bytes from the current position; fewer at the
+  /// end of the file.
+  std::string read(size_t count) {
+    std::string bytes(count, '\0');
+    size_t done = 0;
+#if defined(FILE_FINDER_POSIX)
+    while (done < count) {
+      ssize_t result = ::read(this->fd, bytes.data() + done, count - done);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      } else if (result <= 0) {
+        break;
+      }
+      done += static_cast<size_t>(result);
+    }
+#else
+    this->file.read(bytes.data(), static_cast<std::streamsize>(count));
+    done = static_cast<size_t>(this->file.gcount());
+#endif
+    bytes.resize(done);
+    return bytes;
+  }
+
+  void seek(uint64_t offset) {
+#if defined(FILE_FINDER_POSIX)
+    ::lseek(this->fd, static_cast<off_t>(offset), SEEK_SET);
+#else
+    this->file.clear();
+    this->file.seekg(static_cast<std::streamoff>(offset));
+#endif
+  }
+
+  /// @brief Moves past `count` bytes without reading them.
+  void skip(uint64_t count) {
+#if defined(FILE_FINDER_POSIX)
+    ::lseek(this->fd, static_cast<off_t>(count), SEEK_CUR);
+#else
+    this->file.seekg(static_cast<std::streamoff>(count), std::ios::cur);
+#endif
+  }
+
+  uint64_t size = 0;
+
+private:
+#if defined(FILE_FINDER_POSIX)
+  int fd = -1;
+#else
+  std::ifstream file;
+#endif
+};
+
+/// @brief Lists the files inside .zip and (uncompressed) .tar archives found
+/// by a search on a pool of threads, and matches their names against the
+/// search's substrings. Matches are pushed straight to the container as
+/// "<archive>!/<path inside the archive>", numbered from the walker's ids.
+struct ArchiveLister {
+  ArchiveLister(SearchResultContainer *container,
+                std::vector<std::string> patterns,
+                size_t threads = std::max(
+                    1U, std::thread::hardware_concurrency()))
+      : container(container), patterns(std::move(patterns)) {
+    for (size_t i = 0; i < threads; ++i) {
+      this->threads.emplace_back([this]() { this->loop(); });
+    }
+  }
+
+  ~ArchiveLister() {
+    this->stop();
+    for (std::thread &thread : this->threads) {
+      thread.join();
+    }
+  }
+
+  static bool is_archive(const fs::path &path) {
+    std::string extension = lowercase_extension(path);
+    return extension == ".zip" || extension == ".tar";
+  }
+
+  /// @brief Calls `on_member` with the path of every file in `archive` until
+  /// it returns false. A zip's central directory is read in one piece; a
+  /// tar's headers are read one block at a time, seeking past the contents.
+  /// Throws IndexException if the archive can't be read.
+  static void list(const fs::path &archive,
+                   const std::function<bool(std::string_view)> &on_member) {
+    ArchiveFile file(archive);
+    if (lowercase_extension(archive) == ".zip") {
+      list_zip(file, on_member);
+    } else {
+      list_tar(file, on_member);
+    }
+  }
+
+  /// @brief Queues `archive` to be listed, numbering its matches from
+  /// `next_id`.
+  void post(const fs::path &archive, std::atomic<EntryId> &next_id) {
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      if (this->stopped) {
+        return;
+      }
+      this->pending.emplace_back(archive, &next_id);
+    }
+    this->changed.notify_all();
+  }
+
+  /// @brief Waits until every archive posted so far has been listed, or the
+  /// lister was stopped.
+  void finish() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [this]() {
+      return this->stopped || (this->pending.empty() && this->busy == 0);
+    });
+  }
+
+  /// @brief Drops the archives that haven't been started and ends the ones
+  /// being listed early.
+  void stop() {
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->stopped = true;
+      this->pending.clear();
+    }
+    this->changed.notify_all();
+  }
+
+  Throttle *throttle = nullptr; // Optional CPU limit and pause.
+  std::atomic_size_t archives_listed = 0;
+  std::atomic_size_t members = 0;
+
+private:
+  static std::string lowercase_extension(const fs::path &path) {
+    std::string extension = path.extension().string();
+    std::ranges::transform(extension, extension.begin(), [](char c) {
+      return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    });
+    return extension;
+  }
+
+  void loop() {
+    while (true) {
+      std::pair<fs::path, std::atomic<EntryId> *> next;
+      {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->changed.wait(lock, [this]() {
+          return this->stopped || !this->pending.empty();
+        });
+        if (this->stopped) {
+          return;
+        }
+        next = std::move(this->pending.front());
+        this->pending.pop_front();
+        ++this->busy;
+      }
+      if (this->throttle != nullptr) {
+        this->throttle->wait_while_paused();
+        this->throttle->check_cpu();
+      }
+      this->match(next.first, *next.second);
+      {
+        std::scoped_lock<std::mutex> lock(this->mutex);
+        --this->busy;
+      }
+      this->changed.notify_all();
+    }
+  }
+
+  void match(const fs::path &archive, std::atomic<EntryId> &next_id) {
+    std::string prefix = archive.string() + "!/";
+    try {
+      list(archive, [&](std::string_view member) {
+        ++this->members;
+        std::string_view name = member.substr(member.rfind('/') + 1);
+        std::optional<EntryId> id;
+        for (size_t pattern = 0; pattern < this->patterns.size(); ++pattern) {
+          if (name.find(this->patterns[pattern]) == std::string_view::npos) {
+            continue;
+          }
+          if (!id) {
+            id = next_id++;
+          }
+          this->container->push(SearchResult{*id, pattern},
+                                fs::path(prefix + std::string(member)));
+        }
+        return !this->stopped;
+      });
+      ++this->archives_listed;
+    } catch (const IndexException &e) {
+      logger.info(std::format("skipping archive \"{}\": {}",
+                              archive.string(), e.what()));
+    }
+  }
+
+  /// @brief Reads a little endian integer at `offset` of `bytes`.
+  template <typename T>
+  static T little_endian(std::string_view bytes, size_t offset) {
+    if (offset + sizeof(T) > bytes.size()) {
+      throw IndexException("truncated archive");
+    }
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      value |= static_cast<T>(static_cast<uint8_t>(bytes[offset + i]))
+               << (8 * i);
+    }
+    return value;
+  }
+
+  static void list_zip(ArchiveFile &file,
+                       const std::function<bool(std::string_view)> &on_member) {
+    // The end of central directory record is in the last 22 bytes, unless
+    // the archive has a comment (of up to 64K).
+    uint64_t tail_size = std::min<uint64_t>(file.size, 22 + 0xFFFF);
+    file.seek(file.size - tail_size);
+    std::string tail = file.read(tail_size);
+    size_t end = tail.rfind(std::string_view("PK\x05\x06", 4));
+    if (end == std::string::npos) {
+      throw IndexException("no zip central directory");
+    }
+    uint64_t count = little_endian<uint16_t>(tail, end + 10);
+    uint64_t size = little_endian<uint32_t>(tail, end + 12);
+    uint64_t offset = little_endian<uint32_t>(tail, end + 16);
+    if ((count == 0xFFFF || size == 0xFFFFFFFF || offset == 0xFFFFFFFF) &&
+        end >= 20 && tail.compare(end - 20, 4, "PK\x06\x07") == 0) {
+      // Zip64: the locator in front of the record points to the real one.
+      file.seek(little_endian<uint64_t>(tail, end - 20 + 8));
+      std::string zip64 = file.read(56);
+      if (zip64.compare(0, 4, "PK\x06\x06") != 0) {
+        throw IndexException("broken zip64 central directory");
+      }
+      count = little_endian<uint64_t>(zip64, 32);
+      size = little_endian<uint64_t>(zip64, 40);
+      offset = little_endian<uint64_t>(zip64, 48);
+    }
+    if (offset > file.size || size > file.size - offset) {
+      throw IndexException("central directory out of bounds");
+    }
+    file.seek(offset);
+    std::string directory = file.read(size);
+    size_t position = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      // Every entry has 46 fixed bytes, then its name, extra field and
+      // comment, all of which must lie within the directory.
+      if (directory.size() - position < 46 ||
+          directory.compare(position, 4, "PK\x01\x02") != 0) {
+        throw IndexException("broken zip central directory");
+      }
+      uint16_t name_size = little_endian<uint16_t>(directory, position + 28);
+      uint16_t extra_size = little_endian<uint16_t>(directory, position + 30);
+      uint16_t comment_size =
+          little_endian<uint16_t>(directory, position + 32);
+      size_t entry_size = size_t{46} + name_size + extra_size + comment_size;
+      if (directory.size() - position < entry_size) {
+        throw IndexException("truncated archive");
+      }
+      std::string_view name(directory.data() + position + 46, name_size);
+      if (!name.empty() && !name.ends_with('/') && !on_member(name)) {
+        return;
+      }
+      position += entry_size;
+    }
+  }
+
+  /// @brief Parses a tar number: octal digits, or base-256 if the high bit
+  /// of the first byte is set.
+  static uint64_t tar_number(std::string_view field) {
+    uint64_t value = 0;
+    if (!field.empty() && (static_cast<uint8_t>(field[0]) & 0x80) != 0) {
+      for (size_t i = 1; i < field.size(); ++i) {
+        value = (value << 8) | static_cast<uint8_t>(field[i]);
+      }
+      return value;
+    }
+    for (char c : field) {
+      if (c >= '0' && c <= '7') {
+        value = value * 8 + static_cast<uint64_t>(c - '0');
+      } else if (c != ' ' || value != 0) {
+        break;
+      }
+    }
+    return value;
+  }
+
+  static void list_tar(ArchiveFile &file,
+                       const std::function<bool(std::string_view)> &on_member) {
+    auto field = [](std::string_view header, size_t offset, size_t size) {
+      std::string_view value = header.substr(offset, size);
+      return value.substr(0, value.find('\0'));
+    };
+    std::string long_name; // From a preceding GNU 'L' or pax 'x' entry.
+    while (true) {
+      std::string header = file.read(512);
+      if (header.size() < 512 ||
+          header.find_first_not_of('\0') == std::string::npos) {
+        return; // End of archive.
+      }
+      uint64_t checksum = 8 * ' ';
+      for (size_t i = 0; i < 512; ++i) {
+        if (i < 148 || i >= 156) {
+          checksum += static_cast<uint8_t>(header[i]);
+        }
+      }
+      if (checksum != tar_number(field(header, 148, 8))) {
+        throw IndexException("not a tar archive");
+      }
+      uint64_t size = tar_number(header.substr(124, 12));
+      uint64_t padded = (size + 511) / 512 * 512;
+      char type = header[156];
+      if (type == 'L' || type == 'x') {
+        std::string data = file.read(std::min<uint64_t>(size, 1 << 20));
+        file.skip(padded - data.size());
+        long_name = type == 'L' ? data.substr(0, data.find('\0'))
+                                : pax_path(data);
+        continue;
+      }
+      file.skip(padded);
+      std::string name = std::move(long_name);
+      long_name.clear();
+      if (name.empty()) {
+        name = field(header, 0, 100);
+        if (header.compare(257, 6, std::string_view("ustar\0", 6)) == 0 &&
+            header[345] != '\0') {
+          name = std::string(field(header, 345, 155)) + "/" + name;
+        }
+      }
+      while (name.starts_with("./") || name.starts_with('/')) {
+        name.erase(0, name.starts_with('/') ? 1 : 2);
+      }
+      bool file_entry = type == '0' || type == '\0' || type == '7';
+      if (file_entry && !name.empty() && !on_member(name)) {
+        return;
+      }
+    }
+  }
+
+  /// @brief Returns the "path" of a pax extended header, or "".
+  static std::string pax_path(std::string_view records) {
+    // Records are "<length> <key>=<value>\n".
+    while (!records.empty()) {
+      size_t length = 0;
+      auto [end, error] =
+          std::from_chars(records.data(), records.data() + records.size(),
+                          length);
+      if (error != std::errc{} || length == 0 || length > records.size()) {
+        return "";
+      }
+      std::string_view record = records.substr(0, length);
+      record.remove_prefix(std::min(record.size(),
+                                    static_cast<size_t>(end - records.data()) +
+                                        1));
+      if (record.starts_with("path=")) {
+        record.remove_prefix(5);
+        return std::string(record.substr(0, record.find('\n')));
+      }
+      records.remove_prefix(length);
+    }
+    return "";
+  }
+
+  SearchResultContainer *container;
+  std::vector<std::string> patterns;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::pair<fs::path, std::atomic<EntryId> *>> pending;
+  size_t busy = 0;
+  std::atomic_bool stopped = false; // Set under `mutex`.
+};
+
+#pragma endregion Archives
+
+/// @brief A glob over root relative, '/' separated paths, run as an automaton
+/// a character at a time. `*` matches any run of characters within a path
+/// component and `?` any one of them, `**` matches any run of characters
+/// including '/', and `**/` any number of whole folders (including none).
+/// Other characters match themselves. A state is the set of glob positions
+/// that the text so far can have reached, as a bitmask, so the state after a
+/// folder's path can be kept and stepped on from for each of its entries.
+struct PathGlob {
+  using State = uint64_t;
+  static constexpr State dead = 0; // Nothing that follows can match.
+  static constexpr size_t max_tokens = 63;
+
+  PathGlob(std::string_view glob) {
+    for (size_t i = 0; i < glob.size(); ++i) {
+      if (glob.substr(i, 3) == "**/") {
+        this->tokens.push_back({Token::FolderStart});
+        this->tokens.push_back({Token::FolderInside});
+        i += 2;
+      } else if (glob.substr(i, 2) == "**") {
+        this->tokens.push_back({Token::AnyRun});
+        i += 1;
+      } else if (glob[i] == '*') {
+        this->tokens.push_back({Token::Run});
+      } else if (glob[i] == '?') {
+        this->tokens.push_back({Token::One});
+      } else {
+        this->tokens.push_back({Token::Literal, glob[i]});
+      }
+    }
+  }
+
+  /// @brief Whether the glob is short enough for a state to hold.
+  bool valid() const { return this->tokens.size() <= max_tokens; }
+
+  /// @brief The state before any text.
+  State start() const { return this->closure(1); }
+
+  /// @brief The state after `text` follows the text that led to `state`.
+  State step(State state, std::string_view text) const {
+    for (char c : text) {
+      State next = 0;
+      for (State left = state; left != 0; left &= left - 1) {
+        size_t i = std::countr_zero(left);
+        if (i == this->tokens.size()) {
+          continue; // Already past the end; more text can't match.
+        }
+        const Token &token = this->tokens[i];
+        switch (token.kind) {
+        case Token::Literal:
+          next |= State{c == token.c} << (i + 1);
+          break;
+        case Token::One:
+          next |= State{c != '/'} << (i + 1);
+          break;
+        case Token::Run:
+          next |= State{c != '/'} << i;
+          break;
+        case Token::AnyRun:
+          next |= State{1} << i;
+          break;
+        case Token::FolderStart:
+          next |= State{1} << (c == '/' ? i : i + 1);
+          break;
+        case Token::FolderInside:
+          next |= State{1} << (c == '/' ? i - 1 : i);
+          break;
+        }
+      }
+      state = this->closure(next);
+      if (state == dead) {
+        break;
+      }
+    }
+    return state;
+  }
+
+  /// @brief Whether the text that led to `state` matches the whole glob.
+  bool accepts(State state) const {
+    return (state >> this->tokens.size() & 1) != 0;
+  }
+
+private:
+  struct Token {
+    enum Kind {
+      Literal,
+      One,          // ?
+      Run,          // *
+      AnyRun,       // **
+      FolderStart,  // **/ at the start of a component,
+      FolderInside, // and inside one.
+    } kind;
+    char c = 0;
+  };
+
+  /// @brief Adds the positions reachable without consuming text: past a `*`
+  /// or `**` (matching nothing), and past a `**/` (matching no folder).
+  State closure(State state) const {
+    for (size_t i = 0; i < this->tokens.size(); ++i) {
+      if ((state >> i & 1) == 0) {
+        continue;
+      }
+      Token::Kind kind = this->tokens[i].kind;
+      if (kind == Token::Run || kind == Token::AnyRun) {
+        state |= State{1} << (i + 1);
+      } else if (kind == Token::FolderStart) {
+        state |= State{1} << (i + 2);
+      }
+    }
+    return state;
+  }
+
+  std::vector<Token> tokens;
+};
+
+struct PathFinder {
+  /// @brief Pushes every file (not folder) below `path` to each processor.
+  /// With a `cache`, unchanged folders aren't read; their cached matches are
+  /// replayed instead. With `names` and `folders`, each file's name and the
+  /// path of its folder are interned and the file is pushed as their ids.
+  int list_paths(std::filesystem::path path, std::vector<Processor> *processors,
+                 std::filesystem::directory_options &&options,
+                 ResultCache *cache = nullptr) {
+    return this->walk(
+        path, options,
+        [this, processors](EntryId id, const fs::directory_entry &entry) {
+          NameId name = no_name;
+          NameId folder = no_name;
+          if (this->names != nullptr) {
+            name = this->names->intern(entry.path().filename().string());
+            folder = this->folders->intern(entry.path().parent_path().string());
+          }
+          for (Processor &proc : *processors) {
+            if (name != no_name && folder != no_name) {
+              proc.push(id, name, folder);
+            } else {
+              proc.push(id, entry);
+            }
+          }
+        },
+        cache);
+  }
+
+  /// @brief Walks the tree below `path` folder by folder and calls `on_file`
+  /// for every file (not folder), numbering them in the order they are found.
+  /// With more than one walker, folders are read in parallel and `on_file` is
+  /// called concurrently. Pending folders are visited in order of their
+  /// profile's priority, otherwise depth first. With a glob, only files whose
+  /// root relative path it matches are passed on, and folders below which it
+  /// can't match are skipped without being read.
+  /// @return 1 if stopped through `should_continue`, otherwise 0.
+  int walk(const fs::path &path, fs::directory_options options,
+           const std::function<void(EntryId, const fs::directory_entry &)>
+               &on_file,
+           ResultCache *cache = nullptr) {
+    logger.debug("find start");
+    this->should_continue = true;
+
+    // (priority, order pushed, folder, glob state after the folder's path).
+    // Among equal priorities the folder pushed last is visited first, like a
+    // stack.
+    using Pending = std::tuple<std::pair<uint64_t, uint64_t>, uint64_t,
+                               std::string, PathGlob::State>;
+    std::priority_queue<Pending> pending;
+    uint64_t pushed = 0;
+    size_t busy = 0;
+    std::mutex mutex;
+    std::condition_variable changed;
+    pending.emplace(std::pair<uint64_t, uint64_t>{}, pushed++, "",
+                    this->glob != nullptr ? this->glob->start()
+                                          : PathGlob::dead);
+
+    auto walker = [&]() {
+      while (true) {
+        std::string folder;
+        PathGlob::State state;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (pending.empty() && busy > 0 && this->should_continue) {
+            changed.wait_for(lock, std::chrono::milliseconds{50});
+          }
+          if (pending.empty() || !this->should_continue) {
+            changed.notify_all();
+            return;
+          }
+          folder = std::get<2>(pending.top());
+          state = std::get<3>(pending.top());
+          pending.pop();
+          ++busy;
+        }
+        std::vector<std::string> children =
+            this->visit(path, folder, state, options, on_file, cache);
+        // Each folder's path is only stepped through the glob once, from its
+        // parent's state. Folders the glob can't match below aren't read.
+        std::vector<std::pair<std::string, PathGlob::State>> next;
+        for (std::string &child : children) {
+          PathGlob::State child_state = PathGlob::dead;
+          if (this->glob != nullptr) {
+            std::string_view name = std::string_view(child).substr(
+                folder.empty() ? 0 : folder.size() + 1);
+            child_state = this->glob->step(this->glob->step(state, name), "/");
+            if (child_state == PathGlob::dead) {
+              ++this->folders_pruned;
+              continue;
+            }
+          }
+          next.emplace_back(std::move(child), child_state);
+        }
+        {
+          std::scoped_lock<std::mutex> lock(mutex);
+          // Pushed in reverse so that subfolders are visited in listing
+          // order.
+          for (auto child = next.rbegin(); child != next.rend(); ++child) {
+            auto priority = this->profile != nullptr
+                                ? this->profile->priority(child->first)
+                                : std::pair<uint64_t, uint64_t>{};
+            pending.emplace(priority, pushed++, std::move(child->first),
+                            child->second);
+          }
+          --busy;
+        }
+        changed.notify_all();
+      }
+    };
+    std::vector<std::thread> helpers;
+    for (size_t i = 1; i < this->walkers; ++i) {
+      helpers.emplace_back(walker);
+    }
+    walker();
+    for (std::thread &helper : helpers) {
+      helper.join();
+    }
+
+    if (!this->should_continue) {
+      logger.debug("end_find (stop)");
+      return 1;
+    }
+    logger.debug("find end");
+    return 0;
+  }
+
+  std::atomic_bool should_continue = false;
+  // Optional limit on folder reads (and stats, with a cache) and CPU time,
+  // and pause.
+  Throttle *throttle = nullptr;
+  // Optional deadline for each folder read. Without one, reads run inline.
+  FolderReader *reader = nullptr;
+  // Optional profile to schedule by and record into.
+  TraversalProfile *profile = nullptr;
+  size_t walkers = 1; // Threads reading folders.
+  // Optional pool that lists the archives found, to match their contents.
+  ArchiveLister *archives = nullptr;
+  // Optional dictionaries list_paths interns the names of files, and the
+  // paths of their folders, in. Either both or neither.
+  NameDictionary *names = nullptr;
+  NameDictionary *folders = nullptr;
+  // Optional glob the root relative paths of files must match.
+  const PathGlob *glob = nullptr;
+  std::atomic_size_t folders_pruned = 0; // Not read, as the glob can't match.
+  std::vector<fs::path> timed_out; // Folders skipped for missing a deadline.
+
+private:
+  /// @brief Reads `folder` (relative to `path`) and calls `on_file` for its
+  /// files (those the glob accepts from `state`, the glob state after the
+  /// folder's path, if there is a glob), or replays its cached matches if it
+  /// didn't change.
+  /// @return The subfolders to visit, relative to `path`.
+  std::vector<std::string>
+  visit(const fs::path &path, const std::string &folder, PathGlob::State state,
+        fs::directory_options options,
+        const std::function<void(EntryId, const fs::directory_entry &)>
+            &on_file,
+        ResultCache *cache) {
+    if (this->throttle != nullptr) {
+      this->throttle->wait_while_paused();
+      this->throttle->check_cpu();
+    }
+    fs::path folder_path = folder.empty() ? path : path / fs::path(folder);
+    std::string prefix = folder.empty() ? "" : folder + "/";
+    auto children = [&prefix](const std::vector<std::string> &names) {
+      std::vector<std::string> folders;
+      for (const std::string &name : names) {
+        folders.push_back(prefix + name);
+      }
+      return folders;
+    };
+
+    std::optional<FolderStamp> stamp;
+    if (cache != nullptr) {
+      if (this->throttle != nullptr) {
+        this->throttle->acquire();
+      }
+      auto stat = [folder_path]() { return stamp_folder(folder_path); };
+      std::optional<std::optional<FolderStamp>> result =
+          this->read<std::optional<FolderStamp>>(folder_path, stat);
+      if (!result || !*result) {
+        return {};
+      }
+      stamp = *result;
+      if (const ResultCache::Folder *cached = cache->find(folder, *stamp)) {
+        cache->replay(folder, *cached, folder_path, this->next_id);
+        std::vector<std::string> folders = children(cached->folders);
+        if (this->profile != nullptr) {
+          this->profile->record_unread(folder, folders);
+        }
+        return folders;
+      }
+    }
+
+    if (this->throttle != nullptr) {
+      this->throttle->acquire();
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::optional<FolderListing> listing =
+        this->read<FolderListing>(folder_path, [folder_path, options]() {
+          return list_folder(folder_path, options);
+        });
+    if (!listing) {
+      return {};
+    }
+    std::vector<std::string> folders = children(listing->folders);
+    if (this->profile != nullptr) {
+      auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+      this->profile->record_folder(folder, folders, listing->files.size(),
+                                   micros.count());
+    }
+    // Timed out folders aren't cached, so they are read again next time.
+    uint32_t record =
+        cache != nullptr ? cache->add(folder, *stamp, listing->folders) : 0;
+    for (const fs::directory_entry &entry : listing->files) {
+      if (this->throttle != nullptr) {
+        this->throttle->wait_while_paused();
+      }
+      if (this->glob != nullptr &&
+          !this->glob->accepts(
+              this->glob->step(state, entry.path().filename().string()))) {
+        continue;
+      }
+      EntryId id = this->next_id++;
+      if (cache != nullptr) {
+        cache->assign(id, record);
+      }
+      on_file(id, entry);
+      if (this->archives != nullptr &&
+          ArchiveLister::is_archive(entry.path())) {
+        this->archives->post(entry.path(), this->next_id);
+      }
+    }
+    return folders;
+  }
+
+  /// @brief Runs `operation` on `folder` through the reader, if any. Folders
+  /// whose operation misses the deadline are reported and skipped.
+  template <typename T>
+  std::optional<T> read(const fs::path &folder, std::function<T()> operation) {
+    if (this->reader == nullptr) {
+      return operation();
+    }
+    std::optional<T> result =
+        this->reader->run(std::move(operation), this->should_continue);
+    if (!result && this->should_continue) {
+      logger.info(
+          std::format("skipping \"{}\": read timed out", folder.string()));
+      std::scoped_lock<std::mutex> lock(this->timed_out_mutex);
+      this->timed_out.push_back(folder);
+    }
+    return result;
+  }
+
+  std::atomic<EntryId> next_id = 0;
+  std::mutex timed_out_mutex;
+};
+
+#pragma region Index
+
+/// @brief Set of byte values, used to tell whether a block of names can
+/// possibly contain a substring without decoding the block.
+struct ByteSet {
+  void add(std::string_view bytes) {
+    for (char c : bytes) {
+      uint8_t byte = static_cast<uint8_t>(c);
+      this->bits[byte / 64] |= uint64_t{1} << (byte % 64);
+    }
+  }
+
+  bool contains(const ByteSet &other) const {
+    for (size_t i = 0; i < this->bits.size(); ++i) {
+      if ((other.bits[i] & ~this->bits[i]) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::array<uint64_t, 4> bits{};
+};
+
+/// @brief Runs `task(0) .. task(count - 1)` on up to one thread per core.
+inline void parallel_for(size_t count,
+                         const std::function<void(size_t)> &task) {
+  size_t worker_count = std::min<size_t>(
+      count, std::max(1U, std::thread::hardware_concurrency()));
+  std::atomic_size_t next = 0;
+  std::vector<std::future<void>> workers;
+  for (size_t i = 0; i < worker_count; ++i) {
+    workers.push_back(std::async(std::launch::async, [&]() {
+      for (size_t item = next++; item < count; item = next++) {
+        task(item);
+      }
+    }));
+  }
+  // get() rethrows the first exception thrown by a task.
+  for (std::future<void> &worker : workers) {
+    worker.get();
+  }
+}
+
+/// @brief The directories and files below an index root. Directory ids are
+/// assigned in depth first order, so the subtree of directory `d` is exactly
+/// the ids in [d, directories[d].subtree_end). Files are ordered by directory
+/// id, then name.
+struct IndexTree {
+  struct Directory {
+    uint32_t parent;      // Id of the parent directory. The root is its own.
+    uint32_t subtree_end; // One past the last id below this directory.
+    std::string name;
+    int64_t mtime; // Changes whenever an entry is added, removed or renamed.
+  };
+
+  struct File {
+    uint32_t directory;
+    std::string name;
+    int64_t mtime; // file_clock nanoseconds since its epoch.
+    uint64_t size;
+  };
+
+  /// @brief Marks the files of a folder (or, for a subtree, everything at and
+  /// below it) in older layers of an index as superseded. See ShardedIndex.
+  struct Tombstone {
+    std::string path; // Root relative, '/' separated.
+    bool subtree;
+  };
+
+  // Directory::mtime of folders that are only recorded as the ancestors of
+  // others, in partial trees whose mtime is owned by an older layer.
+  static constexpr int64_t unknown_mtime = std::numeric_limits<int64_t>::min();
+
+  /// @brief Walks `root`, recording every folder and file (not folder) below
+  /// it with its modification time and size. Symlinks to folders are neither
+  /// followed nor recorded. If `recursive` is false, only the files directly
+  /// in `root` are recorded.
+  static IndexTree scan(const fs::path &root, bool recursive = true) {
+    IndexTree tree;
+    tree.recursive = recursive;
+    tree.directories.push_back({0, 0, "", 0});
+    tree.scan_directory(root, 0);
+    return tree;
+  }
+
+  /// @brief The contents of a single folder, each sorted by name.
+  struct Listing {
+    int64_t mtime = 0;
+    std::vector<File> files; // `directory` is left 0 for the caller to set.
+    std::vector<std::string> folders;
+    bool found = false; // False if the folder couldn't be read.
+  };
+
+  static Listing list(const fs::path &path) {
+    Listing listing;
+    std::error_code error;
+    listing.mtime = to_nanoseconds(fs::last_write_time(path, error));
+    listing.found = !error;
+    for (fs::directory_iterator itr(
+             path, fs::directory_options::skip_permission_denied, error);
+         !error && itr != fs::directory_iterator(); itr.increment(error)) {
+      std::string name = itr->path().filename().string();
+      std::error_code entry_error;
+      if (itr->is_directory(entry_error)) {
+        if (!itr->is_symlink(entry_error)) {
+          listing.folders.push_back(std::move(name));
+        }
+      } else {
+        listing.files.push_back(stat_file(*itr, std::move(name)));
+      }
+    }
+    std::sort(listing.files.begin(), listing.files.end(),
+              [](const File &a, const File &b) { return a.name < b.name; });
+    std::sort(listing.folders.begin(), listing.folders.end());
+    return listing;
+  }
+
+  /// @brief The file at `entry`, named `name`, with its modification time and
+  /// its size (0 unless it is a regular file whose size can be read).
+  static File stat_file(const fs::directory_entry &entry, std::string name) {
+    std::error_code error;
+    auto mtime = entry.last_write_time(error);
+    uint64_t size = entry.is_regular_file(error) ? entry.file_size(error) : 0;
+    return {0, std::move(name), to_nanoseconds(mtime), error ? 0 : size};
+  }
+
+  /// @brief Root relative, '/' separated paths of all directories, by id.
+  std::vector<std::string> directory_paths() const {
+    std::vector<std::string> paths(this->directories.size());
+    for (size_t id = 1; id < this->directories.size(); ++id) {
+      const std::string &parent = paths[this->directories[id].parent];
+      paths[id] = parent.empty() ? this->directories[id].name
+                                 : parent + "/" + this->directories[id].name;
+    }
+    return paths;
+  }
+
+  std::vector<Directory> directories;
+  std::vector<File> files;
+  std::vector<Tombstone> tombstones;
+
+private:
+  void scan_directory(const fs::path &path, uint32_t id) {
+    Listing listing = list(path);
+    this->directories[id].mtime = listing.mtime;
+    for (File &file : listing.files) {
+      file.directory = id;
+      this->files.push_back(std::move(file));
+    }
+    if (!this->recursive) {
+      listing.folders.clear();
+    }
+
+    for (std::string &folder : listing.folders) {
+      uint32_t child = static_cast<uint32_t>(this->directories.size());
+      this->directories.push_back({id, 0, folder, 0});
+      this->scan_directory(path / folder, child);
+    }
+    this->directories[id].subtree_end =
+        static_cast<uint32_t>(this->directories.size());
+  }
+
+  bool recursive = true;
+};
+
+/// @brief Converts a directory below an index root into the root relative
+/// prefix used by IndexQuery.
+inline std::string index_prefix(const std::string &root,
+                                const fs::path &directory) {
+  fs::path normal = fs::absolute(directory).lexically_normal();
+  if (!normal.has_filename()) {
+    normal = normal.parent_path();
+  }
+  fs::path relative = normal.lexically_relative(fs::path(root));
+  std::string prefix = relative.generic_string();
+  if (relative.empty() || prefix.starts_with("..")) {
+    throw IndexException(
+        std::format("\"{}\" is not inside the indexed root \"{}\"",
+                    directory.string(), root));
+  }
+  return prefix == "." ? "" : prefix;
+}
+
+struct IndexQuery {
+  std::string prefix; // Root relative directory to search. Empty for all.
+  std::vector<std::string> substrings;
+  // Inclusive ranges a file's modification time (file_clock nanoseconds since
+  // its epoch) and size must fall in.
+  int64_t min_mtime = std::numeric_limits<int64_t>::min();
+  int64_t max_mtime = std::numeric_limits<int64_t>::max();
+  uint64_t min_size = 0;
+  uint64_t max_size = std::numeric_limits<uint64_t>::max();
+};
+
+struct IndexMatch {
+  std::string path; // Root relative, '/' separated.
+  PatternMask patterns;
+};
+
+struct IndexQueryStats {
+  size_t blocks_scanned = 0;
+  size_t blocks_skipped = 0;
+  size_t subtrees_skipped = 0; // Ruled out by their summary.
+  size_t files_read = 0;       // To confirm content matches.
+};
+
+// Persistent, read-only index of the files below a root directory.
+//
+// Directories are numbered in depth first order (see IndexTree), so every
+// subtree is a contiguous range of ids. Files are sorted by (directory id,
+// name) and front-coded in blocks: each file after the first of a block stores
+// the difference between its directory id and its predecessor's, the length of
+// the name prefix they share and the rest of its name. Modification times and
+// sizes are stored as separate columns in front of the names. The block
+// headers are kept together at the front of the file so that the blocks of a
+// subtree are found by binary search without touching any block payload.
+//
+// Layout (native byte order, `string` is a u32 length followed by bytes):
+//   magic "FFINDEX6", u32 entries_per_block, u64 entry_count,
+//   u64 block_count, u32 directory_count, string root
+//   directory_count x { u32 parent, u32 subtree_end, i64 mtime, string name }
+//   u32 tombstone_count, tombstone_count x { u8 subtree, string path }
+//   u32 summary_count, summary_count x { u32 directory, u8 bits_log2,
+//                                        u64 bits[2^bits_log2 / 64] }
+//   block_count x { u64 payload_offset, u32 payload_size, u32 entry_count,
+//                   u64 name_bytes[4], i64 min_mtime, i64 max_mtime,
+//                   u64 min_size, u64 max_size, u32 first_directory,
+//                   string first_name }
+//   per block: entry_count x i64 mtime, entry_count x u64 size,
+//              (entry_count - 1) x { varint directory_delta, varint shared,
+//                                    varint size, suffix }
+//
+// `name_bytes` records every byte that occurs in a file name of the block, so
+// that a block which can't contain a substring is skipped without decoding.
+// Likewise the min/max of the mtime and size columns (zone maps) skip blocks
+// that can't satisfy a time or size range.
+//
+// Directories whose subtree holds more files than a block get a summary: a
+// bloom filter of the byte pairs (bigrams) occurring in the file names of the
+// subtree, sized to the number of distinct pairs. A query skips the whole id
+// range of a subtree whose summary lacks a pair of every substring, so that
+// selective queries only visit the parts of the tree that may match.
+struct PathIndex {
+  static constexpr std::string_view magic = "FFINDEX6";
+  static constexpr uint32_t max_entries_per_block = 1024;
+
+  struct DirectoryHeader {
+    uint32_t parent;
+    uint32_t subtree_end;
+    int64_t mtime;
+    std::string_view name;
+  };
+
+  struct BlockHeader {
+    uint64_t payload_offset;
+    uint32_t payload_size;
+    uint32_t entry_count;
+    ByteSet name_bytes;
+    int64_t min_mtime;
+    int64_t max_mtime;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint32_t first_directory;
+    std::string_view first_name;
+  };
+
+  struct SubtreeSummary {
+    uint32_t directory;
+    uint8_t bits_log2;
+    std::string_view bits; // 2^bits_log2 bits, as u64 words.
+
+    bool contains(uint16_t bigram) const {
+      uint32_t bit = summary_bit(bigram, this->bits_log2);
+      uint64_t word;
+      std::memcpy(&word, this->bits.data() + bit / 64 * 8, 8);
+      return (word >> (bit % 64) & 1) != 0;
+    }
+  };
+
+  /// @brief Returns the byte pairs of `name`.
+  static std::vector<uint16_t> bigrams(std::string_view name) {
+    std::vector<uint16_t> pairs;
+    for (size_t i = 1; i < name.size(); ++i) {
+      pairs.push_back(static_cast<uint16_t>(
+          static_cast<uint8_t>(name[i - 1]) << 8 |
+          static_cast<uint8_t>(name[i])));
+    }
+    return pairs;
+  }
+
+  /// @brief Bit of a summary with 2^bits_log2 bits that `bigram` sets.
+  static uint32_t summary_bit(uint16_t bigram, uint8_t bits_log2) {
+    return (bigram * uint32_t{0x9E3779B1}) >> (32 - bits_log2);
+  }
+
+  static void write(const fs::path &index_path, const fs::path &root,
+                    const IndexTree &tree, uint32_t entries_per_block = 64) {
+    ByteWriter directories;
+    for (const IndexTree::Directory &directory : tree.directories) {
+      directories.fixed<uint32_t>(directory.parent);
+      directories.fixed<uint32_t>(directory.subtree_end);
+      directories.fixed<int64_t>(directory.mtime);
+      directories.string(directory.name);
+    }
+    directories.fixed<uint32_t>(static_cast<uint32_t>(tree.tombstones.size()));
+    for (const IndexTree::Tombstone &tombstone : tree.tombstones) {
+      directories.fixed<uint8_t>(tombstone.subtree);
+      directories.string(tombstone.path);
+    }
+    write_summaries(directories, tree,
+                    std::clamp(entries_per_block, uint32_t{1},
+                               max_entries_per_block));
+
+    ByteWriter headers;
+    ByteWriter payload;
+    const std::vector<IndexTree::File> &files = tree.files;
+    entries_per_block = std::clamp(entries_per_block, uint32_t{1},
+                                   max_entries_per_block);
+    uint64_t block_count = 0;
+    for (size_t first = 0; first < files.size(); first += entries_per_block) {
+      size_t last = std::min(files.size(), first + entries_per_block);
+      ByteSet name_bytes;
+      size_t payload_start = payload.out.size();
+      auto block_files =
+          std::ranges::subrange(files.begin() + first, files.begin() + last);
+      auto [min_mtime, max_mtime] =
+          std::ranges::minmax(block_files | std::views::transform(
+                                                &IndexTree::File::mtime));
+      auto [min_size, max_size] = std::ranges::minmax(
+          block_files | std::views::transform(&IndexTree::File::size));
+      for (const IndexTree::File &file : block_files) {
+        payload.fixed<int64_t>(file.mtime);
+      }
+      for (const IndexTree::File &file : block_files) {
+        payload.fixed<uint64_t>(file.size);
+      }
+      name_bytes.add(files[first].name);
+      for (size_t i = first + 1; i < last; ++i) {
+        const std::string &previous = files[i - 1].name;
+        const std::string &current = files[i].name;
+        size_t shared = std::mismatch(previous.begin(), previous.end(),
+                                      current.begin(), current.end())
+                            .first -
+                        previous.begin();
+        payload.varint(files[i].directory - files[i - 1].directory);
+        payload.varint(shared);
+        payload.varint(current.size() - shared);
+        payload.out.append(current, shared);
+        name_bytes.add(current);
+      }
+      headers.fixed<uint64_t>(payload_start);
+      headers.fixed<uint32_t>(
+          static_cast<uint32_t>(payload.out.size() - payload_start));
+      headers.fixed<uint32_t>(static_cast<uint32_t>(last - first));
+      for (uint64_t bits : name_bytes.bits) {
+        headers.fixed<uint64_t>(bits);
+      }
+      headers.fixed<int64_t>(min_mtime);
+      headers.fixed<int64_t>(max_mtime);
+      headers.fixed<uint64_t>(min_size);
+      headers.fixed<uint64_t>(max_size);
+      headers.fixed<uint32_t>(files[first].directory);
+      headers.string(files[first].name);
+      ++block_count;
+    }
+
+    ByteWriter file;
+    file.out.append(magic);
+    file.fixed<uint32_t>(entries_per_block);
+    file.fixed<uint64_t>(files.size());
+    file.fixed<uint64_t>(block_count);
+    file.fixed<uint32_t>(static_cast<uint32_t>(tree.directories.size()));
+    file.string(fs::absolute(root).lexically_normal().generic_string());
+    file.out.append(directories.out);
+    file.out.append(headers.out);
+
+    // Payload offsets are relative to the start of the payload section.
+    write_file_atomically(index_path, {file.out, payload.out});
+  }
+
+  PathIndex(const fs::path &index_path) : file(index_path) {
+    ByteReader reader(this->file.bytes());
+    if (reader.data.substr(0, magic.size()) != magic) {
+      throw IndexException(
+          std::format("\"{}\" is not an index", index_path.string()));
+    }
+    reader.take(magic.size());
+    reader.fixed<uint32_t>(); // entries_per_block, informational.
+    this->entry_count = reader.fixed<uint64_t>();
+    uint64_t block_count = reader.fixed<uint64_t>();
+    uint32_t directory_count = reader.fixed<uint32_t>();
+    this->root = std::string(reader.string());
+    this->directories.reserve(directory_count);
+    for (uint32_t i = 0; i < directory_count; ++i) {
+      DirectoryHeader header{};
+      header.parent = reader.fixed<uint32_t>();
+      header.subtree_end = reader.fixed<uint32_t>();
+      header.mtime = reader.fixed<int64_t>();
+      header.name = reader.string();
+      if (header.parent > i || header.subtree_end > directory_count) {
+        throw IndexException("Malformed index directory table");
+      }
+      this->directories.push_back(header);
+    }
+    uint32_t tombstone_count = reader.fixed<uint32_t>();
+    for (uint32_t i = 0; i < tombstone_count; ++i) {
+      bool subtree = reader.fixed<uint8_t>() != 0;
+      this->tombstones.push_back({std::string(reader.string()), subtree});
+    }
+    uint32_t summary_count = reader.fixed<uint32_t>();
+    for (uint32_t i = 0; i < summary_count; ++i) {
+      SubtreeSummary summary{};
+      summary.directory = reader.fixed<uint32_t>();
+      summary.bits_log2 = reader.fixed<uint8_t>();
+      if (summary.directory >= directory_count ||
+          summary.bits_log2 < 6 || summary.bits_log2 > 16 ||
+          (i > 0 && summary.directory <= this->summaries.back().directory)) {
+        throw IndexException("Malformed index subtree summary");
+      }
+      summary.bits = reader.take((size_t{1} << summary.bits_log2) / 8);
+      this->summaries.push_back(summary);
+    }
+    this->blocks.reserve(block_count);
+    for (uint64_t i = 0; i < block_count; ++i) {
+      BlockHeader header{};
+      header.payload_offset = reader.fixed<uint64_t>();
+      header.payload_size = reader.fixed<uint32_t>();
+      header.entry_count = reader.fixed<uint32_t>();
+      for (uint64_t &bits : header.name_bytes.bits) {
+        bits = reader.fixed<uint64_t>();
+      }
+      header.min_mtime = reader.fixed<int64_t>();
+      header.max_mtime = reader.fixed<int64_t>();
+      header.min_size = reader.fixed<uint64_t>();
+      header.max_size = reader.fixed<uint64_t>();
+      header.first_directory = reader.fixed<uint32_t>();
+      header.first_name = reader.string();
+      if (header.entry_count == 0 ||
+          header.entry_count > max_entries_per_block) {
+        throw IndexException("Malformed index block header");
+      }
+      this->blocks.push_back(header);
+    }
+    this->payload = reader.data.substr(reader.pos);
+  }
+
+  /// @brief Finds the indexed files below `query.prefix` within the query's
+  /// time and size ranges whose names contain at least one of the query's
+  /// substrings. Only the blocks holding files of that subtree are visited,
+  /// less those of subtrees whose summary rules out every substring, and
+  /// names are only matched for files that satisfy the ranges.
+  std::vector<IndexMatch> query(const IndexQuery &query,
+                                IndexQueryStats *stats = nullptr) const {
+    std::vector<IndexMatch> matches;
+    std::optional<uint32_t> found_subtree = this->find_directory(query.prefix);
+    if (!found_subtree) {
+      throw IndexException(
+          std::format("\"{}\" is not in the index", query.prefix));
+    }
+    uint32_t subtree = *found_subtree;
+    uint32_t subtree_end = this->directories[subtree].subtree_end;
+    std::vector<ByteSet> needed(query.substrings.size());
+    for (size_t i = 0; i < query.substrings.size(); ++i) {
+      needed[i].add(query.substrings[i]);
+    }
+
+    std::string name;
+    std::string directory_path;
+    uint32_t directory_path_id = subtree_end; // None resolved yet.
+    std::vector<size_t> candidates;
+    std::array<int64_t, max_entries_per_block> mtimes;
+    std::array<uint64_t, max_entries_per_block> sizes;
+    std::array<uint8_t, max_entries_per_block> selected;
+    for (auto [first, end] : this->unskipped_ranges(query, subtree, stats)) {
+      // The first block that may hold files of [first, end) is the last one
+      // starting before it.
+      auto block = std::lower_bound(
+          this->blocks.begin(), this->blocks.end(), first,
+          [](const BlockHeader &header, uint32_t directory) {
+            return header.first_directory < directory;
+          });
+      if (block != this->blocks.begin()) {
+        --block;
+      }
+      for (; block != this->blocks.end(); ++block) {
+        if (block->first_directory >= end) {
+          break;
+        }
+        if (block->max_mtime < query.min_mtime ||
+            block->min_mtime > query.max_mtime ||
+            block->max_size < query.min_size ||
+            block->min_size > query.max_size) {
+          if (stats != nullptr) {
+            ++stats->blocks_skipped;
+          }
+          continue;
+        }
+        candidates.clear();
+        for (size_t i = 0; i < needed.size(); ++i) {
+          if (block->name_bytes.contains(needed[i])) {
+            candidates.push_back(i);
+          }
+        }
+        if (candidates.empty()) {
+          if (stats != nullptr) {
+            ++stats->blocks_skipped;
+          }
+          continue;
+        }
+
+        // Compare the columns of the whole block before looking at any name.
+        // The loop is branch free so that the compiler can vectorize it.
+        ByteReader reader(
+            this->payload.substr(block->payload_offset, block->payload_size));
+        uint32_t count = block->entry_count;
+        std::memcpy(mtimes.data(), reader.take(count * sizeof(int64_t)).data(),
+                    count * sizeof(int64_t));
+        std::memcpy(sizes.data(), reader.take(count * sizeof(uint64_t)).data(),
+                    count * sizeof(uint64_t));
+        uint32_t selected_count = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+          selected[i] = (mtimes[i] >= query.min_mtime) &
+                        (mtimes[i] <= query.max_mtime) &
+                        (sizes[i] >= query.min_size) &
+                        (sizes[i] <= query.max_size);
+          selected_count += selected[i];
+        }
+        if (selected_count == 0) {
+          if (stats != nullptr) {
+            ++stats->blocks_skipped;
+          }
+          continue;
+        }
+        if (stats != nullptr) {
+          ++stats->blocks_scanned;
+        }
+
+        // Decode and match in a single pass over the block, reusing `name`.
+        uint32_t directory = block->first_directory;
+        name.assign(block->first_name);
+        for (uint32_t entry = 0; entry < block->entry_count; ++entry) {
+          if (entry > 0) {
+            directory += static_cast<uint32_t>(reader.varint());
+            size_t shared = reader.varint();
+            std::string_view suffix = reader.take(reader.varint());
+            if (shared > name.size()) {
+              throw IndexException("Malformed index block");
+            }
+            name.resize(shared);
+            name.append(suffix);
+          }
+          if (directory >= end) {
+            break;
+          } else if (directory < first || !selected[entry]) {
+            continue;
+          }
+          PatternMask found;
+          for (size_t i : candidates) {
+            if (name.find(query.substrings[i]) != std::string::npos) {
+              found.set(i);
+            }
+          }
+          if (found.any()) {
+            if (directory != directory_path_id) {
+              directory_path = this->directory_path(directory);
+              directory_path_id = directory;
+            }
+            matches.push_back(IndexMatch{
+                directory_path.empty() ? name : directory_path + "/" + name,
+                found});
+          }
+        }
+      }
+    }
+    return matches;
+  }
+
+  /// @brief Converts a directory below the index root into the root relative
+  /// prefix used by IndexQuery.
+  std::string relative_prefix(const fs::path &directory) const {
+    return index_prefix(this->root, directory);
+  }
+
+  /// @brief Resolves a root relative prefix to its directory id by walking
+  /// down from the root. Children are the ids following a directory, each
+  /// one's subtree skipped over to reach the next.
+  std::optional<uint32_t> find_directory(std::string_view prefix) const {
+    uint32_t id = 0;
+    for (auto part : std::views::split(prefix, '/')) {
+      std::string_view component(part.begin(), part.end());
+      if (component.empty()) {
+        continue;
+      }
+      uint32_t child = id + 1;
+      while (child < this->directories[id].subtree_end &&
+             this->directories[child].name != component) {
+        child = this->directories[child].subtree_end;
+      }
+      if (child >= this->directories[id].subtree_end) {
+        return std::nullopt;
+      }
+      id = child;
+    }
+    return id;
+  }
+
+  /// @brief Decodes the index back into the tree it was written from. Only
+  /// the folders and tombstones are decoded unless `with_files` is set.
+  IndexTree decode(bool with_files = true) const {
+    IndexTree tree;
+    for (const DirectoryHeader &header : this->directories) {
+      tree.directories.push_back({header.parent, header.subtree_end,
+                                  std::string(header.name), header.mtime});
+    }
+    tree.tombstones = this->tombstones;
+    if (!with_files) {
+      return tree;
+    }
+    tree.files.reserve(this->entry_count);
+    for (const BlockHeader &block : this->blocks) {
+      ByteReader reader(
+          this->payload.substr(block.payload_offset, block.payload_size));
+      std::string_view mtimes = reader.take(block.entry_count * 8);
+      std::string_view sizes = reader.take(block.entry_count * 8);
+      uint32_t directory = block.first_directory;
+      std::string name(block.first_name);
+      for (uint32_t entry = 0; entry < block.entry_count; ++entry) {
+        if (entry > 0) {
+          directory += static_cast<uint32_t>(reader.varint());
+          size_t shared = reader.varint();
+          std::string_view suffix = reader.take(reader.varint());
+          if (shared > name.size()) {
+            throw IndexException("Malformed index block");
+          }
+          name.resize(shared);
+          name.append(suffix);
+        }
+        IndexTree::File file{directory, name, 0, 0};
+        std::memcpy(&file.mtime, mtimes.data() + entry * 8, 8);
+        std::memcpy(&file.size, sizes.data() + entry * 8, 8);
+        tree.files.push_back(std::move(file));
+      }
+    }
+    return tree;
+  }
+
+  /// @brief Root relative, '/' separated path of a directory.
+  std::string directory_path(uint32_t id) const {
+    std::vector<std::string_view> parts;
+    for (; id != 0; id = this->directories[id].parent) {
+      parts.push_back(this->directories[id].name);
+    }
+    std::string path;
+    for (auto part = parts.rbegin(); part != parts.rend(); ++part) {
+      if (!path.empty()) {
+        path += '/';
+      }
+      path += *part;
+    }
+    return path;
+  }
+
+  std::string root;
+  uint64_t entry_count = 0;
+  std::vector<IndexTree::Tombstone> tombstones;
+
+private:
+  /// @brief Adds a summary of every directory whose subtree holds more than
+  /// `entries_per_block` files to `out`.
+  static void write_summaries(ByteWriter &out, const IndexTree &tree,
+                              uint32_t entries_per_block) {
+    // Files are ordered by directory, so a subtree's files are contiguous.
+    auto first_file = [&](uint32_t directory) {
+      return std::ranges::lower_bound(tree.files, directory, {},
+                                      &IndexTree::File::directory) -
+             tree.files.begin();
+    };
+    ByteWriter summaries;
+    uint32_t summary_count = 0;
+    std::vector<uint64_t> present(65536 / 64);
+    for (uint32_t id = 0; id < tree.directories.size(); ++id) {
+      size_t first = first_file(id);
+      size_t end = first_file(tree.directories[id].subtree_end);
+      if (end - first <= entries_per_block) {
+        continue;
+      }
+      std::ranges::fill(present, 0);
+      for (size_t i = first; i < end; ++i) {
+        for (uint16_t bigram : bigrams(tree.files[i].name)) {
+          present[bigram / 64] |= uint64_t{1} << (bigram % 64);
+        }
+      }
+      size_t distinct = 0;
+      for (uint64_t word : present) {
+        distinct += std::popcount(word);
+      }
+      // About 8 bits per pair keeps false positives near 1 in 9 per pair.
+      uint8_t bits_log2 = static_cast<uint8_t>(std::clamp<size_t>(
+          std::bit_width(distinct * 8 - 1), 6, 16));
+      std::vector<uint64_t> bits((size_t{1} << bits_log2) / 64);
+      for (uint32_t bigram = 0; bigram < 65536; ++bigram) {
+        if (present[bigram / 64] >> (bigram % 64) & 1) {
+          uint32_t bit =
+              summary_bit(static_cast<uint16_t>(bigram), bits_log2);
+          bits[bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+      }
+      summaries.fixed<uint32_t>(id);
+      summaries.fixed<uint8_t>(bits_log2);
+      for (uint64_t word : bits) {
+        summaries.fixed<uint64_t>(word);
+      }
+      ++summary_count;
+    }
+    out.fixed<uint32_t>(summary_count);
+    out.out.append(summaries.out);
+  }
+
+  /// @brief Splits the ids of `subtree` into the ranges left once the
+  /// subtrees whose summary lacks a byte pair of every substring are taken
+  /// out. A substring shorter than two bytes rules nothing out.
+  std::vector<std::pair<uint32_t, uint32_t>>
+  unskipped_ranges(const IndexQuery &query, uint32_t subtree,
+                   IndexQueryStats *stats) const {
+    uint32_t subtree_end = this->directories[subtree].subtree_end;
+    std::vector<std::vector<uint16_t>> pairs;
+    for (const std::string &substring : query.substrings) {
+      pairs.push_back(bigrams(substring));
+    }
+    bool prunable = std::ranges::none_of(
+        pairs, [](const auto &bigrams) { return bigrams.empty(); });
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    uint32_t first = subtree;
+    auto summary = std::ranges::lower_bound(this->summaries, subtree, {},
+                                            &SubtreeSummary::directory);
+    for (; prunable && summary != this->summaries.end() &&
+           summary->directory < subtree_end;
+         ++summary) {
+      // Summaries below `first` are inside a subtree already skipped.
+      if (summary->directory < first ||
+          std::ranges::any_of(pairs, [&](const auto &bigrams) {
+            return std::ranges::all_of(bigrams, [&](uint16_t bigram) {
+              return summary->contains(bigram);
+            });
+          })) {
+        continue;
+      }
+      if (summary->directory > first) {
+        ranges.emplace_back(first, summary->directory);
+      }
+      first = this->directories[summary->directory].subtree_end;
+      if (stats != nullptr) {
+        ++stats->subtrees_skipped;
+      }
+    }
+    if (first < subtree_end) {
+      ranges.emplace_back(first, subtree_end);
+    }
+    return ranges;
+  }
+
+  MappedFile file;
+  std::vector<DirectoryHeader> directories;
+  std::vector<SubtreeSummary> summaries; // Sorted by directory.
+  std::vector<BlockHeader> blocks;
+  std::string_view payload;
+};
+
+/// @brief Compares root relative paths component by component. This orders
+/// folders depth first, with the children of a folder sorted by name, so a
+/// folder's subtree directly follows it.
+struct PathOrder {
+  using is_transparent = void;
+
+  bool operator()(std::string_view a, std::string_view b) const {
+    auto [a_end, b_end] = std::mismatch(a.begin(), a.end(), b.begin(), b.end());
+    if (a_end == a.end() || b_end == b.end()) {
+      return a_end == a.end() && b_end != b.end();
+    }
+    if (*a_end == '/' || *b_end == '/') {
+      return *a_end == '/';
+    }
+    return static_cast<uint8_t>(*a_end) < static_cast<uint8_t>(*b_end);
+  }
+};
+
+/// @brief Returns true if `path` is `folder` or below it.
+inline bool is_at_or_below(std::string_view path, std::string_view folder) {
+  return folder.empty() || path == folder ||
+         (path.starts_with(folder) && path[folder.size()] == '/');
+}
+
+inline std::string parent_folder(std::string_view path) {
+  size_t slash = path.rfind('/');
+  return std::string(slash == std::string_view::npos ? ""
+                                                     : path.substr(0, slash));
+}
+
+/// @brief Assembles an IndexTree from folders keyed by root relative path,
+/// added in any order. Used to merge the layers of an index and to write
+/// partial trees.
+struct IndexTreeBuilder {
+  struct Folder {
+    int64_t mtime = IndexTree::unknown_mtime;
+    std::vector<IndexTree::File> files; // `directory` is set by build().
+  };
+
+  IndexTreeBuilder() { this->folders[""]; }
+
+  /// @brief Returns the folder at `path`, adding it and its ancestors if they
+  /// are missing.
+  Folder &folder(const std::string &path) {
+    auto itr = this->folders.find(path);
+    if (itr != this->folders.end()) {
+      return itr->second;
+    }
+    this->folder(parent_folder(path));
+    return this->folders[path];
+  }
+
+  /// @brief Removes the folder at `path` and everything below it.
+  void remove_subtree(const std::string &path) {
+    auto first = this->folders.lower_bound(path);
+    auto last = first;
+    while (last != this->folders.end() && is_at_or_below(last->first, path)) {
+      ++last;
+    }
+    this->folders.erase(first, last);
+    this->folders[""];
+  }
+
+  /// @brief Applies a layer of an index on top of the folders so far: first
+  /// its tombstones, then its folders and files.
+  void apply(const IndexTree &layer) {
+    for (const IndexTree::Tombstone &tombstone : layer.tombstones) {
+      if (tombstone.subtree) {
+        this->remove_subtree(tombstone.path);
+      } else if (auto itr = this->folders.find(tombstone.path);
+                 itr != this->folders.end()) {
+        itr->second.files.clear();
+      }
+    }
+    this->add("", layer);
+  }
+
+  /// @brief Adds `tree`, scanned from the folder at `path`, below `path`.
+  void add(const std::string &path, const IndexTree &tree) {
+    std::vector<std::string> paths = tree.directory_paths();
+    for (std::string &relative : paths) {
+      relative = path.empty()       ? relative
+                 : relative.empty() ? path
+                                    : path + "/" + relative;
+    }
+    for (size_t id = 0; id < tree.directories.size(); ++id) {
+      if (tree.directories[id].mtime != IndexTree::unknown_mtime) {
+        this->folder(paths[id]).mtime = tree.directories[id].mtime;
+      }
+    }
+    for (const IndexTree::File &file : tree.files) {
+      this->folder(paths[file.directory]).files.push_back(file);
+    }
+  }
+
+  IndexTree build() const {
+    IndexTree tree;
+    std::vector<std::pair<std::string_view, uint32_t>> ancestors;
+    auto close = [&tree, &ancestors]() {
+      tree.directories[ancestors.back().second].subtree_end =
+          static_cast<uint32_t>(tree.directories.size());
+      ancestors.pop_back();
+    };
+    for (const auto &[path, folder] : this->folders) {
+      while (!ancestors.empty() &&
+             !is_at_or_below(path, ancestors.back().first)) {
+        close();
+      }
+      uint32_t id = static_cast<uint32_t>(tree.directories.size());
+      uint32_t parent = ancestors.empty() ? 0 : ancestors.back().second;
+      size_t slash = path.rfind('/');
+      tree.directories.push_back(
+          {parent, 0,
+           slash == std::string::npos ? path : path.substr(slash + 1),
+           folder.mtime});
+      ancestors.emplace_back(path, id);
+
+      size_t first_file = tree.files.size();
+      for (IndexTree::File file : folder.files) {
+        file.directory = id;
+        tree.files.push_back(std::move(file));
+      }
+      std::sort(tree.files.begin() + first_file, tree.files.end(),
+                [](const IndexTree::File &a, const IndexTree::File &b) {
+                  return a.name < b.name;
+                });
+    }
+    while (!ancestors.empty()) {
+      close();
+    }
+    return tree;
+  }
+
+  std::map<std::string, Folder, PathOrder> folders;
+};
+
+struct IndexRefreshStats {
+  size_t shards_kept = 0;
+  size_t shards_updated = 0; // Shards that were given a new segment.
+  size_t shards_added = 0;
+  size_t shards_removed = 0;
+  size_t shards_compacted = 0;
+};
+
+// Trigram index of the contents of the files of one index layer, kept in a
+// file next to the layer with the extension ".tri". Every trigram (three
+// consecutive bytes) of a file's contents has a posting list of the files
+// that contain it. A query for a text intersects the lists of the text's
+// trigrams; the files left are candidates that still have to be read to
+// confirm the match. Files that are too large or hold a NUL byte (binary
+// files) aren't indexed; they are listed as skipped and are candidates for
+// every query, so reading them decides.
+//
+// Layout (native byte order):
+//   magic "FFTRIGR2", u32 file_count, u32 trigram_count, u32 skipped_count,
+//   u32 name_ends[file_count], names (root relative paths, concatenated),
+//   u32 skipped[skipped_count] (ordinals of the skipped files, ascending),
+//   trigram_count x { u32 trigram, u32 file_count, u64 offset },
+//   postings: per trigram, the ordinals of its files as varint deltas.
+struct ContentIndex {
+  static constexpr std::string_view magic = "FFTRIGR2";
+  static constexpr uint64_t max_file_size = 16 << 20;
+  // Files read into one set of postings by one thread before merging.
+  static constexpr size_t files_per_segment = 256;
+
+  using Trigram = uint32_t;
+  // Trigram -> ordinals of the files containing it, ascending.
+  using Postings = std::map<Trigram, std::vector<uint32_t>>;
+
+  // What the files of a layer hold: the postings of the indexed files and
+  // the ordinals of the skipped ones, ascending.
+  struct Contents {
+    Postings postings;
+    std::vector<uint32_t> skipped;
+  };
+
+  /// @brief Returns the distinct trigrams of `text`, sorted.
+  static std::vector<Trigram> trigrams(std::string_view text) {
+    std::vector<Trigram> found;
+    for (size_t i = 0; i + 3 <= text.size(); ++i) {
+      found.push_back(pack(text.substr(i, 3)));
+    }
+    std::ranges::sort(found);
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+  }
+
+  /// @brief Returns the root relative paths of the files of `tree`, in its
+  /// order.
+  static std::vector<std::string> file_paths(const IndexTree &tree) {
+    std::vector<std::string> directories = tree.directory_paths();
+    std::vector<std::string> paths;
+    paths.reserve(tree.files.size());
+    for (const IndexTree::File &file : tree.files) {
+      const std::string &directory = directories[file.directory];
+      paths.push_back(directory.empty() ? file.name
+                                        : directory + "/" + file.name);
+    }
+    return paths;
+  }
+
+  /// @brief Reads `files` (relative to `root`) and returns their contents.
+  /// The files are split into segments, each read into postings of its own
+  /// by one thread; the segments are then merged in order.
+  static Contents scan(const fs::path &root,
+                       const std::vector<std::string> &files) {
+    size_t segment_count =
+        (files.size() + files_per_segment - 1) / files_per_segment;
+    std::vector<Contents> segments(segment_count);
+    parallel_for(segment_count, [&](size_t segment) {
+      // One bit per possible trigram, to find a file's distinct trigrams.
+      std::vector<uint64_t> seen(1 << 18);
+      std::vector<Trigram> found;
+      size_t end = std::min(files.size(), (segment + 1) * files_per_segment);
+      for (size_t file = segment * files_per_segment; file < end; ++file) {
+        fs::path path = root / files[file];
+        std::optional<MappedFile> contents = open_text(path);
+        if (!contents ||
+            contents->bytes().find('\0') != std::string_view::npos) {
+          std::error_code error;
+          if (fs::is_regular_file(path, error)) {
+            segments[segment].skipped.push_back(static_cast<uint32_t>(file));
+          }
+          continue;
+        }
+        std::string_view text = contents->bytes();
+        for (size_t i = 0; i + 3 <= text.size(); ++i) {
+          Trigram trigram = pack(text.substr(i, 3));
+          uint64_t bit = uint64_t{1} << (trigram % 64);
+          if ((seen[trigram / 64] & bit) == 0) {
+            seen[trigram / 64] |= bit;
+            found.push_back(trigram);
+          }
+        }
+        for (Trigram trigram : found) {
+          segments[segment].postings[trigram].push_back(
+              static_cast<uint32_t>(file));
+          seen[trigram / 64] = 0;
+        }
+        found.clear();
+      }
+    });
+    // Segments hold increasing ranges of files, so appending them in order
+    // keeps every list sorted.
+    Contents result;
+    for (Contents &segment : segments) {
+      for (auto &[trigram, ordinals] : segment.postings) {
+        std::vector<uint32_t> &list = result.postings[trigram];
+        list.insert(list.end(), ordinals.begin(), ordinals.end());
+      }
+      result.skipped.insert(result.skipped.end(), segment.skipped.begin(),
+                            segment.skipped.end());
+    }
+    return result;
+  }
+
+  /// @brief Merges the contents of the layers of a shard, oldest first, into
+  /// contents of `files`, the files of the merged layers. A file's postings
+  /// (or its being skipped) are taken from the newest layer that holds it.
+  static Contents merge(const std::vector<const ContentIndex *> &layers,
+                        const std::vector<std::string> &files) {
+    std::unordered_map<std::string_view, uint32_t> ordinals;
+    for (size_t i = 0; i < files.size(); ++i) {
+      ordinals.emplace(files[i], static_cast<uint32_t>(i));
+    }
+    std::vector<char> claimed(files.size());
+    std::vector<std::vector<std::optional<uint32_t>>> remap(layers.size());
+    for (size_t layer = layers.size(); layer-- > 0;) {
+      remap[layer].resize(layers[layer]->size());
+      for (uint32_t file = 0; file < layers[layer]->size(); ++file) {
+        auto itr = ordinals.find(layers[layer]->file(file));
+        if (itr != ordinals.end() && !claimed[itr->second]) {
+          claimed[itr->second] = 1;
+          remap[layer][file] = itr->second;
+        }
+      }
+    }
+    Contents result;
+    for (size_t layer = 0; layer < layers.size(); ++layer) {
+      for (uint32_t i = 0; i < layers[layer]->trigram_count; ++i) {
+        Entry entry = layers[layer]->entry(i);
+        std::vector<uint32_t> *list = nullptr;
+        for (uint32_t file : layers[layer]->decode(entry)) {
+          if (remap[layer][file]) {
+            if (list == nullptr) {
+              list = &result.postings[entry.trigram];
+            }
+            list->push_back(*remap[layer][file]);
+          }
+        }
+      }
+      for (uint32_t file : layers[layer]->skipped_files()) {
+        if (remap[layer][file]) {
+          result.skipped.push_back(*remap[layer][file]);
+        }
+      }
+    }
+    for (auto &[trigram, list] : result.postings) {
+      std::ranges::sort(list);
+    }
+    std::ranges::sort(result.skipped);
+    return result;
+  }
+
+  static void write(const fs::path &path,
+                    const std::vector<std::string> &files,
+                    const Contents &contents) {
+    const Postings &postings = contents.postings;
+    ByteWriter header;
+    header.out.append(magic);
+    header.fixed<uint32_t>(static_cast<uint32_t>(files.size()));
+    header.fixed<uint32_t>(static_cast<uint32_t>(postings.size()));
+    header.fixed<uint32_t>(static_cast<uint32_t>(contents.skipped.size()));
+    uint32_t name_end = 0;
+    for (const std::string &file : files) {
+      name_end += static_cast<uint32_t>(file.size());
+      header.fixed<uint32_t>(name_end);
+    }
+    for (const std::string &file : files) {
+      header.out.append(file);
+    }
+    for (uint32_t ordinal : contents.skipped) {
+      header.fixed<uint32_t>(ordinal);
+    }
+    ByteWriter lists;
+    for (const auto &[trigram, ordinals] : postings) {
+      header.fixed<uint32_t>(trigram);
+      header.fixed<uint32_t>(static_cast<uint32_t>(ordinals.size()));
+      header.fixed<uint64_t>(lists.out.size());
+      uint32_t previous = 0;
+      for (uint32_t ordinal : ordinals) {
+        lists.varint(ordinal - previous);
+        previous = ordinal;
+      }
+    }
+    write_file_atomically(path, {header.out, lists.out});
+  }
+
+  /// @brief Writes the content index of `tree`, scanned from `root`.
+  static void write(const fs::path &path, const fs::path &root,
+                    const IndexTree &tree) {
+    std::vector<std::string> files = file_paths(tree);
+    write(path, files, scan(root, files));
+  }
+
+  ContentIndex(const fs::path &path) : mapped(path) {
+    ByteReader reader(this->mapped.bytes());
+    if (reader.data.substr(0, magic.size()) != magic) {
+      throw IndexException(
+          std::format("\"{}\" is not a content index", path.string()));
+    }
+    reader.take(magic.size());
+    this->file_count = reader.fixed<uint32_t>();
+    this->trigram_count = reader.fixed<uint32_t>();
+    this->skipped_count = reader.fixed<uint32_t>();
+    this->name_ends = reader.take(this->file_count * sizeof(uint32_t));
+    uint32_t names_size =
+        this->file_count == 0 ? 0 : this->read<uint32_t>(this->name_ends,
+                                                         this->file_count - 1);
+    this->names = reader.take(names_size);
+    this->skipped = reader.take(this->skipped_count * sizeof(uint32_t));
+    this->entries = reader.take(this->trigram_count * sizeof(Entry));
+    this->postings = reader.data.substr(reader.pos);
+  }
+
+  uint32_t size() const { return this->file_count; }
+
+  /// @brief Whether the regular file at `path` contains `text`.
+  static bool contains(const fs::path &path, std::string_view text) {
+    std::error_code error;
+    if (!fs::is_regular_file(path, error)) {
+      return false;
+    }
+    try {
+      MappedFile file(path);
+      std::string_view bytes = file.bytes();
+      return std::search(bytes.begin(), bytes.end(),
+                         std::boyer_moore_horspool_searcher(
+                             text.begin(), text.end())) != bytes.end();
+    } catch (const IndexException &) {
+      return false;
+    }
+  }
+
+  /// @brief Returns the root relative path of file `ordinal`.
+  std::string_view file(uint32_t ordinal) const {
+    uint32_t begin =
+        ordinal == 0 ? 0 : this->read<uint32_t>(this->name_ends, ordinal - 1);
+    uint32_t end = this->read<uint32_t>(this->name_ends, ordinal);
+    return this->names.substr(begin, end - begin);
+  }
+
+  /// @brief Returns the ordinals of the files that weren't indexed,
+  /// ascending.
+  std::vector<uint32_t> skipped_files() const {
+    std::vector<uint32_t> ordinals(this->skipped_count);
+    for (uint32_t i = 0; i < this->skipped_count; ++i) {
+      ordinals[i] = this->read<uint32_t>(this->skipped, i);
+    }
+    return ordinals;
+  }
+
+  /// @brief Returns the ordinals of the files that may contain `text`, or
+  /// nothing if any file may (the text is shorter than a trigram). The
+  /// skipped files are always among them.
+  std::optional<std::vector<uint32_t>> candidates(std::string_view text) const {
+    std::vector<Trigram> needed = trigrams(text);
+    if (needed.empty()) {
+      return std::nullopt;
+    }
+    std::vector<Entry> found;
+    for (Trigram trigram : needed) {
+      std::optional<Entry> entry = this->find(trigram);
+      if (!entry) {
+        return this->skipped_files();
+      }
+      found.push_back(*entry);
+    }
+    // Shortest lists first, so that the intersection shrinks quickly.
+    std::ranges::sort(found, {}, &Entry::file_count);
+    std::vector<uint32_t> result = this->decode(found.front());
+    std::vector<uint32_t> next;
+    for (size_t i = 1; i < found.size() && !result.empty(); ++i) {
+      std::vector<uint32_t> list = this->decode(found[i]);
+      next.clear();
+      std::ranges::set_intersection(result, list, std::back_inserter(next));
+      std::swap(result, next);
+    }
+    next.clear();
+    std::ranges::set_union(result, this->skipped_files(),
+                           std::back_inserter(next));
+    return next;
+  }
+
+private:
+  struct Entry {
+    uint32_t trigram;
+    uint32_t file_count;
+    uint64_t offset;
+  };
+  static_assert(sizeof(Entry) == 16);
+
+  static Trigram pack(std::string_view bytes) {
+    return static_cast<uint32_t>(static_cast<uint8_t>(bytes[0])) << 16 |
+           static_cast<uint32_t>(static_cast<uint8_t>(bytes[1])) << 8 |
+           static_cast<uint8_t>(bytes[2]);
+  }
+
+  /// @brief Maps `path` if it is a regular file small enough to index.
+  static std::optional<MappedFile> open_text(const fs::path &path) {
+    std::error_code error;
+    fs::file_status status = fs::status(path, error);
+    if (error || !fs::is_regular_file(status) ||
+        fs::file_size(path, error) > max_file_size || error) {
+      return std::nullopt;
+    }
+    try {
+      return std::optional<MappedFile>(std::in_place, path);
+    } catch (const IndexException &) {
+      return std::nullopt;
+    }
+  }
+
+  template <typename T>
+  static T read(std::string_view data, size_t index) {
+    T value;
+    std::memcpy(&value, data.data() + index * sizeof(T), sizeof(T));
+    return value;
+  }
+
+  Entry entry(uint32_t index) const {
+    return this->read<Entry>(this->entries, index);
+  }
+
+  std::optional<Entry> find(Trigram trigram) const {
+    uint32_t first = 0;
+    uint32_t last = this->trigram_count;
+    while (first < last) {
+      uint32_t middle = first + (last - first) / 2;
+      if (this->entry(middle).trigram < trigram) {
+        first = middle + 1;
+      } else {
+        last = middle;
+      }
+    }
+    if (first < this->trigram_count && this->entry(first).trigram == trigram) {
+      return this->entry(first);
+    }
+    return std::nullopt;
+  }
+
+  std::vector<uint32_t> decode(const Entry &entry) const {
+    ByteReader reader(this->postings.substr(entry.offset));
+    std::vector<uint32_t> ordinals(entry.file_count);
+    uint32_t ordinal = 0;
+    for (uint32_t &value : ordinals) {
+      ordinal += static_cast<uint32_t>(reader.varint());
+      value = ordinal;
+    }
+    return ordinals;
+  }
+
+  MappedFile mapped;
+  uint32_t file_count = 0;
+  uint32_t trigram_count = 0;
+  uint32_t skipped_count = 0;
+  std::string_view name_ends;
+  std::string_view names;
+  std::string_view skipped;
+  std::string_view entries;
+  std::string_view postings;
+};
+
+// A persistent index split into one shard per top-level folder of the root,
+// plus one for the files directly in the root. Shards are built, queried and
+// refreshed independently and in parallel; a query below a top-level folder
+// only opens that folder's shard.
+//
+// A shard is a stack of PathIndex layers: a base and the segments written by
+// later refreshes. A refresh only re-reads the folders whose modification
+// time changed (an entry was added, removed or renamed in them) and writes
+// them, plus any new folders, to a segment. The segment's tombstones hide
+// those folders' files, and folders that were removed, in the older layers.
+// Compaction merges a shard's layers back into a single base.
+//
+// Layers are never modified. Every refresh or compaction writes new layer
+// files named after a new epoch and publishes them by atomically renaming a
+// new manifest into place, so a reader sees either the old or the new
+// snapshot. Files that are no longer referenced are deleted afterwards;
+// readers that mapped them keep their mapping (where the platform allows it).
+//
+// The index is a folder holding the layers and a manifest:
+//   magic "FFSHARD2", u64 epoch, string root, u32 shard_count,
+//   shard_count x { string name, u32 layer_count, layer_count x string file }
+// where `name` is the top-level folder (empty for the root's own files) and
+// the layer files are ordered oldest (the base) first.
+struct ShardedIndex {
+  static constexpr std::string_view magic = "FFSHARD2";
+  static constexpr std::string_view manifest_name = "MANIFEST";
+  // Shards with this many layers (a base and segments) are compacted.
+  static constexpr size_t compaction_layers = 5;
+
+  struct Shard {
+    std::string name;
+    std::vector<std::string> files;
+    std::vector<std::unique_ptr<PathIndex>> layers;
+    // Content index of each layer, or nullptr if it has none.
+    std::vector<std::unique_ptr<ContentIndex>> contents;
+  };
+
+  /// @brief Writes a new index of `root` to the folder `index_dir`, with a
+  /// content index of every layer if `content` is set.
+  /// @return The number of indexed files.
+  static size_t build(const fs::path &index_dir, const fs::path &root,
+                      bool content = false) {
+    fs::create_directories(index_dir);
+    uint64_t epoch = 1;
+    if (fs::exists(index_dir / manifest_name)) {
+      epoch = read_epoch(index_dir) + 1;
+    }
+    std::vector<std::string> names = top_level_names(root);
+    std::vector<Shard> shards(names.size());
+    std::vector<size_t> counts(names.size());
+    parallel_for(names.size(), [&](size_t i) {
+      shards[i].name = names[i];
+      shards[i].files = {build_base(index_dir, root, names[i], epoch,
+                                    content, &counts[i])};
+    });
+    publish(index_dir, root, epoch, shards);
+    return std::reduce(counts.begin(), counts.end());
+  }
+
+  /// @brief Brings the index in `index_dir` up to date with its root. Shards
+  /// of new top-level folders are built, those of removed folders dropped,
+  /// and the changed folders of the others are written to a new segment.
+  static IndexRefreshStats refresh(const fs::path &index_dir) {
+    ShardedIndex current(index_dir);
+    if (current.root ==
+        fs::absolute(index_dir).lexically_normal().generic_string()) {
+      throw IndexException(std::format(
+          "\"{}\" is a fleet index, import bundles into it instead",
+          index_dir.string()));
+    }
+    uint64_t epoch = current.epoch + 1;
+    fs::path root = current.root;
+    bool content = current.has_contents();
+    std::vector<std::string> names = top_level_names(root);
+    std::vector<Shard> shards(names.size());
+    std::vector<char> added(names.size());
+    std::vector<char> updated(names.size());
+    parallel_for(names.size(), [&](size_t i) {
+      const Shard *shard = current.find_shard(names[i]);
+      shards[i].name = names[i];
+      if (shard == nullptr) {
+        shards[i].files = {
+            build_base(index_dir, root, names[i], epoch, content)};
+        added[i] = 1;
+        return;
+      }
+      shards[i].files = shard->files;
+      fs::path shard_root = names[i].empty() ? root : root / names[i];
+      std::optional<IndexTree> segment =
+          changed_folders(*shard, shard_root, !names[i].empty());
+      if (segment) {
+        std::string file = layer_file(names[i], epoch);
+        PathIndex::write(index_dir / file, shard_root, *segment);
+        if (content) {
+          ContentIndex::write(index_dir / content_file(file), shard_root,
+                              *segment);
+        }
+        shards[i].files.push_back(file);
+        updated[i] = 1;
+      }
+    });
+
+    IndexRefreshStats stats;
+    stats.shards_added = std::ranges::count(added, 1);
+    stats.shards_updated = std::ranges::count(updated, 1);
+    stats.shards_kept =
+        names.size() - stats.shards_added - stats.shards_updated;
+    stats.shards_removed =
+        current.shards.size() - (names.size() - stats.shards_added);
+    publish(index_dir, root, epoch, shards);
+    return stats;
+  }
+
+  /// @brief Merges the layers of every shard that has at least `min_layers`
+  /// of them into a new base.
+  /// @return The number of shards compacted.
+  static size_t compact(const fs::path &index_dir, size_t min_layers = 2) {
+    ShardedIndex current(index_dir);
+    uint64_t epoch = current.epoch + 1;
+    std::vector<Shard> shards(current.shards.size());
+    std::vector<char> compacted(current.shards.size());
+    parallel_for(current.shards.size(), [&](size_t i) {
+      const Shard &shard = current.shards[i];
+      shards[i].name = shard.name;
+      shards[i].files = shard.files;
+      if (shard.layers.size() < std::max<size_t>(min_layers, 2)) {
+        return;
+      }
+      IndexTreeBuilder builder;
+      for (const std::unique_ptr<PathIndex> &layer : shard.layers) {
+        builder.apply(layer->decode());
+      }
+      std::string file = layer_file(shard.name, epoch);
+      IndexTree tree = builder.build();
+      PathIndex::write(index_dir / file, shard.layers.front()->root, tree);
+      if (has_contents(shard)) {
+        // The files' postings are carried over from the layers rather than
+        // read again.
+        std::vector<const ContentIndex *> contents;
+        for (const std::unique_ptr<ContentIndex> &layer : shard.contents) {
+          contents.push_back(layer.get());
+        }
+        std::vector<std::string> files = ContentIndex::file_paths(tree);
+        ContentIndex::write(index_dir / content_file(file), files,
+                            ContentIndex::merge(contents, files));
+      }
+      shards[i].files = {file};
+      compacted[i] = 1;
+    });
+    size_t count = std::ranges::count(compacted, 1);
+    if (count > 0) {
+      publish(index_dir, current.root, epoch, shards);
+    }
+    return count;
+  }
+
+  /// @brief A self-contained copy of the layers an index gained after epoch
+  /// `since`, tagged with the host it came from. Layers are copied as they
+  /// are: a shard whose base is newer than `since` is replaced by its
+  /// layers, any other shard gains its newer segments, and shards that are
+  /// not listed were removed. Layers are in the byte order of the host that
+  /// wrote them, which the bundle records so that a host of the other byte
+  /// order refuses it rather than misreading it.
+  struct Bundle {
+    static constexpr std::string_view magic = "FFBUNDL2";
+    static constexpr uint8_t byte_order =
+        std::endian::native == std::endian::little ? 'L' : 'B';
+
+    struct Layer {
+      std::string file;
+      std::string bytes;
+    };
+
+    struct Shard {
+      std::string name;
+      bool replace = false;
+      std::vector<Layer> layers;
+    };
+
+    static Bundle read(const fs::path &path) {
+      MappedFile file(path);
+      ByteReader reader(file.bytes());
+      if (reader.data.substr(0, magic.size()) != magic) {
+        throw IndexException(
+            std::format("\"{}\" is not an index bundle", path.string()));
+      }
+      reader.take(magic.size());
+      if (reader.fixed<uint8_t>() != byte_order) {
+        throw IndexException(std::format(
+            "\"{}\" was written on a host of another byte order",
+            path.string()));
+      }
+      Bundle bundle;
+      bundle.host = std::string(reader.string());
+      bundle.root = std::string(reader.string());
+      bundle.since = reader.fixed<uint64_t>();
+      bundle.epoch = reader.fixed<uint64_t>();
+      bundle.shards.resize(reader.fixed<uint32_t>());
+      for (Shard &shard : bundle.shards) {
+        shard.name = std::string(reader.string());
+        shard.replace = reader.fixed<uint8_t>() != 0;
+        shard.layers.resize(reader.fixed<uint32_t>());
+        for (Layer &layer : shard.layers) {
+          layer.file = std::string(reader.string());
+          layer.bytes = std::string(reader.take(reader.fixed<uint64_t>()));
+        }
+      }
+      return bundle;
+    }
+
+    void write(const fs::path &path) const {
+      ByteWriter header;
+      header.out.append(magic);
+      header.fixed<uint8_t>(byte_order);
+      header.string(this->host);
+      header.string(this->root);
+      header.fixed<uint64_t>(this->since);
+      header.fixed<uint64_t>(this->epoch);
+      header.fixed<uint32_t>(static_cast<uint32_t>(this->shards.size()));
+      std::vector<std::string_view> parts{header.out};
+      std::deque<ByteWriter> headers; // Stable references.
+      for (const Shard &shard : this->shards) {
+        ByteWriter &out = headers.emplace_back();
+        out.string(shard.name);
+        out.fixed<uint8_t>(shard.replace);
+        out.fixed<uint32_t>(static_cast<uint32_t>(shard.layers.size()));
+        parts.push_back(out.out);
+        for (const Layer &layer : shard.layers) {
+          ByteWriter &size = headers.emplace_back();
+          size.string(layer.file);
+          size.fixed<uint64_t>(layer.bytes.size());
+          parts.push_back(size.out);
+          parts.push_back(layer.bytes);
+        }
+      }
+      write_file_atomically(path, parts);
+    }
+
+    std::string host;
+    std::string root;
+    uint64_t since = 0; // 0: the whole index.
+    uint64_t epoch = 0;
+    std::vector<Shard> shards;
+  };
+
+  /// @brief Writes the layers `index_dir` gained after epoch `since` (all of
+  /// them if 0) to `bundle_path`, tagged with `host`.
+  /// @return The bundle, for its epoch and shard counts.
+  static Bundle export_bundle(const fs::path &index_dir,
+                              const fs::path &bundle_path,
+                              const std::string &host, uint64_t since = 0) {
+    ShardedIndex current(index_dir);
+    if (since > current.epoch) {
+      throw IndexException(std::format(
+          "\"{}\" is at epoch {}, not after {}", index_dir.string(),
+          current.epoch, since));
+    }
+    Bundle bundle{host, current.root, since, current.epoch, {}};
+    bundle.shards.resize(current.shards.size());
+    parallel_for(current.shards.size(), [&](size_t i) {
+      const Shard &shard = current.shards[i];
+      Bundle::Shard &out = bundle.shards[i];
+      out.name = shard.name;
+      out.replace = since == 0 || layer_epoch(shard.files.front()) > since;
+      for (const std::string &file : shard.files) {
+        if (out.replace || layer_epoch(file) > since) {
+          out.layers.push_back(
+              {file, std::string(MappedFile(index_dir / file).bytes())});
+        }
+      }
+    });
+    bundle.write(bundle_path);
+    return bundle;
+  }
+
+  /// @brief Imports bundles from any number of hosts into the fleet index in
+  /// `fleet_dir`. Each host's own index is kept below ".hosts" and brought
+  /// to the bundles' epoch (they must follow on from what was imported
+  /// before; bundles already imported are skipped), then its shards are
+  /// merged into one layer of the fleet index. Hosts are imported in
+  /// parallel, and the fleet index has one shard per host so that queries
+  /// see "<host>/<path below its root>".
+  /// @return The number of hosts updated.
+  static size_t import_bundles(const fs::path &fleet_dir,
+                               const std::vector<fs::path> &bundle_paths) {
+    std::map<std::string, std::vector<Bundle>> hosts;
+    for (const fs::path &path : bundle_paths) {
+      Bundle bundle = Bundle::read(path);
+      if (!is_host_tag(bundle.host)) {
+        throw IndexException(std::format("\"{}\" has an invalid host \"{}\"",
+                                         path.string(), bundle.host));
+      }
+      hosts[bundle.host].push_back(std::move(bundle));
+    }
+    fs::create_directories(fleet_dir);
+    uint64_t epoch = 1;
+    std::vector<Shard> shards;
+    if (fs::exists(fleet_dir / manifest_name)) {
+      ShardedIndex fleet(fleet_dir);
+      epoch = fleet.epoch + 1;
+      for (const Shard &shard : fleet.shards) {
+        shards.push_back({shard.name, shard.files, {}});
+      }
+    }
+
+    std::vector<std::pair<const std::string, std::vector<Bundle>> *> work;
+    for (auto &host : hosts) {
+      work.push_back(&host);
+    }
+    std::vector<std::string> files(work.size());
+    parallel_for(work.size(), [&](size_t i) {
+      const std::string &host = work[i]->first;
+      fs::path host_dir = fleet_dir / ".hosts" / host;
+      if (import_host(host_dir, work[i]->second)) {
+        files[i] = merge_host(host_dir, fleet_dir, layer_file(host, epoch));
+      }
+    });
+
+    size_t updated = 0;
+    for (size_t i = 0; i < work.size(); ++i) {
+      if (files[i].empty()) {
+        continue;
+      }
+      ++updated;
+      auto shard = std::ranges::find(shards, work[i]->first, &Shard::name);
+      if (shard == shards.end()) {
+        shards.push_back({work[i]->first, {}, {}});
+        shard = std::prev(shards.end());
+      }
+      shard->files = {files[i]};
+    }
+    std::ranges::sort(shards, {}, &Shard::name);
+    if (updated > 0) {
+      publish(fleet_dir, fleet_dir, epoch, shards);
+    }
+    return updated;
+  }
+
+  /// @brief Host tags name a folder of a fleet index.
+  static bool is_host_tag(std::string_view host) {
+    return !host.empty() && !host.starts_with('.') &&
+           std::ranges::all_of(host, [](char c) {
+             return std::isalnum(static_cast<unsigned char>(c)) ||
+                    c == '-' || c == '_' || c == '.';
+           });
+  }
+
+  /// @brief Opens the snapshot currently published in `index_dir`.
+  ShardedIndex(const fs::path &index_dir) {
+    // A writer may publish a new epoch and delete the files of this one
+    // between reading the manifest and opening its layers. Retry with the
+    // new manifest if so.
+    for (int attempt = 0;; ++attempt) {
+      try {
+        this->load(index_dir);
+        return;
+      } catch (const IndexException &) {
+        if (attempt == 2 || read_epoch(index_dir) == this->epoch) {
+          throw;
+        }
+      }
+    }
+  }
+
+  /// @brief Runs `query` on the shards that overlap its prefix in parallel
+  /// and returns their matches in shard (name) order.
+  std::vector<IndexMatch> query(const IndexQuery &query,
+                                IndexQueryStats *stats = nullptr) const {
+    std::string_view prefix = query.prefix;
+    std::string_view top_level = prefix.substr(0, prefix.find('/'));
+    std::vector<const Shard *> selected;
+    for (const Shard &shard : this->shards) {
+      if (prefix.empty() || (!shard.name.empty() && shard.name == top_level)) {
+        selected.push_back(&shard);
+      }
+    }
+
+    std::vector<std::optional<std::vector<IndexMatch>>> results(
+        selected.size());
+    std::vector<IndexQueryStats> shard_stats(selected.size());
+    parallel_for(selected.size(), [&](size_t i) {
+      IndexQuery shard_query = query;
+      shard_query.prefix =
+          prefix.size() > top_level.size()
+              ? std::string(prefix.substr(top_level.size() + 1))
+              : "";
+      results[i] = query_layers(*selected[i], shard_query, &shard_stats[i]);
+      if (results[i] && !selected[i]->name.empty()) {
+        for (IndexMatch &match : *results[i]) {
+          match.path = selected[i]->name + "/" + match.path;
+        }
+      }
+    });
+
+    std::vector<IndexMatch> matches;
+    bool found = prefix.empty();
+    for (size_t i = 0; i < selected.size(); ++i) {
+      if (results[i]) {
+        found = true;
+        std::move(results[i]->begin(), results[i]->end(),
+                  std::back_inserter(matches));
+      }
+      if (stats != nullptr) {
+        stats->blocks_scanned += shard_stats[i].blocks_scanned;
+        stats->blocks_skipped += shard_stats[i].blocks_skipped;
+        stats->subtrees_skipped += shard_stats[i].subtrees_skipped;
+      }
+    }
+    if (!found) {
+      throw IndexException(
+          std::format("\"{}\" is not in the index", query.prefix));
+    }
+    return matches;
+  }
+
+  /// @brief Runs `query` and keeps the matches whose contents hold `text`.
+  /// Matches that no content index lists as a candidate (skipped files
+  /// always are) are dropped without being read; the others are read to
+  /// confirm (in parallel). Shards without content indexes read every match.
+  std::vector<IndexMatch>
+  query_content(const IndexQuery &query, std::string_view text,
+                IndexQueryStats *stats = nullptr) const {
+    std::vector<IndexMatch> matches = this->query(query, stats);
+    // Shard -> shard relative paths of its candidates, or nothing if every
+    // file is one. Filled in for the shards that have matches.
+    std::map<const Shard *, std::optional<std::set<std::string_view>>>
+        candidates;
+    auto is_candidate = [&](const Shard &shard, std::string_view path) {
+      auto [itr, inserted] = candidates.try_emplace(&shard);
+      if (inserted && has_contents(shard)) {
+        itr->second.emplace();
+        for (const std::unique_ptr<ContentIndex> &layer : shard.contents) {
+          std::optional<std::vector<uint32_t>> ordinals =
+              layer->candidates(text);
+          if (!ordinals) {
+            itr->second.reset();
+            break;
+          }
+          for (uint32_t ordinal : *ordinals) {
+            itr->second->insert(layer->file(ordinal));
+          }
+        }
+      }
+      return !itr->second || itr->second->contains(path);
+    };
+
+    std::vector<IndexMatch> candidate_matches;
+    for (IndexMatch &match : matches) {
+      std::string_view path = match.path;
+      size_t slash = path.find('/');
+      const Shard *shard = slash == std::string_view::npos
+                               ? nullptr
+                               : this->find_shard(path.substr(0, slash));
+      if (shard != nullptr) {
+        path.remove_prefix(slash + 1);
+      } else {
+        shard = this->find_shard("");
+      }
+      if (shard != nullptr && is_candidate(*shard, path)) {
+        candidate_matches.push_back(std::move(match));
+      }
+    }
+    std::vector<char> found(candidate_matches.size());
+    parallel_for(candidate_matches.size(), [&](size_t i) {
+      found[i] = ContentIndex::contains(
+          fs::path(this->root) / candidate_matches[i].path, text);
+    });
+    if (stats != nullptr) {
+      stats->files_read += candidate_matches.size();
+    }
+    matches.clear();
+    for (size_t i = 0; i < candidate_matches.size(); ++i) {
+      if (found[i]) {
+        matches.push_back(std::move(candidate_matches[i]));
+      }
+    }
+    return matches;
+  }
+
+  /// @brief Whether every layer has a content index.
+  bool has_contents() const {
+    return !this->shards.empty() &&
+           std::ranges::all_of(this->shards, [](const Shard &shard) {
+             return has_contents(shard);
+           });
+  }
+
+  static bool has_contents(const Shard &shard) {
+    return std::ranges::all_of(
+        shard.contents,
+        [](const std::unique_ptr<ContentIndex> &layer) { return !!layer; });
+  }
+
+  std::string relative_prefix(const fs::path &directory) const {
+    return index_prefix(this->root, directory);
+  }
+
+  const Shard *find_shard(std::string_view name) const {
+    for (const Shard &shard : this->shards) {
+      if (shard.name == name) {
+        return &shard;
+      }
+    }
+    return nullptr;
+  }
+
+  std::string root;
+  uint64_t epoch = 0;
+  std::vector<Shard> shards; // Sorted by name.
+
+private:
+  void load(const fs::path &index_dir) {
+    this->shards.clear();
+    MappedFile manifest(index_dir / manifest_name);
+    ByteReader reader(manifest.bytes());
+    if (reader.data.substr(0, magic.size()) != magic) {
+      throw IndexException(
+          std::format("\"{}\" is not an index", index_dir.string()));
+    }
+    reader.take(magic.size());
+    this->epoch = reader.fixed<uint64_t>();
+    this->root = std::string(reader.string());
+    uint32_t shard_count = reader.fixed<uint32_t>();
+    std::vector<std::pair<size_t, size_t>> layers; // (shard, layer)
+    for (uint32_t i = 0; i < shard_count; ++i) {
+      Shard shard;
+      shard.name = std::string(reader.string());
+      uint32_t layer_count = reader.fixed<uint32_t>();
+      for (uint32_t layer = 0; layer < layer_count; ++layer) {
+        shard.files.emplace_back(reader.string());
+        layers.emplace_back(i, layer);
+      }
+      shard.layers.resize(layer_count);
+      shard.contents.resize(layer_count);
+      this->shards.push_back(std::move(shard));
+    }
+    parallel_for(layers.size(), [&](size_t i) {
+      Shard &shard = this->shards[layers[i].first];
+      const std::string &file = shard.files[layers[i].second];
+      shard.layers[layers[i].second] =
+          std::make_unique<PathIndex>(index_dir / file);
+      if (fs::exists(index_dir / content_file(file))) {
+        shard.contents[layers[i].second] =
+            std::make_unique<ContentIndex>(index_dir / content_file(file));
+      }
+    });
+  }
+
+  static uint64_t read_epoch(const fs::path &index_dir) {
+    MappedFile manifest(index_dir / manifest_name);
+    ByteReader reader(manifest.bytes());
+    reader.take(magic.size());
+    return reader.fixed<uint64_t>();
+  }
+
+  /// @brief Queries the layers of a shard newest first, dropping matches of
+  /// older layers that a newer layer's tombstones hide.
+  /// @return nullopt if no layer holds the query's prefix.
+  static std::optional<std::vector<IndexMatch>>
+  query_layers(const Shard &shard, const IndexQuery &query,
+               IndexQueryStats *stats) {
+    std::vector<IndexMatch> matches;
+    std::set<std::string, PathOrder> replaced;
+    std::set<std::string, PathOrder> removed;
+    auto hidden = [&](const std::string &path) {
+      std::string folder = parent_folder(path);
+      if (replaced.contains(folder)) {
+        return true;
+      }
+      for (;; folder = parent_folder(folder)) {
+        if (removed.contains(folder)) {
+          return true;
+        } else if (folder.empty()) {
+          return false;
+        }
+      }
+    };
+
+    bool found = false;
+    for (auto layer = shard.layers.rbegin(); layer != shard.layers.rend();
+         ++layer) {
+      if ((*layer)->find_directory(query.prefix)) {
+        found = true;
+        for (IndexMatch &match : (*layer)->query(query, stats)) {
+          if (!hidden(match.path)) {
+            matches.push_back(std::move(match));
+          }
+        }
+      }
+      for (const IndexTree::Tombstone &tombstone : (*layer)->tombstones) {
+        (tombstone.subtree ? removed : replaced).insert(tombstone.path);
+      }
+    }
+    if (!found) {
+      return std::nullopt;
+    }
+    if (shard.layers.size() > 1) {
+      // Restore the order of a single layer: by folder, then by name.
+      std::sort(matches.begin(), matches.end(),
+                [](const IndexMatch &a, const IndexMatch &b) {
+                  std::string a_folder = parent_folder(a.path);
+                  std::string b_folder = parent_folder(b.path);
+                  if (a_folder != b_folder) {
+                    return PathOrder{}(a_folder, b_folder);
+                  }
+                  return a.path < b.path;
+                });
+    }
+    return matches;
+  }
+
+  /// @brief Whether any of `files` (in the folder at `folder_path`) has a
+  /// different modification time or size than when it was indexed.
+  static bool files_changed(const fs::path &folder_path,
+                            const std::vector<IndexTree::File> &files) {
+    return std::ranges::any_of(files, [&](const IndexTree::File &file) {
+      std::error_code error;
+      fs::directory_entry entry(folder_path / file.name, error);
+      IndexTree::File current = IndexTree::stat_file(entry, file.name);
+      return current.mtime != file.mtime || current.size != file.size;
+    });
+  }
+
+  /// @brief Compares the folders of a shard against the file system. A
+  /// folder changed if its own modification time did, or, since writing to
+  /// a file leaves its folder's time alone, if one of its files changed.
+  /// @return A segment with the current contents of every changed folder,
+  /// the folders added below them and tombstones for what they replace, or
+  /// nullopt if nothing changed.
+  static std::optional<IndexTree> changed_folders(const Shard &shard,
+                                                  const fs::path &shard_root,
+                                                  bool recursive) {
+    IndexTreeBuilder known;
+    for (const std::unique_ptr<PathIndex> &layer : shard.layers) {
+      known.apply(layer->decode());
+    }
+
+    IndexTreeBuilder segment;
+    std::vector<IndexTree::Tombstone> tombstones;
+    for (const auto &[path, folder] : known.folders) {
+      std::error_code error;
+      fs::path folder_path = path.empty() ? shard_root : shard_root / path;
+      auto mtime = fs::last_write_time(folder_path, error);
+      if (!error && to_nanoseconds(mtime) == folder.mtime &&
+          !files_changed(folder_path, folder.files)) {
+        continue;
+      }
+      IndexTree::Listing listing = IndexTree::list(folder_path);
+      if (!listing.found) {
+        // Removed. Its parent has changed too and records the removal.
+        continue;
+      }
+      IndexTreeBuilder::Folder &changed = segment.folder(path);
+      changed.mtime = listing.mtime;
+      changed.files = std::move(listing.files);
+      tombstones.push_back({path, false});
+      if (!recursive) {
+        continue;
+      }
+
+      std::set<std::string> current(listing.folders.begin(),
+                                    listing.folders.end());
+      for (auto child = std::next(known.folders.find(path));
+           child != known.folders.end() &&
+           is_at_or_below(child->first, path);
+           ++child) {
+        if (parent_folder(child->first) != path) {
+          continue;
+        }
+        std::string name = child->first.substr(path.empty() ? 0
+                                                            : path.size() + 1);
+        if (!current.erase(name)) {
+          tombstones.push_back({child->first, true});
+        }
+      }
+      for (const std::string &name : current) {
+        std::string child = path.empty() ? name : path + "/" + name;
+        segment.add(child, IndexTree::scan(shard_root / child));
+      }
+    }
+    if (tombstones.empty()) {
+      return std::nullopt;
+    }
+    IndexTree tree = segment.build();
+    tree.tombstones = std::move(tombstones);
+    return tree;
+  }
+
+  /// @brief Returns the shard names of `root`: "" for its own files followed
+  /// by its folders, sorted.
+  static std::vector<std::string> top_level_names(const fs::path &root) {
+    std::vector<std::string> names{""};
+    std::vector<std::string> folders = IndexTree::list(root).folders;
+    names.insert(names.end(), folders.begin(), folders.end());
+    return names;
+  }
+
+  static std::string layer_file(std::string_view name, uint64_t epoch) {
+    return std::format("shard-{:016x}-{}.idx", fnv1a(name), epoch);
+  }
+
+  /// @brief Returns the epoch a layer file was written in.
+  static uint64_t layer_epoch(std::string_view file) {
+    std::string_view digits =
+        file.substr(file.rfind('-') + 1, file.rfind('.') - file.rfind('-') - 1);
+    uint64_t epoch = 0;
+    std::from_chars(digits.data(), digits.data() + digits.size(), epoch);
+    return epoch;
+  }
+
+  /// @brief Applies `bundles`, all from one host, to its index in
+  /// `host_dir` in epoch order.
+  /// @return Whether any of them was new.
+  static bool import_host(const fs::path &host_dir,
+                          std::vector<Bundle> &bundles) {
+    std::ranges::sort(bundles, {}, &Bundle::epoch);
+    fs::create_directories(host_dir);
+    std::optional<ShardedIndex> current;
+    if (fs::exists(host_dir / manifest_name)) {
+      current.emplace(host_dir);
+    }
+    uint64_t epoch = current ? current->epoch : 0;
+    std::map<std::string, std::vector<std::string>> files;
+    if (current) {
+      for (const Shard &shard : current->shards) {
+        files[shard.name] = shard.files;
+      }
+    }
+
+    bool changed = false;
+    std::string root = current ? current->root : "";
+    for (const Bundle &bundle : bundles) {
+      if (bundle.epoch <= epoch) {
+        logger.debug(std::format("skipping epoch {} of \"{}\"",
+                                 bundle.epoch, bundle.host));
+        continue;
+      } else if (bundle.since != 0 && bundle.since != epoch) {
+        throw IndexException(std::format(
+            "the bundle of \"{}\" starts after epoch {}, but epoch {} was "
+            "imported last",
+            bundle.host, bundle.since, epoch));
+      }
+      std::map<std::string, std::vector<std::string>> next;
+      for (const Bundle::Shard &shard : bundle.shards) {
+        std::vector<std::string> &shard_files = next[shard.name];
+        if (!shard.replace) {
+          shard_files = files[shard.name];
+        }
+        for (const Bundle::Layer &layer : shard.layers) {
+          write_file_atomically(host_dir / layer.file, {layer.bytes});
+          shard_files.push_back(layer.file);
+        }
+      }
+      files = std::move(next);
+      epoch = bundle.epoch;
+      root = bundle.root;
+      changed = true;
+    }
+    if (changed) {
+      std::vector<Shard> shards;
+      for (auto &[name, shard_files] : files) {
+        shards.push_back({name, std::move(shard_files), {}});
+      }
+      publish(host_dir, root, epoch, shards);
+    }
+    return changed;
+  }
+
+  /// @brief Merges the shards of the index in `host_dir` into a single
+  /// layer `file` of `fleet_dir`, rooted at the host's root.
+  /// @return `file`.
+  static std::string merge_host(const fs::path &host_dir,
+                                const fs::path &fleet_dir,
+                                const std::string &file) {
+    ShardedIndex host(host_dir);
+    std::vector<IndexTree> trees(host.shards.size());
+    parallel_for(host.shards.size(), [&](size_t i) {
+      IndexTreeBuilder builder;
+      for (const std::unique_ptr<PathIndex> &layer : host.shards[i].layers) {
+        builder.apply(layer->decode());
+      }
+      trees[i] = builder.build();
+    });
+    IndexTreeBuilder merged;
+    for (size_t i = 0; i < host.shards.size(); ++i) {
+      merged.add(host.shards[i].name, trees[i]);
+    }
+    PathIndex::write(fleet_dir / file, host.root, merged.build());
+    return file;
+  }
+
+  /// @brief Returns the content index file of layer `file`.
+  static std::string content_file(const std::string &file) {
+    return fs::path(file).replace_extension(".tri").string();
+  }
+
+  static std::string build_base(const fs::path &index_dir,
+                                const fs::path &root, const std::string &name,
+                                uint64_t epoch, bool content,
+                                size_t *count = nullptr) {
+    fs::path shard_root = name.empty() ? root : root / name;
+    IndexTree tree = IndexTree::scan(shard_root, !name.empty());
+    std::string file = layer_file(name, epoch);
+    PathIndex::write(index_dir / file, shard_root, tree);
+    if (content) {
+      ContentIndex::write(index_dir / content_file(file), shard_root, tree);
+    }
+    if (count != nullptr) {
+      *count = tree.files.size();
+    }
+    return file;
+  }
+
+  /// @brief Atomically replaces the manifest, then deletes the layer files
+  /// it no longer references.
+  static void publish(const fs::path &index_dir, const fs::path &root,
+                      uint64_t epoch, const std::vector<Shard> &shards) {
+    ByteWriter manifest;
+    manifest.out.append(magic);
+    manifest.fixed<uint64_t>(epoch);
+    manifest.string(fs::absolute(root).lexically_normal().generic_string());
+    manifest.fixed<uint32_t>(static_cast<uint32_t>(shards.size()));
+    std::set<std::string> referenced;
+    for (const Shard &shard : shards) {
+      manifest.string(shard.name);
+      manifest.fixed<uint32_t>(static_cast<uint32_t>(shard.files.size()));
+      for (const std::string &file : shard.files) {
+        manifest.string(file);
+        referenced.insert(file);
+        referenced.insert(content_file(file));
+      }
+    }
+    write_file_atomically(index_dir / manifest_name, {manifest.out});
+
+    for (const fs::directory_entry &entry : fs::directory_iterator(index_dir)) {
+      std::string file = entry.path().filename().string();
+      if ((entry.path().extension() == ".idx" ||
+           entry.path().extension() == ".tri") &&
+          !referenced.contains(file)) {
+        std::error_code error;
+        fs::remove(entry.path(), error);
+      }
+    }
+  }
+};
+
+/// @brief Serves queries from the latest snapshot of an index while a
+/// background thread refreshes and compacts it. Queries never wait for a
+/// refresh or compaction: each one holds on to the snapshot it started with,
+/// and the next snapshot is swapped in once it has been published.
+struct IndexService {
+  IndexService(fs::path index_dir)
+      : index_dir(index_dir),
+        current(std::make_shared<const ShardedIndex>(index_dir)) {}
+
+  std::shared_ptr<const ShardedIndex> snapshot() const {
+    return this->current.load();
+  }
+
+  /// @brief Refreshes the index, compacts shards that have accumulated too
+  /// many segments and swaps in the resulting snapshot.
+  IndexRefreshStats refresh() {
+    std::scoped_lock<std::mutex> lock(writer_mutex);
+    IndexRefreshStats stats = ShardedIndex::refresh(this->index_dir);
+    stats.shards_compacted = ShardedIndex::compact(
+        this->index_dir, ShardedIndex::compaction_layers);
+    this->current.store(std::make_shared<const ShardedIndex>(this->index_dir));
+    logger.debug(std::format("index epoch {}", this->snapshot()->epoch));
+    return stats;
+  }
+
+  int periodic_refresh(
+      std::chrono::milliseconds ms,
+      std::chrono::milliseconds resolution = std::chrono::milliseconds{80}) {
+    this->should_continue = true;
+    auto start = std::chrono::high_resolution_clock::now();
+    while (this->should_continue) {
+      auto finish = std::chrono::high_resolution_clock::now();
+      std::chrono::duration<double, std::milli> elapsed = finish - start;
+      if (elapsed > ms) {
+        try {
+          this->refresh();
+        } catch (const std::exception &exception) {
+          logger.info(std::format("refresh failed: {}", exception.what()));
+        }
+        start = std::chrono::high_resolution_clock::now();
+      }
+      std::this_thread::sleep_for(resolution);
+    }
+    logger.debug("refresh end");
+    return 0;
+  }
+
+  std::atomic_bool should_continue = false;
+
+private:
+  fs::path index_dir;
+  std::atomic<std::shared_ptr<const ShardedIndex>> current;
+  std::mutex writer_mutex;
+};
+
+#pragma endregion Index
+
+#pragma region SharedScan
+
+/// @brief Key to compare folders by: absolute, normal, '/' separated and
+/// without a trailing '/'.
+inline std::string folder_key(const fs::path &path) {
+  std::string key = fs::absolute(path).lexically_normal().generic_string();
+  while (!key.empty() && key.back() == '/') {
+    key.pop_back();
+  }
+  return key;
+}
+
+/// @brief One traversal of `root`, shared by every search below it. Files are
+/// kept in the order they are found, so a search that attaches late is first
+/// backfilled with the files found so far. Each folder is read once, however
+/// many searches consume the scan.
+struct SharedScan {
+  SharedScan(const fs::path &root)
+      : root(fs::absolute(root).lexically_normal()), key(folder_key(root)) {}
+
+  void run() {
+    this->finder.walk(
+        this->root, fs::directory_options::skip_permission_denied,
+        [this](EntryId, const fs::directory_entry &entry) {
+          if (this->stopping) {
+            this->finder.should_continue = false;
+          }
+          {
+            std::scoped_lock<std::mutex> lock(this->mutex);
+            this->entries.push_back(entry);
+          }
+          this->changed.notify_all();
+        });
+    {
+      std::scoped_lock<std::mutex> lock(this->mutex);
+      this->done = true;
+    }
+    this->changed.notify_all();
+  }
+
+  void stop() {
+    this->stopping = true;
+    this->finder.should_continue = false;
+  }
+
+  /// @brief Whether searches below `folder` can attach to this scan.
+  bool covers(const fs::path &folder) const {
+    return is_at_or_below(folder_key(folder), this->key);
+  }
+
+  bool finished() const {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    return this->done;
+  }
+
+  size_t size() const {
+    std::scoped_lock<std::mutex> lock(this->mutex);
+    return this->entries.size();
+  }
+
+  /// @brief Waits until files past the first `from` were found (or the scan
+  /// finished) and copies them into `batch`.
+  /// @return false once `from` is the end of a finished scan.
+  bool wait_for_entries(size_t from, std::vector<fs::directory_entry> &batch) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->changed.wait(lock, [&]() {
+      return this->done || this->entries.size() > from;
+    });
+    batch.assign(this->entries.begin() + from, this->entries.end());
+    return !batch.empty() || !this->done;
+  }
+
+  const fs::path root;
+  const std::string key;
+
+private:
+  PathFinder finder;
+  std::atomic_bool stopping = false;
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<fs::directory_entry> entries;
+  bool done = false;
+};
+
+/// @brief Matches the files of `scan` below `root_dir` against `substrings`
+/// into `container`, until the scan finishes. Entries are numbered by their
+/// position in the scan.
+inline void run_shared_search(SharedScan &scan, const fs::path &root_dir,
+                              const std::vector<std::string> &substrings,
+                              SearchResultContainer *container) {
+  std::vector<Processor> processors;
+  processors.reserve(substrings.size());
+  for (size_t pattern = 0; pattern < substrings.size(); ++pattern) {
+    processors.emplace_back(container, pattern, substrings[pattern]);
+    container->set_thread(pattern, std::this_thread::get_id());
+  }
+  std::string below = folder_key(root_dir);
+  std::vector<fs::directory_entry> batch;
+  EntryId next = 0;
+  while (scan.wait_for_entries(next, batch)) {
+    for (const fs::directory_entry &entry : batch) {
+      EntryId id = next++;
+      if (is_at_or_below(entry.path().generic_string(), below)) {
+        for (Processor &processor : processors) {
+          processor.push(id, entry);
+        }
+      }
+    }
+    for (Processor &processor : processors) {
+      processor.process();
+    }
+  }
+}
+
+#pragma endregion SharedScan
+
+#pragma region Interactive
+
+/// @brief Compact in-memory table of the files below a root, meant to be
+/// re-filtered on every keystroke. Names are packed into one buffer and each
+/// file refers to its folder by id.
+struct EntryTable {
+  static EntryTable scan(const fs::path &root) {
+    EntryTable table;
+    PathFinder finder;
+    finder.walk(root, fs::directory_options::skip_permission_denied,
+                [&table](EntryId, const fs::directory_entry &entry) {
+                  fs::path folder = entry.path().parent_path();
+                  // The walk lists a folder's files one after another.
+                  if (table.folders.empty() || table.folders.back() != folder) {
+                    table.folders.push_back(folder);
+                  }
+                  table.names.append(entry.path().filename().string());
+                  table.name_ends.push_back(table.names.size());
+                  table.entry_folders.push_back(
+                      static_cast<uint32_t>(table.folders.size() - 1));
+                });
+    return table;
+  }
+
+  size_t size() const { return this->name_ends.size(); }
+
+  std::string_view name(uint32_t entry) const {
+    size_t begin = entry == 0 ? 0 : this->name_ends[entry - 1];
+    return std::string_view(this->names)
+        .substr(begin, this->name_ends[entry] - begin);
+  }
+
+  fs::path path(uint32_t entry) const {
+    return this->folders[this->entry_folders[entry]] / this->name(entry);
+  }
+
+  /// @brief Returns the entries (of `within`, or all) whose name contains
+  /// `substring`, in table order. Chunks of entries are matched in parallel.
+  std::vector<uint32_t>
+  filter(std::string_view substring,
+         const std::vector<uint32_t> *within = nullptr) const {
+    size_t count = within != nullptr ? within->size() : this->size();
+    size_t chunk_count = (count + chunk_size - 1) / chunk_size;
+    std::vector<std::vector<uint32_t>> chunks(chunk_count);
+    BatchMatcher matcher{std::string(substring)};
+    parallel_for(chunk_count, [&](size_t chunk) {
+      size_t end = std::min(count, (chunk + 1) * chunk_size);
+      size_t first = chunk * chunk_size;
+      if (within == nullptr) {
+        // The names of a run of entries are already packed together.
+        std::vector<uint64_t> matches = matcher.match(
+            this->names,
+            std::span(this->name_ends).subspan(first, end - first),
+            first == 0 ? 0 : this->name_ends[first - 1]);
+        for (size_t i = first; i < end; ++i) {
+          if (matches[(i - first) / 64] >> ((i - first) % 64) & 1) {
+            chunks[chunk].push_back(static_cast<uint32_t>(i));
+          }
+        }
+        return;
+      }
+      for (size_t i = first; i < end; ++i) {
+        uint32_t entry = (*within)[i];
+        if (this->name(entry).find(substring) != std::string_view::npos) {
+          chunks[chunk].push_back(entry);
+        }
+      }
+    });
+    std::vector<uint32_t> matches;
+    for (const std::vector<uint32_t> &chunk : chunks) {
+      matches.insert(matches.end(), chunk.begin(), chunk.end());
+    }
+    return matches;
+  }
+
+  static constexpr size_t chunk_size = 1 << 16;
+
+  std::string names;
+  std::vector<size_t> name_ends; // End of each entry's name in `names`.
+  std::vector<uint32_t> entry_folders;
+  std::vector<fs::path> folders;
+};
+
+/// @brief Type-ahead search over an EntryTable. A query that contains the
+/// previous one can only match a subset of its matches, so only those are
+/// checked again.
+struct InteractiveSearch {
+  InteractiveSearch(const EntryTable *table) : table(table) {}
+
+  const std::vector<uint32_t> &update(const std::string &query) {
+    bool narrowing = this->started && query.find(this->query) != npos;
+    this->checked = narrowing ? this->matches.size() : this->table->size();
+    this->matches =
+        this->table->filter(query, narrowing ? &this->matches : nullptr);
+    this->query = query;
+    this->started = true;
+    return this->matches;
+  }
+
+  size_t checked = 0; // Entries checked by the last update.
+
+private:
+  static constexpr size_t npos = std::string::npos;
+
+  const EntryTable *table;
+  std::string query;
+  bool started = false;
+  std::vector<uint32_t> matches;
+};
+
+#pragma endregion Interactive
+
+#pragma region Estimate
+
+/// @brief Estimated number and total size of the files matching each
+/// substring (and any of them), with the half-width of their 95% confidence
+/// intervals.
+struct MatchEstimate {
+  std::vector<double> counts; // Per substring, then any substring.
+  std::vector<double> count_errors;
+  std::vector<double> bytes;
+  std::vector<double> byte_errors;
+  size_t probes = 0;
+  size_t folders_read = 0;
+};
+
+/// @brief Estimates match counts and sizes from random descents (Knuth's
+/// estimator). Each probe walks from the root to a leaf folder, picking a
+/// subfolder uniformly at random at every step, and counts each folder on
+/// the way weighted by the product of the fan-outs above it (the inverse of
+/// the probability of reaching it). The mean over probes is an unbiased
+/// estimate for the whole tree. Folders are read at most once.
+struct TreeEstimator {
+  TreeEstimator(const fs::path &root, std::vector<std::string> substrings,
+                uint64_t seed = std::random_device{}())
+      : root(root), substrings(std::move(substrings)), random(seed) {}
+
+  /// @brief Probes until the 95% confidence interval of the number of files
+  /// matching any substring is within `percent` of the estimate. The
+  /// interval is only trusted once some probes found matches: until then, a
+  /// zero variance just means the matches haven't been reached.
+  MatchEstimate run(uint64_t percent, size_t min_probes = 30,
+                    size_t max_probes = 100000) {
+    size_t metrics = this->substrings.size() + 1;
+    // Welford's running mean and sum of squared differences, per metric:
+    // counts first, then bytes.
+    std::vector<double> mean(2 * metrics);
+    std::vector<double> squares(2 * metrics);
+    auto half_width = [&](size_t metric, size_t probes) {
+      return probes < 2 ? 0.0
+                        : 1.96 * std::sqrt(squares[metric] / (probes - 1) /
+                                           probes);
+    };
+
+    MatchEstimate estimate;
+    size_t any = metrics - 1;
+    size_t probes_with_matches = 0;
+    while (estimate.probes < max_probes) {
+      std::vector<double> sample = this->probe();
+      size_t probes = ++estimate.probes;
+      for (size_t metric = 0; metric < sample.size(); ++metric) {
+        double delta = sample[metric] - mean[metric];
+        mean[metric] += delta / probes;
+        squares[metric] += delta * (sample[metric] - mean[metric]);
+      }
+      probes_with_matches += sample[any] > 0;
+      if (probes >= min_probes &&
+          probes_with_matches >= min_probes_with_matches &&
+          half_width(any, probes) * 100 <= mean[any] * percent) {
+        break;
+      }
+    }
+
+    for (size_t metric = 0; metric < metrics; ++metric) {
+      estimate.counts.push_back(mean[metric]);
+      estimate.count_errors.push_back(half_width(metric, estimate.probes));
+      estimate.bytes.push_back(mean[metrics + metric]);
+      estimate.byte_errors.push_back(
+          half_width(metrics + metric, estimate.probes));
+    }
+    estimate.folders_read = this->folders.size();
+    return estimate;
+  }
+
+private:
+  static constexpr size_t min_probes_with_matches = 5;
+
+  struct Folder {
+    std::vector<fs::path> folders;
+    std::vector<double> values; // Counts, then bytes, as in MatchEstimate.
+    size_t entries = 0;         // Files and folders.
+  };
+
+  /// @return One sample of every metric.
+  std::vector<double> probe() {
+    std::vector<double> sample(2 * (this->substrings.size() + 1));
+    fs::path path = this->root;
+    double weight = 1;
+    while (true) {
+      const Folder &folder = this->read(path);
+      for (size_t metric = 0; metric < sample.size(); ++metric) {
+        sample[metric] += weight * folder.values[metric];
+      }
+      if (folder.folders.empty()) {
+        return sample;
+      }
+      // Importance weights: subfolders already read are picked in
+      // proportion to their fan-out, the others as if they had the average
+      // fan-out of those.
+      std::vector<double> fan_outs(folder.folders.size(), 0.0);
+      double known = 0;
+      size_t known_count = 0;
+      for (size_t i = 0; i < folder.folders.size(); ++i) {
+        auto itr = this->folders.find(folder.folders[i].string());
+        if (itr != this->folders.end()) {
+          fan_outs[i] = 1.0 + itr->second.entries;
+          known += fan_outs[i];
+          ++known_count;
+        }
+      }
+      double average = known_count == 0 ? 1.0 : known / known_count;
+      for (double &fan_out : fan_outs) {
+        fan_out = fan_out == 0.0 ? average : fan_out;
+      }
+      std::discrete_distribution<size_t> pick(fan_outs.begin(),
+                                              fan_outs.end());
+      size_t child = pick(this->random);
+      double total = std::reduce(fan_outs.begin(), fan_outs.end());
+      weight *= total / fan_outs[child];
+      path = folder.folders[child];
+    }
+  }
+
+  const Folder &read(const fs::path &path) {
+    auto [itr, inserted] = this->folders.try_emplace(path.string());
+    Folder &folder = itr->second;
+    if (!inserted) {
+      return folder;
+    }
+    size_t metrics = this->substrings.size() + 1;
+    folder.values.resize(2 * metrics);
+    FolderListing listing =
+        list_folder(path, fs::directory_options::skip_permission_denied);
+    for (const std::string &name : listing.folders) {
+      folder.folders.push_back(path / name);
+    }
+    folder.entries = listing.files.size() + listing.folders.size();
+    for (const fs::directory_entry &entry : listing.files) {
+      std::string name = entry.path().filename().string();
+      std::error_code error;
+      double size = 0;
+      bool matched = false;
+      for (size_t pattern = 0; pattern < this->substrings.size(); ++pattern) {
+        if (name.find(this->substrings[pattern]) == std::string::npos) {
+          continue;
+        }
+        if (!matched) {
+          uint64_t bytes = entry.file_size(error);
+          size = error ? 0 : static_cast<double>(bytes);
+          matched = true;
+        }
+        folder.values[pattern] += 1;
+        folder.values[metrics + pattern] += size;
+      }
+      if (matched) {
+        folder.values[metrics - 1] += 1;
+        folder.values[2 * metrics - 1] += size;
+      }
+    }
+    return folder;
+  }
+
+  fs::path root;
+  std::vector<std::string> substrings;
+  std::mt19937_64 random;
+  std::unordered_map<std::string, Folder> folders; // Folders read so far.
+};
+
+#pragma endregion Estimate
+
+#pragma region Workers
+#if defined(FILE_FINDER_POSIX)
+
+/// @brief A message between the coordinator and a worker process. On the
+/// wire: u32 size of type and payload, u8 type, then the payload (ByteWriter
+/// encoded).
+struct Frame {
+  enum Type : char {
+    // Coordinator to worker.
+    Setup = 'P', // Root, then the substrings.
+    Shard = 'S', // A folder (relative to the root) to search recursively.
+    Split = 'X', // Give away part of the current shard.
+    Quit = 'Q',
+    // Worker to coordinator.
+    Matches = 'M', // Count, then (path relative to the root, u64 mask).
+    Folders = 'F', // Count, then folders given away after a Split.
+    Done = 'D',    // The current shard is finished.
+  };
+
+  Type type;
+  std::string payload;
+
+  void write(int fd) const {
+    ByteWriter frame;
+    frame.fixed<uint32_t>(static_cast<uint32_t>(this->payload.size() + 1));
+    frame.out.push_back(this->type);
+    frame.out.append(this->payload);
+    std::string_view bytes = frame.out;
+    while (!bytes.empty()) {
+      ssize_t written = ::write(fd, bytes.data(), bytes.size());
+      if (written <= 0) {
+        throw IndexException("Unable to write to worker pipe");
+      }
+      bytes.remove_prefix(static_cast<size_t>(written));
+    }
+  }
+
+  /// @brief Removes the first complete frame from `buffer`, if any.
+  static std::optional<Frame> take(std::string &buffer) {
+    if (buffer.size() < sizeof(uint32_t)) {
+      return std::nullopt;
+    }
+    uint32_t size = ByteReader(buffer).fixed<uint32_t>();
+    if (size == 0) {
+      throw IndexException("Malformed worker frame");
+    }
+    if (buffer.size() < sizeof(uint32_t) + size) {
+      return std::nullopt;
+    }
+    Frame frame{static_cast<Type>(buffer[sizeof(uint32_t)]),
+                buffer.substr(sizeof(uint32_t) + 1, size - 1)};
+    buffer.erase(0, sizeof(uint32_t) + size);
+    return frame;
+  }
+
+  /// @brief Blocks until a whole frame was read from `fd`.
+  /// @return Nothing at the end of input.
+  static std::optional<Frame> read(int fd, std::string &buffer) {
+    while (true) {
+      if (std::optional<Frame> frame = take(buffer)) {
+        return frame;
+      }
+      char bytes[65536];
+      ssize_t count = ::read(fd, bytes, sizeof(bytes));
+      if (count <= 0) {
+        return std::nullopt;
+      }
+      buffer.append(bytes, static_cast<size_t>(count));
+    }
+  }
+};
+
+/// @brief Worker side of a multi-process search (`--worker`): searches the
+/// shards it is sent, depth first, streaming matches back one folder at a
+/// time. Between folders it checks for a Split request, which it answers by
+/// giving away the older half of its stack of folders still to visit. A Split
+/// that arrives before the stack holds two folders (e.g. together with its
+/// shard) is answered after the next folder that leaves it with two or more,
+/// or with nothing once the shard is done.
+struct ShardWorker {
+  ShardWorker(int in, int out) : in(in), out(out) {}
+
+  int run() {
+    std::string buffer;
+    while (true) {
+      // Handle the messages already read first. Then block for the next one
+      // while idle, otherwise only look.
+      std::optional<Frame> frame = Frame::take(buffer);
+      pollfd input{this->in, POLLIN, 0};
+      if (!frame && (this->pending.empty() || ::poll(&input, 1, 0) > 0)) {
+        frame = Frame::read(this->in, buffer);
+        if (!frame) {
+          return EXIT_SUCCESS;
+        }
+      }
+      if (frame) {
+        if (frame->type == Frame::Quit) {
+          return EXIT_SUCCESS;
+        }
+        this->handle(*frame);
+        continue;
+      }
+      this->visit();
+      if (this->split_requested) {
+        this->answer_split();
+      }
+      if (this->pending.empty()) {
+        Frame{Frame::Done}.write(this->out);
+      }
+    }
+  }
+
+private:
+  void handle(const Frame &frame) {
+    ByteReader reader(frame.payload);
+    if (frame.type == Frame::Setup) {
+      this->root = std::string(reader.string());
+      while (!reader.done()) {
+        this->substrings.emplace_back(reader.string());
+      }
+    } else if (frame.type == Frame::Shard) {
+      this->pending.emplace_back(reader.string());
+    } else if (frame.type == Frame::Split) {
+      this->split_requested = true;
+      this->answer_split();
+    }
+  }
+
+  /// @brief Gives away the older half of the pending folders, once there are
+  /// at least two of them or there is nothing left to search.
+  void answer_split() {
+    if (this->pending.size() == 1) {
+      return;
+    }
+    size_t given = this->pending.size() / 2;
+    ByteWriter reply;
+    reply.fixed<uint32_t>(static_cast<uint32_t>(given));
+    for (size_t i = 0; i < given; ++i) {
+      reply.string(this->pending[i]);
+    }
+    this->pending.erase(this->pending.begin(), this->pending.begin() + given);
+    Frame{Frame::Folders, std::move(reply.out)}.write(this->out);
+    this->split_requested = false;
+  }
+
+  void visit() {
+    std::string folder = std::move(this->pending.back());
+    this->pending.pop_back();
+    FolderListing listing = list_folder(
+        this->root / folder, fs::directory_options::skip_permission_denied);
+    std::string prefix = folder.empty() ? "" : folder + "/";
+    ByteWriter matches;
+    uint32_t count = 0;
+    for (const fs::directory_entry &entry : listing.files) {
+      std::string name = entry.path().filename().string();
+      PatternMask mask;
+      for (size_t pattern = 0; pattern < this->substrings.size(); ++pattern) {
+        if (name.find(this->substrings[pattern]) != npos) {
+          mask.set(pattern);
+        }
+      }
+      if (mask.any()) {
+        matches.string(prefix + name);
+        mask.write(matches);
+        ++count;
+      }
+    }
+    if (count > 0) {
+      ByteWriter frame;
+      frame.fixed<uint32_t>(count);
+      frame.out.append(matches.out);
+      Frame{Frame::Matches, std::move(frame.out)}.write(this->out);
+    }
+    // Reversed, so that subfolders are visited in listing order.
+    for (auto child = listing.folders.rbegin();
+         child != listing.folders.rend(); ++child) {
+      this->pending.push_back(prefix + *child);
+    }
+  }
+
+  static constexpr size_t npos = std::string::npos;
+
+  int in;
+  int out;
+  fs::path root;
+  std::vector<std::string> substrings;
+  std::deque<std::string> pending; // Folders to visit; the back is next.
+  bool split_requested = false;    // A Split is waiting to be answered.
+};
+
+/// @brief Spreads a search over worker processes (this executable, started
+/// with `--worker`) connected through pipes. Each top-level folder is a
+/// shard. When a worker runs out of shards while others are still busy, the
+/// longest running one is asked to split its shard, and the folders it gives
+/// away become new shards. The shard of a worker that dies is queued again
+/// for the others. Matches are merged into one container.
+struct Coordinator {
+  Coordinator(fs::path executable, fs::path root,
+              std::vector<std::string> substrings,
+              SearchResultContainer *container)
+      : executable(std::move(executable)),
+        root(fs::absolute(root).lexically_normal()),
+        substrings(std::move(substrings)), container(container) {}
+
+  /// @brief Throws IndexException if every worker died before the search
+  /// was done.
+  void run(size_t processes) {
+    // Writing to a worker that died must fail rather than end this process.
+    std::signal(SIGPIPE, SIG_IGN);
+    for (size_t pattern = 0; pattern < this->substrings.size(); ++pattern) {
+      this->container->set_thread(pattern, std::this_thread::get_id());
+    }
+    FolderListing listing =
+        list_folder(this->root, fs::directory_options::skip_permission_denied);
+    for (const fs::directory_entry &entry : listing.files) {
+      std::string name = entry.path().filename().string();
+      PatternMask mask;
+      for (size_t pattern = 0; pattern < this->substrings.size(); ++pattern) {
+        if (name.find(this->substrings[pattern]) != npos) {
+          mask.set(pattern);
+        }
+      }
+      this->push(name, mask);
+    }
+    this->shards.assign(listing.folders.begin(), listing.folders.end());
+
+    ByteWriter setup;
+    setup.string(this->root.generic_string());
+    for (const std::string &substring : this->substrings) {
+      setup.string(substring);
+    }
+    for (size_t i = 0; i < std::max<size_t>(1, processes); ++i) {
+      this->workers.push_back(this->start());
+      this->send(this->workers.back(), Frame{Frame::Setup, setup.out});
+    }
+
+    bool failed = false;
+    while (true) {
+      this->assign();
+      bool busy = std::ranges::any_of(
+          this->workers, [](const Worker &worker) { return worker.busy; });
+      if (!busy && this->shards.empty()) {
+        break;
+      }
+      if (std::ranges::none_of(this->workers, &Worker::alive)) {
+        failed = true;
+        break;
+      }
+      this->rebalance();
+      this->receive();
+    }
+
+    for (Worker &worker : this->workers) {
+      this->send(worker, Frame{Frame::Quit});
+      ::close(worker.in);
+      ::close(worker.out);
+      ::waitpid(worker.pid, nullptr, 0);
+    }
+    if (failed) {
+      throw IndexException(
+          std::format("Every worker exited with {} shards left to search",
+                      this->shards.size()));
+    }
+  }
+
+  size_t shards_assigned = 0;
+  size_t splits = 0;          // Shards split to rebalance.
+  size_t shards_requeued = 0; // After their worker died.
+
+private:
+  struct Worker {
+    pid_t pid;
+    int in;  // The worker's stdin.
+    int out; // The worker's stdout.
+    std::string buffer;
+    bool alive = true;
+    bool busy = false;
+    std::string shard;      // Assigned, while busy.
+    bool splitting = false; // A Split was sent and not answered yet.
+    std::chrono::steady_clock::time_point started;
+    // When a Split last gave nothing away; its stack may grow again later.
+    std::chrono::steady_clock::time_point refused;
+  };
+
+  Worker start() {
+    int to_worker[2];
+    int from_worker[2];
+    if (::pipe(to_worker) != 0 || ::pipe(from_worker) != 0) {
+      throw IndexException("Unable to create worker pipes");
+    }
+    // Only the worker's own ends survive exec, so that every worker sees
+    // the end of its input when the coordinator closes it.
+    ::fcntl(to_worker[1], F_SETFD, FD_CLOEXEC);
+    ::fcntl(from_worker[0], F_SETFD, FD_CLOEXEC);
+    std::string program = this->executable.string();
+    char worker_flag[] = "--worker";
+    char *argv[] = {program.data(), worker_flag, nullptr};
+    pid_t pid = ::fork();
+    if (pid == 0) {
+      ::dup2(to_worker[0], STDIN_FILENO);
+      ::dup2(from_worker[1], STDOUT_FILENO);
+      ::close(to_worker[0]);
+      ::close(from_worker[1]);
+      ::execv(program.c_str(), argv);
+      ::_exit(127);
+    }
+    ::close(to_worker[0]);
+    ::close(from_worker[1]);
+    if (pid < 0) {
+      throw IndexException("Unable to start a worker process");
+    }
+    return Worker{pid, to_worker[1], from_worker[0]};
+  }
+
+  void assign() {
+    for (Worker &worker : this->workers) {
+      if (!worker.alive || worker.busy || this->shards.empty()) {
+        continue;
+      }
+      worker.shard = std::move(this->shards.front());
+      this->shards.pop_front();
+      worker.busy = true;
+      worker.refused = {};
+      worker.started = std::chrono::steady_clock::now();
+      ++this->shards_assigned;
+      ByteWriter shard;
+      shard.string(worker.shard);
+      this->send(worker, Frame{Frame::Shard, std::move(shard.out)});
+    }
+  }
+
+  /// @brief Sends `frame` to a live worker. A worker that can't be written
+  /// to is lost.
+  void send(Worker &worker, const Frame &frame) {
+    if (!worker.alive) {
+      return;
+    }
+    try {
+      frame.write(worker.in);
+    } catch (const IndexException &) {
+      this->lose(worker);
+    }
+  }
+
+  /// @brief Marks `worker` as dead and queues its shard again. Matches it
+  /// already sent are reported once (see push).
+  void lose(Worker &worker) {
+    logger.info(std::format("worker {} exited", worker.pid));
+    if (worker.busy) {
+      this->shards.push_front(std::move(worker.shard));
+      ++this->shards_requeued;
+    }
+    worker.alive = worker.busy = worker.splitting = false;
+  }
+
+  /// @brief Asks the longest running worker to split its shard if another
+  /// worker is idle and no shards are left.
+  void rebalance() {
+    bool idle = std::ranges::any_of(this->workers, [](const Worker &worker) {
+      return worker.alive && !worker.busy;
+    });
+    bool splitting = std::ranges::any_of(
+        this->workers, [](const Worker &worker) { return worker.splitting; });
+    if (!idle || splitting || !this->shards.empty()) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    Worker *slowest = nullptr;
+    for (Worker &worker : this->workers) {
+      if (worker.alive && worker.busy &&
+          now - worker.refused > std::chrono::milliseconds{200} &&
+          (slowest == nullptr || worker.started < slowest->started)) {
+        slowest = &worker;
+      }
+    }
+    if (slowest != nullptr) {
+      slowest->splitting = true;
+      this->send(*slowest, Frame{Frame::Split});
+    }
+  }
+
+  /// @brief Waits (up to 100ms) for output from the workers and handles it.
+  void receive() {
+    std::vector<pollfd> fds;
+    for (const Worker &worker : this->workers) {
+      fds.push_back({worker.alive ? worker.out : -1, POLLIN, 0});
+    }
+    if (::poll(fds.data(), fds.size(), 100) <= 0) {
+      return;
+    }
+    for (size_t i = 0; i < fds.size(); ++i) {
+      Worker &worker = this->workers[i];
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      char bytes[65536];
+      ssize_t count = ::read(worker.out, bytes, sizeof(bytes));
+      if (count <= 0) {
+        this->lose(worker);
+        continue;
+      }
+      worker.buffer.append(bytes, static_cast<size_t>(count));
+      while (std::optional<Frame> frame = Frame::take(worker.buffer)) {
+        this->handle(worker, *frame);
+      }
+    }
+  }
+
+  void handle(Worker &worker, const Frame &frame) {
+    ByteReader reader(frame.payload);
+    if (frame.type == Frame::Matches) {
+      uint32_t count = reader.fixed<uint32_t>();
+      for (uint32_t i = 0; i < count; ++i) {
+        std::string_view path = reader.string();
+        this->push(path, PatternMask::read(reader));
+      }
+    } else if (frame.type == Frame::Folders) {
+      uint32_t count = reader.fixed<uint32_t>();
+      for (uint32_t i = 0; i < count; ++i) {
+        this->shards.emplace_back(reader.string());
+      }
+      worker.splitting = false;
+      if (count == 0) {
+        worker.refused = std::chrono::steady_clock::now();
+      } else {
+        ++this->splits;
+      }
+    } else if (frame.type == Frame::Done) {
+      worker.busy = false;
+    }
+  }
+
+  void push(std::string_view path, PatternMask mask) {
+    // A requeued shard is searched again from the start.
+    if (mask.none() || !this->reported.emplace(path).second) {
+      return;
+    }
+    EntryId id = this->next_id++;
+    for (size_t pattern = 0; pattern < this->substrings.size(); ++pattern) {
+      if (mask.test(pattern)) {
+        this->container->push(SearchResult{id, pattern}, this->root / path);
+      }
+    }
+  }
+
+  static constexpr size_t npos = std::string::npos;
+
+  fs::path executable;
+  fs::path root;
+  std::vector<std::string> substrings;
+  SearchResultContainer *container;
+  std::deque<std::string> shards; // Folders relative to the root.
+  std::vector<Worker> workers;
+  std::set<std::string, std::less<>> reported; // Paths of the matches.
+  EntryId next_id = 0;
+};
+
+#endif
+#pragma endregion Workers
+
+struct SearchSettings {
+  fs::path root_dir;         // Root directory to begin traversing from.
+  bool follow_links = false; // todo: Flags for different kinds of links
+                             // (hardlink, symlink, shortcut, etc)
+  std::vector<std::string> substrings; // Substring to look for in filenames
+  std::optional<fs::path> cache_dir; // Where to keep results between runs.
+  uint64_t max_ops_per_second = 0;   // Folder reads and stats. 0: no limit.
+  uint64_t max_cpu_percent = 0;      // Of one core. 0: no limit.
+  bool idle_io = false;              // Only read when the disk is idle.
+  // Folders that take longer to read are skipped. 0: no deadline.
+  std::chrono::seconds read_timeout{30};
+  size_t walkers = 1; // Threads reading folders.
+  std::optional<fs::path> profile_path; // Profile to schedule walkers by.
+  bool matched_first = false; // Visit subtrees that had matches first.
+  bool archives = false;      // Match the files inside .zip and .tar files.
+  bool intern_names = false;  // Match each distinct file name once.
+  // Only report files whose root relative path matches this glob.
+  std::optional<std::string> path_glob;
+  // Only report files whose contents are of these types (by magic bytes).
+  std::vector<std::string> magic_types;
+  std::optional<std::string> content; // Only report files containing this.
+  std::optional<fs::path> content_cache_dir; // Outcomes of --content.
+
+  bool operator==(const SearchSettings &) const = default;
+};
+
+struct ArgumentException : std::runtime_error {
+  ArgumentException(std::string message)
+      : std::runtime_error(message.c_str()) {}
+};
+
+// Ordinarily we would use a test framework.
+// Since the problem specified no external libraries, we'll add it here.
+struct TestCommand {};
+
+struct HelpCommand {
+  HelpCommand(std::string help_message) : message(help_message) {}
+  HelpCommand(const HelpCommand &command) : message(command.message) {}
+  std::string to_string() { return this->message; }
+  std::string message;
+};
+
+struct IndexBuildCommand {
+  fs::path index_path; // Index folder to (re)write.
+  fs::path root_dir;   // Root directory to index.
+  bool content = false; // Also index the files' contents.
+};
+
+struct IndexRefreshCommand {
+  fs::path index_path; // Index folder to bring up to date.
+};
+
+struct IndexServeCommand {
+  fs::path index_path; // Index folder to serve queries from.
+};
+
+struct IndexExportCommand {
+  fs::path index_path;  // Index folder to export.
+  std::string host;     // Tag of this host in the fleet index.
+  fs::path bundle_path; // File to write.
+  uint64_t since = 0;   // Epoch already exported (0: everything).
+};
+
+struct IndexImportCommand {
+  fs::path fleet_path;                // Fleet index folder to update.
+  std::vector<fs::path> bundle_paths; // Bundles exported by the hosts.
+};
+
+struct ServeCommand {};
+
+struct InteractiveCommand {
+  fs::path root_dir; // Root directory to load.
+};
+
+struct WorkerCommand {};
+
+struct CoordinatorCommand {
+  fs::path executable; // This program, to start the workers with.
+  uint64_t processes;  // Worker processes to start.
+  fs::path root_dir;   // Root directory to begin traversing from.
+  std::vector<std::string> substrings; // Substring to look for in filenames
+};
+
+struct EstimateCommand {
+  uint64_t percent;  // Target half-width of the confidence interval.
+  fs::path root_dir; // Root directory to sample.
+  std::vector<std::string> substrings; // Substring to look for in filenames
+};
+
+struct IndexQueryCommand {
+  fs::path index_path; // Index folder to search.
+  fs::path root_dir;   // Directory (inside the indexed root) to search below.
+  std::vector<std::string> substrings; // Substring to look for in filenames
+  std::optional<std::chrono::seconds> modified_within; // Max age of a match.
+  uint64_t min_size = 0;
+  uint64_t max_size = std::numeric_limits<uint64_t>::max();
+  std::optional<std::string> content; // Text the matches must contain.
+};
+
+using Command =
+    std::variant<SearchSettings, TestCommand, HelpCommand, IndexBuildCommand,
+                 IndexRefreshCommand, IndexQueryCommand, IndexServeCommand,
+                 ServeCommand, InteractiveCommand, EstimateCommand,
+                 WorkerCommand, CoordinatorCommand, IndexExportCommand,
+                 IndexImportCommand>;
+
+struct ArgParser {
+  std::string get_help_string(std::string exe_name = "file-finder") const {
+    return std::format(
+        "Usage: {0} [<options>] <dir> <substring1>[<substring2> "
+        "[<substring3>]...]\n"
+        "Traverses a directory tree and prints out any paths whose "
+        "filenames "
+        "contain the given substrings.\n"
+        R"(Example: {0} D:\\Documents\\Alice report book draft )"
+        "\n"
+        "Options\n"
+        "--help           Output usage message and exit.\n"
+        "--test           Run tests.\n"
+        "--cache <cache>  Keep the results in the folder <cache> and only\n"
+        "                 re-read folders that changed since the last\n"
+        "                 search with the same <dir> and substrings.\n"
+        "--serve          Answer \"search <dir> <substrings>\" commands.\n"
+        "                 Searches below a folder that is being scanned\n"
+        "                 share that scan.\n"
+        "--interactive <dir>\n"
+        "                 Load the file names below <dir> once, then list\n"
+        "                 the files containing each line typed.\n"
+        "--max-ops <n>    Read or stat at most <n> folders per second.\n"
+        "--max-cpu <percent>\n"
+        "                 Use at most <percent> of one core.\n"
+        "--idle-io        Only read from disk when it is otherwise idle\n"
+        "                 (Linux).\n"
+        "                 While searching, \"ops <n>\" and \"cpu <percent>\"\n"
+        "                 change the limits (0: no limit).\n"
+        "--read-timeout <duration>\n"
+        "                 Skip folders that take longer to read (default\n"
+        "                 30s, 0s: wait forever).\n"
+        "--walkers <n>    Read up to <n> folders at a time (default 1).\n"
+        "--profile <file> Record folder sizes and read times in <file> and\n"
+        "                 start the biggest subtrees first next time.\n"
+        "--matched-first  With --profile, start with subtrees that had\n"
+        "                 matches last time.\n"
+        "--archives       Also match the files inside .zip and .tar\n"
+        "                 files, printed as <archive>!/<path>.\n"
+        "--intern-names   Keep one copy of each distinct file name and\n"
+        "                 match it once, however many files share it.\n"
+        "--path-glob <glob>\n"
+        "                 Only list files whose path below <dir> matches\n"
+        "                 <glob> (* and ? within a folder name, ** across\n"
+        "                 folders, e.g. */logs/**/error*.txt). The\n"
+        "                 substrings may then be left out.\n"
+        "--magic <type1,..n>, --mime <type1,..n>\n"
+        "                 Only list matches whose first bytes show\n"
+        "                 they are of one of the types (e.g. pdf, png,\n"
+        "                 zip or application/pdf).\n"
+        "--content <text> Only list matches that contain <text>.\n"
+        "--content-cache <cache>\n"
+        "                 Keep the outcome of --content per file in the\n"
+        "                 folder <cache>, and don't read files again\n"
+        "                 until they change.\n"
+        "--processes <n> <dir> <substring1..n>\n"
+        "                 Search with <n> worker processes, one\n"
+        "                 top-level folder (or part of one) at a time.\n"
+        "--estimate <percent> <dir> <substring1..n>\n"
+        "                 Estimate the number and size of matching files\n"
+        "                 from a sample of folders, to within <percent>.\n"
+        "--build-index <index> <dir> [--content]\n"
+        "                 Write an index of the files below <dir>, and\n"
+        "                 of their contents with --content.\n"
+        "--refresh-index <index>\n"
+        "                 Rebuild the parts of an index whose folders\n"
+        "                 changed.\n"
+        "--index <index> [<filters>] <dir> <substring1..n>\n"
+        "                 Search an index instead of traversing <dir>.\n"
+        "                 Filters: --modified-within <duration> (e.g. 24h),\n"
+        "                 --min-size <size>, --max-size <size> (e.g. 10M),\n"
+        "                 --content <text>.\n"
+        "--serve-index <index>\n"
+        "                 Answer \"query <dir> <substrings>\" commands\n"
+        "                 while refreshing the index in the background.\n"
+        "--export-index <index> <host> <bundle> [<since>]\n"
+        "                 Write what changed in an index after epoch\n"
+        "                 <since> (default: all of it) to <bundle>.\n"
+        "--import-index <fleet> <bundle1..n>\n"
+        "                 Merge bundles of any number of hosts into the\n"
+        "                 index <fleet>, searched as <fleet>/<host>/...\n"
+        "<dir>            Root directory to begin traversing.\n"
+        "<substring1..n>  Substring to search for in file names.",
+        exe_name);
+  }
+
+  /// @brief Parses CLI arguments and returns SearchSettings (or other
+  /// command as appropriate).
+  /// @param args CLI arguments. The first argument is expected to be the
+  /// executable name.
+  /// @return If the second argument is --help, --test, --build-index,
+  /// --refresh-index, --index or --serve-index, returns the corresponding
+  /// command.
+  /// Otherwise, returns settings for search as derived from given arguments.
+  Command parse_args(const std::vector<std::string> &args) {
+    if (args.size() == 2) {
+      if (args[1] == "--help") {
+        return HelpCommand{this->get_help_string(args[0])};
+      } else if (args[1] == "--test") {
+        return TestCommand{};
+      } else if (args[1] == "--serve") {
+        return ServeCommand{};
+      } else if (args[1] == "--worker") {
+        return WorkerCommand{};
+      }
+    }
+
+    if (args.size() > 1 && args[1] == "--interactive") {
+      if (args.size() != 3) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      return InteractiveCommand{this->existing_root(args[2])};
+    }
+
+    if (args.size() > 1 && args[1] == "--processes") {
+      if (args.size() < 5) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+#if !defined(FILE_FINDER_POSIX)
+      throw ArgumentException("--processes isn't supported on this platform.");
+#endif
+      // Prefer the kernel's record of this executable to a relative argv[0].
+      fs::path executable = fs::exists("/proc/self/exe")
+                                ? fs::path("/proc/self/exe")
+                                : fs::path(args[0]);
+      CoordinatorCommand command{executable, this->parse_count(args[2]),
+                                 this->existing_root(args[3])};
+      for (auto itr :
+           std::views::iota(std::begin(args) + 4, std::end(args))) {
+        command.substrings.emplace_back(*itr);
+      }
+      return command;
+    }
+
+    if (args.size() > 1 && args[1] == "--estimate") {
+      if (args.size() < 5) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      EstimateCommand command{this->parse_count(args[2]),
+                              this->existing_root(args[3])};
+      if (command.percent == 0) {
+        throw ArgumentException("The error bound must be at least 1%.");
+      }
+      for (auto itr :
+           std::views::iota(std::begin(args) + 4, std::end(args))) {
+        command.substrings.emplace_back(*itr);
+      }
+      return command;
+    }
+
+    if (args.size() > 1 && args[1] == "--build-index") {
+      if (args.size() != 4 && (args.size() != 5 || args[4] != "--content")) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      return IndexBuildCommand{args[2], this->existing_root(args[3]),
+                               args.size() == 5};
+    }
+
+    if (args.size() > 1 && args[1] == "--refresh-index") {
+      if (args.size() != 3) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      if (!fs::exists(args[2])) {
+        throw ArgumentException(
+            std::format("Index doesn't exist! (\"{}\")", args[2]));
+      }
+      return IndexRefreshCommand{args[2]};
+    }
+
+    if (args.size() > 1 && args[1] == "--index") {
+      if (args.size() < 3) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      if (!fs::exists(args[2])) {
+        throw ArgumentException(
+            std::format("Index doesn't exist! (\"{}\")", args[2]));
+      }
+      IndexQueryCommand command = this->parse_index_query(args, 3);
+      command.index_path = args[2];
+      return command;
+    }
+
+    if (args.size() > 1 && args[1] == "--serve-index") {
+      if (args.size() != 3) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      if (!fs::exists(args[2])) {
+        throw ArgumentException(
+            std::format("Index doesn't exist! (\"{}\")", args[2]));
+      }
+      return IndexServeCommand{args[2]};
+    }
+
+    if (args.size() > 1 && args[1] == "--export-index") {
+      if (args.size() != 5 && args.size() != 6) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      if (!fs::exists(args[2])) {
+        throw ArgumentException(
+            std::format("Index doesn't exist! (\"{}\")", args[2]));
+      }
+      if (!ShardedIndex::is_host_tag(args[3])) {
+        throw ArgumentException(std::format(
+            "Invalid host \"{}\" (letters, digits, '-', '_' and '.')",
+            args[3]));
+      }
+      return IndexExportCommand{args[2], args[3], args[4],
+                                args.size() == 6 ? this->parse_count(args[5])
+                                                 : 0};
+    }
+
+    if (args.size() > 1 && args[1] == "--import-index") {
+      if (args.size() < 4) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+      IndexImportCommand command{args[2], {}};
+      for (auto itr :
+           std::views::iota(std::begin(args) + 3, std::end(args))) {
+        if (!fs::exists(*itr)) {
+          throw ArgumentException(
+              std::format("Bundle doesn't exist! (\"{}\")", *itr));
+        }
+        command.bundle_paths.emplace_back(*itr);
+      }
+      return command;
+    }
+
+    // Options without a value, and the setting each one turns on.
+    static const std::map<std::string_view, bool SearchSettings::*> flags{
+        {"--idle-io", &SearchSettings::idle_io},
+        {"--matched-first", &SearchSettings::matched_first},
+        {"--archives", &SearchSettings::archives},
+        {"--intern-names", &SearchSettings::intern_names},
+    };
+    SearchSettings settings{};
+    size_t next = 1;
+    while (next + 1 < args.size() && args[next].starts_with("--")) {
+      if (auto flag = flags.find(args[next]); flag != flags.end()) {
+        settings.*flag->second = true;
+        next += 1;
+        continue;
+      }
+      if (args[next] == "--cache") {
+        settings.cache_dir = args[next + 1];
+      } else if (args[next] == "--max-ops") {
+        settings.max_ops_per_second = this->parse_count(args[next + 1]);
+      } else if (args[next] == "--max-cpu") {
+        settings.max_cpu_percent = this->parse_count(args[next + 1]);
+      } else if (args[next] == "--read-timeout") {
+        settings.read_timeout = this->parse_duration(args[next + 1]);
+      } else if (args[next] == "--walkers") {
+        settings.walkers =
+            std::max<uint64_t>(1, this->parse_count(args[next + 1]));
+      } else if (args[next] == "--profile") {
+        settings.profile_path = args[next + 1];
+      } else if (args[next] == "--magic" || args[next] == "--mime") {
+        for (auto type : std::views::split(args[next + 1], ',')) {
+          std::string name(type.begin(), type.end());
+          if (!MagicClassifier::is_type(name)) {
+            throw ArgumentException(
+                std::format("Unknown file type \"{}\"", name));
+          }
+          settings.magic_types.push_back(name);
+        }
+      } else if (args[next] == "--content") {
+        if (args[next + 1].empty()) {
+          throw ArgumentException("--content needs a non-empty text.");
+        }
+        settings.content = args[next + 1];
+      } else if (args[next] == "--content-cache") {
+        settings.content_cache_dir = args[next + 1];
+      } else if (args[next] == "--path-glob") {
+        if (!PathGlob(args[next + 1]).valid()) {
+          throw ArgumentException(std::format(
+              "--path-glob accepts at most {} characters and wildcards.",
+              PathGlob::max_tokens));
+        }
+        settings.path_glob = args[next + 1];
+      } else {
+        throw ArgumentException(
+            std::format("Unknown option \"{}\"", args[next]));
+      }
+      next += 2;
+    }
+
+    // With a glob, the substrings may be left out.
+    if (args.size() < next + (settings.path_glob ? 1 : 2)) {
+      if (args.size() == 0) {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string()));
+      } else {
+        throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                            this->get_help_string(args[0])));
+      }
+    }
+
+    if (settings.archives && settings.cache_dir) {
+      // The cache only knows the matches of each folder, not its archives.
+      throw ArgumentException("--archives can't be used with --cache.");
+    }
+    if ((!settings.magic_types.empty() || settings.content) &&
+        (settings.archives || settings.cache_dir)) {
+      // Neither files in archives nor cached matches are read again.
+      throw ArgumentException(
+          "--magic and --content can't be used with --archives or --cache.");
+    }
+    if (settings.content_cache_dir && !settings.content) {
+      throw ArgumentException("--content-cache needs --content.");
+    }
+    if (settings.path_glob && (settings.archives || settings.cache_dir)) {
+      // Neither the paths inside archives nor cached matches are globbed.
+      throw ArgumentException(
+          "--path-glob can't be used with --archives or --cache.");
+    }
+    settings.root_dir = this->existing_root(args[next]);
+    for (auto itr :
+         std::views::iota(std::begin(args) + next + 1, std::end(args))) {
+      settings.substrings.emplace_back(*itr);
+    }
+    if (settings.substrings.empty()) {
+      settings.substrings.emplace_back(""); // Matches every name.
+    }
+
+    return settings;
+  }
+
+  /// @brief Parses a "search <dir> <substring1..n>" command of --serve.
+  /// Shared scans only match names, so options are refused rather than
+  /// silently ignored.
+  SearchSettings parse_serve_search(const std::vector<std::string> &args) {
+    Command parsed = this->parse_args(args);
+    SearchSettings *settings = std::get_if<SearchSettings>(&parsed);
+    if (settings == nullptr) {
+      throw ArgumentException("Expected \"search <dir> <substrings>\"");
+    }
+    SearchSettings plain;
+    plain.root_dir = settings->root_dir;
+    plain.substrings = settings->substrings;
+    if (*settings != plain) {
+      throw ArgumentException(
+          "A search takes no options: \"search <dir> <substrings>\"");
+    }
+    return plain;
+  }
+
+  /// @brief Parses "[<filters>] <dir> <substring1..n>" starting at
+  /// `args[first]` into an IndexQueryCommand (without index path).
+  IndexQueryCommand parse_index_query(const std::vector<std::string> &args,
+                                      size_t first) {
+    IndexQueryCommand command{};
+    size_t next = first;
+    for (; next + 1 < args.size() && args[next].starts_with("--");
+         next += 2) {
+      if (args[next] == "--modified-within") {
+        command.modified_within = this->parse_duration(args[next + 1]);
+      } else if (args[next] == "--min-size") {
+        command.min_size = this->parse_size(args[next + 1]);
+      } else if (args[next] == "--max-size") {
+        command.max_size = this->parse_size(args[next + 1]);
+      } else if (args[next] == "--content") {
+        if (args[next + 1].empty()) {
+          throw ArgumentException("--content needs a non-empty text.");
+        }
+        command.content = args[next + 1];
+      } else {
+        throw ArgumentException(
+            std::format("Unknown option \"{}\"", args[next]));
+      }
+    }
+    if (args.size() < next + 2) {
+      throw ArgumentException(std::format("Invalid number of arguments.\n{}",
+                                          this->get_help_string(args[0])));
+    }
+    command.root_dir = args[next];
+    for (auto itr :
+         std::views::iota(std::begin(args) + next + 1, std::end(args))) {
+      command.substrings.emplace_back(*itr);
+    }
+    return command;
+  }
+
+  /// @brief Parses a non-negative integer, such as a limit.
+  uint64_t parse_count(const std::string &arg) const {
+    uint64_t count = 0;
+    auto [end, error] =
+        std::from_chars(arg.data(), arg.data() + arg.size(), count);
+    if (error != std::errc{} || end != arg.data() + arg.size()) {
+      throw ArgumentException(
+          std::format("Invalid number \"{}\"", arg));
+    }
+    return count;
+  }
+
+private:
+  /// @brief Parses durations such as "90s", "30m", "24h" or "7d".
+  std::chrono::seconds parse_duration(const std::string &arg) const {
+    static const std::map<char, std::chrono::seconds> units{
+        {'s', std::chrono::seconds{1}},
+        {'m', std::chrono::minutes{1}},
+        {'h', std::chrono::hours{1}},
+        {'d', std::chrono::days{1}}};
+    uint64_t count = 0;
+    auto [end, error] =
+        std::from_chars(arg.data(), arg.data() + arg.size(), count);
+    if (error != std::errc{} || end + 1 != arg.data() + arg.size() ||
+        !units.contains(arg.back())) {
+      throw ArgumentException(std::format(
+          "Invalid duration \"{}\". Expected e.g. 90s, 30m, 24h or 7d.", arg));
+    }
+    std::chrono::seconds unit = units.at(arg.back());
+    if (count > static_cast<uint64_t>(std::chrono::seconds::max() / unit)) {
+      throw ArgumentException(std::format("Duration \"{}\" is too long.", arg));
+    }
+    return unit * static_cast<int64_t>(count);
+  }
+
+  /// @brief Parses sizes in bytes with an optional K, M or G suffix.
+  uint64_t parse_size(const std::string &arg) const {
+    uint64_t size = 0;
+    auto [end, error] =
+        std::from_chars(arg.data(), arg.data() + arg.size(), size);
+    std::string_view suffix(end, arg.data() + arg.size());
+    static const std::map<std::string_view, uint64_t> units{
+        {"", 1}, {"K", 1ULL << 10}, {"M", 1ULL << 20}, {"G", 1ULL << 30}};
+    if (error != std::errc{} || end == arg.data() || !units.contains(suffix)) {
+      throw ArgumentException(std::format(
+          "Invalid size \"{}\". Expected bytes with an optional K, M or G.",
+          arg));
+    }
+    uint64_t unit = units.at(suffix);
+    if (size > std::numeric_limits<uint64_t>::max() / unit) {
+      throw ArgumentException(std::format("Size \"{}\" is too large.", arg));
+    }
+    return size * unit;
+  }
+
+  fs::path existing_root(const std::string &arg) const {
+    fs::path root = arg;
+    if (!fs::exists(root)) {
+      throw ArgumentException(
+          std::format("Root path doesn't exist! (\"{}\")", root.string()));
+    }
+    return root;
+  }
+};
+
+int do_main(SearchSettings settings) {
+  logger.debug("do_main");
+
+  SearchResultContainer *container =
+      new SearchResultContainer(settings.substrings);
+
+  Throttle *throttle = new Throttle();
+  throttle->set_ops_per_second(settings.max_ops_per_second);
+  throttle->set_cpu_percent(settings.max_cpu_percent);
+  // Before starting any threads, so that they inherit the priority.
+  if (settings.idle_io && !set_idle_io_priority()) {
+    logger.info("idle I/O priority isn't supported here");
+  }
+  container->throttle = throttle;
+
+  auto dump_period = std::chrono::milliseconds(9500); // ms_delay between dumps
+  std::function<int()> dump_func = [container, dump_period]() {
+    return container->periodic_dump(dump_period);
+  };
+  std::packaged_task<int()> dump(dump_func);
+  std::thread dump_thread(std::move(dump));
+
+  std::vector<std::thread> processor_threads;
+  std::vector<Processor> *processors = new std::vector<Processor>();
+  // Processor threads hold on to their element, so it must never move.
+  processors->reserve(settings.substrings.size());
+  ContentCache *content_cache = nullptr;
+  if (settings.content_cache_dir) {
+    content_cache =
+        new ContentCache(*settings.content_cache_dir, *settings.content);
+  }
+  FileCheck check;
+  if (!settings.magic_types.empty()) {
+    check = MagicClassifier::check(settings.magic_types);
+  }
+  if (settings.content) {
+    FileCheck content = content_check(*settings.content, content_cache);
+    check = check ? both_checks(check, content) : content;
+  }
+  FileFilter *filter = nullptr;
+  if (check) {
+    filter = new FileFilter(container, check);
+    filter->throttle = throttle;
+  }
+  NameDictionary *names = nullptr;
+  NameDictionary *folders = nullptr;
+  if (settings.intern_names) {
+    names = new NameDictionary();
+    folders = new NameDictionary();
+  }
+  uint32_t index = 0;
+  for (std::string substring : settings.substrings) {
+    processors->emplace_back(container, index, substring);
+    processors->back().throttle = throttle;
+    processors->back().filter = filter;
+    processors->back().names = names;
+    processors->back().folders = folders;
+    std::function<int()> fun = [processors, index]() {
+      return (*processors)[index].run();
+    };
+    std::thread processor_thread(std::move(fun));
+    processor_threads.emplace_back(std::move(processor_thread));
+    ++index;
+  }
+
+  ResultCache *cache = nullptr;
+  if (settings.cache_dir) {
+    cache = new ResultCache(*settings.cache_dir, settings.root_dir,
+                            settings.substrings,
+                            settings.follow_links ? "follow_links" : "",
+                            container);
+  }
+  TraversalProfile *profile = nullptr;
+  if (settings.profile_path) {
+    profile = new TraversalProfile(*settings.profile_path, settings.root_dir);
+    profile->matched_first = settings.matched_first;
+  }
+  if (cache != nullptr || profile != nullptr) {
+    container->on_push = [cache, profile](SearchResult result,
+                                          const fs::path &path) {
+      if (cache != nullptr) {
+        cache->record(result, path);
+      }
+      if (profile != nullptr) {
+        profile->record_match(path);
+      }
+    };
+  }
+
+  FolderReader *reader = nullptr;
+  if (settings.read_timeout.count() > 0) {
+    reader = new FolderReader(settings.read_timeout);
+  }
+  PathFinder *path_finder = new PathFinder();
+  path_finder->throttle = throttle;
+  path_finder->reader = reader;
+  path_finder->profile = profile;
+  path_finder->walkers = settings.walkers;
+  path_finder->names = names;
+  path_finder->folders = folders;
+  PathGlob *glob = nullptr;
+  if (settings.path_glob) {
+    glob = new PathGlob(*settings.path_glob);
+    path_finder->glob = glob;
+  }
+  ArchiveLister *archives = nullptr;
+  if (settings.archives) {
+    archives = new ArchiveLister(container, settings.substrings);
+    archives->throttle = throttle;
+    path_finder->archives = archives;
+  }
+  std::function<int()> search_func = [path_finder, settings, processors,
+                                      cache]() {
+    using DirOptions = fs::directory_options;
+    return path_finder->list_paths(settings.root_dir, processors,
+                                   (settings.follow_links
+                                        ? DirOptions::follow_directory_symlink
+                                        : DirOptions::none) |
+                                       DirOptions::skip_permission_denied,
+                                   cache);
+  };
+  std::packaged_task<int()> search_task(search_func);
+  std::future search_future = search_task.get_future();
+  std::thread search_thread(std::move(search_task));
+
+  std::atomic_bool should_continue = true;
+
+  auto stop_func = [&should_continue, &path_finder, &processors, &container,
+                    &throttle, &archives, &filter]() {
+    logger.info("ending");
+    should_continue = false;
+    path_finder->should_continue = false;
+    if (archives != nullptr) {
+      archives->stop();
+    }
+    if (filter != nullptr) {
+      filter->stop();
+    }
+    for (Processor &processor : *processors) {
+      processor.should_continue = false;
+    }
+    container->should_continue = false;
+    // Parked threads have to wake up to see that they should stop.
+    throttle->resume();
+  };
+
+  // Wait until all threads have started.
+  bool ready = false;
+  while (!ready) {
+    ready = should_continue;
+    ready &= path_finder->should_continue;
+    for (Processor &processor : *processors) {
+      ready &= processor.should_continue;
+    }
+    ready &= container->should_continue;
+  }
+
+  std::thread ui_thread([&]() {
+    while (should_continue) {
+      std::string command;
+      std::getline(std::cin, command);
+
+      if (command == "end" || command == "Exit") {
+        stop_func();
+      } else if (command == "dump" || command == "Dump") {
+        container->dump();
+      } else if (command == "pause") {
+        throttle->pause();
+        logger.info("paused");
+      } else if (command == "resume") {
+        throttle->resume();
+        logger.info("resumed");
+      } else if (command.starts_with("ops ") || command.starts_with("cpu ")) {
+        try {
+          uint64_t limit = ArgParser{}.parse_count(command.substr(4));
+          if (command.starts_with("ops ")) {
+            throttle->set_ops_per_second(limit);
+          } else {
+            throttle->set_cpu_percent(limit);
+          }
+          logger.info(std::format("{} limit set to {}",
+                                  command.substr(0, 3), limit));
+        } catch (const ArgumentException &exception) {
+          std::osyncstream(std::cout) << exception.what() << std::endl;
+        }
+      } else {
+        std::osyncstream(std::cout)
+            << "unknown command \"" << command << "\"" << std::endl;
+      }
+    }
+  });
+
+  while (should_continue && !(search_future.wait_for(std::chrono::milliseconds(
+                                  150)) == std::future_status::ready)) {
+  }
+  if (archives != nullptr) {
+    archives->finish();
+    logger.debug(std::format("{} archives listed, {} files",
+                             archives->archives_listed.load(),
+                             archives->members.load()));
+  }
+
+  // Search thread finished, but we may still have some processing to do.
+  while (should_continue && std::transform_reduce(
+              processors->begin(), processors->end(), 0, std::plus<>{},
+              [](Processor &proc) { return proc.queue_size(); }) > 0) {
+    // There is at least one processor with items to process.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (filter != nullptr) {
+    filter->finish();
+    logger.debug(std::format("{} files checked, {} accepted",
+                             filter->files_checked.load(),
+                             filter->files_accepted.load()));
+  }
+  container->dump();
+  if (names != nullptr) {
+    logger.debug(std::format("{} distinct names, {} matched",
+                             names->size(), names->scans.load()));
+  }
+
+  // An interrupted search hasn't seen every folder, so it can't be cached.
+  bool completed = should_continue;
+  stop_func();
+  search_thread.join();
+  if (!path_finder->timed_out.empty()) {
+    logger.info(std::format("{} folders skipped after timing out",
+                            path_finder->timed_out.size()));
+  }
+  if (glob != nullptr) {
+    logger.debug(std::format("{} folders pruned by the glob",
+                             path_finder->folders_pruned.load()));
+  }
+  completed = completed && search_future.get() == 0;
+  if (cache != nullptr && completed) {
+    cache->save();
+    logger.info(std::format("cache: {} folders reused, {} read",
+                            cache->folders_reused, cache->folders_read));
+  }
+  if (profile != nullptr && completed) {
+    profile->save();
+  }
+  if (content_cache != nullptr && completed) {
+    content_cache->save();
+    logger.info(std::format("content cache: {} files answered, {} read",
+                            content_cache->hits.load(),
+                            content_cache->misses.load()));
+  }
+  for (std::thread &thread : processor_threads) {
+    thread.join();
+  }
+  dump_thread.join();
+  ui_thread.detach();
+
+  std::osyncstream(std::cout).flush();
+
+  delete path_finder;
+  delete glob;
+  delete archives;
+  delete filter;
+  delete content_cache;
+  delete reader;
+  delete profile;
+  delete throttle;
+  delete cache;
+  delete processors;
+  delete names;
+  delete folders;
+  delete container;
+
+  return EXIT_SUCCESS;
+}
+
+int do_index_build(IndexBuildCommand command) {
+  logger.debug("do_index_build");
+  size_t count = ShardedIndex::build(command.index_path, command.root_dir,
+                                     command.content);
+  logger.info(std::format("indexed {} files into \"{}\"", count,
+                          command.index_path.string()));
+  return EXIT_SUCCESS;
+}
+
+std::string to_string(const IndexRefreshStats &stats) {
+  return std::format(
+      "shards updated: {}, added: {}, removed: {}, kept: {}, compacted: {}",
+      stats.shards_updated, stats.shards_added, stats.shards_removed,
+      stats.shards_kept, stats.shards_compacted);
+}
+
+int do_index_refresh(IndexRefreshCommand command) {
+  logger.debug("do_index_refresh");
+  IndexRefreshStats stats = ShardedIndex::refresh(command.index_path);
+  stats.shards_compacted = ShardedIndex::compact(
+      command.index_path, ShardedIndex::compaction_layers);
+  logger.info(to_string(stats));
+  return EXIT_SUCCESS;
+}
+
+/// @brief Returns the earliest modification time (as in IndexQuery) of a
+/// file modified within `age` of `now`. Computed in whole seconds so that no
+/// step overflows; an age reaching back past the start of the clock returns
+/// the earliest time there is.
+inline int64_t modified_since(std::chrono::seconds age, int64_t now) {
+  constexpr int64_t second = 1'000'000'000;
+  constexpr int64_t oldest = std::numeric_limits<int64_t>::min() / second;
+  if (age.count() >= now / second - oldest) {
+    return std::numeric_limits<int64_t>::min();
+  }
+  return (now / second - age.count()) * second + now % second;
+}
+
+/// @brief Runs an index query against `index` and prints its matches.
+void run_index_query(const ShardedIndex &index,
+                     const IndexQueryCommand &command) {
+  IndexQuery query{index.relative_prefix(command.root_dir), command.substrings};
+  if (command.modified_within) {
+    query.min_mtime =
+        modified_since(*command.modified_within,
+                       to_nanoseconds(std::chrono::file_clock::now()));
+  }
+  query.min_size = command.min_size;
+  query.max_size = command.max_size;
+  IndexQueryStats stats;
+  std::stringstream ss;
+  std::vector<IndexMatch> matches =
+      command.content ? index.query_content(query, *command.content, &stats)
+                      : index.query(query, &stats);
+  for (const IndexMatch &match : matches) {
+    ss << fs::path(index.root) / fs::path(match.path).make_preferred() << "\n";
+    for (size_t i = 0; i < query.substrings.size(); ++i) {
+      if (match.patterns.test(i)) {
+        ss << "\t\"" << query.substrings[i] << "\"\n";
+      }
+    }
+  }
+  std::osyncstream(std::cout) << ss.str();
+  std::osyncstream(std::cout).flush();
+  logger.debug(std::format(
+      "blocks scanned: {}, skipped: {}, subtrees skipped: {}, files read: {}",
+      stats.blocks_scanned, stats.blocks_skipped, stats.subtrees_skipped,
+      stats.files_read));
+}
+
+int do_index_query(IndexQueryCommand command) {
+  logger.debug("do_index_query");
+  run_index_query(ShardedIndex(command.index_path), command);
+  return EXIT_SUCCESS;
+}
+
+int do_index_export(IndexExportCommand command) {
+  logger.debug("do_index_export");
+  ShardedIndex::Bundle bundle = ShardedIndex::export_bundle(
+      command.index_path, command.bundle_path, command.host, command.since);
+  size_t replaced = std::ranges::count(bundle.shards, true,
+                                       &ShardedIndex::Bundle::Shard::replace);
+  logger.info(std::format(
+      "exported epochs {}..{} of \"{}\" ({} shards, {} replaced)",
+      bundle.since + 1, bundle.epoch, command.index_path.string(),
+      bundle.shards.size(), replaced));
+  return EXIT_SUCCESS;
+}
+
+int do_index_import(IndexImportCommand command) {
+  logger.debug("do_index_import");
+  size_t updated =
+      ShardedIndex::import_bundles(command.fleet_path, command.bundle_paths);
+  logger.info(std::format("updated {} hosts in \"{}\"", updated,
+                          command.fleet_path.string()));
+  return EXIT_SUCCESS;
+}
+
+int do_index_serve(IndexServeCommand command) {
+  logger.debug("do_index_serve");
+  IndexService service(command.index_path);
+
+  auto refresh_period = std::chrono::minutes(1);
+  std::thread refresh_thread([&service, refresh_period]() {
+    service.periodic_refresh(refresh_period);
+  });
+
+  ArgParser parser;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::vector<std::string> args;
+    std::istringstream words(line);
+    for (std::string word; words >> word;) {
+      args.push_back(word);
+    }
+    if (args.empty()) {
+      continue;
+    }
+
+    try {
+      if (args[0] == "end" || args[0] == "Exit") {
+        break;
+      } else if (args[0] == "refresh") {
+        logger.info(to_string(service.refresh()));
+      } else if (args[0] == "query") {
+        // The snapshot stays valid, even if a refresh publishes a new one
+        // while the query runs.
+        run_index_query(*service.snapshot(),
+                        parser.parse_index_query(args, 1));
+      } else {
+        std::osyncstream(std::cout)
+            << "unknown command \"" << line << "\"" << std::endl;
+      }
+    } catch (const ArgumentException &exception) {
+      std::osyncstream(std::cout) << exception.what() << std::endl;
+    } catch (const IndexException &exception) {
+      std::osyncstream(std::cout) << exception.what() << std::endl;
+    }
+  }
+
+  logger.info("ending");
+  service.should_continue = false;
+  refresh_thread.join();
+  return EXIT_SUCCESS;
+}
+
+int do_serve(ServeCommand command) {
+  logger.debug("do_serve");
+  std::vector<std::shared_ptr<SharedScan>> scans; // Scans in progress.
+  std::vector<std::thread> threads;
+  size_t search_count = 0;
+  bool stopped = false;
+
+  ArgParser parser;
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    std::vector<std::string> args;
+    std::istringstream words(line);
+    for (std::string word; words >> word;) {
+      args.push_back(word);
+    }
+    if (args.empty()) {
+      continue;
+    }
+
+    try {
+      if (args[0] == "end" || args[0] == "Exit") {
+        stopped = true;
+        break;
+      } else if (args[0] == "search") {
+        SearchSettings settings = parser.parse_serve_search(args);
+        std::erase_if(scans, [](const std::shared_ptr<SharedScan> &scan) {
+          return scan->finished();
+        });
+        auto itr = std::ranges::find_if(
+            scans, [&](const std::shared_ptr<SharedScan> &scan) {
+              return scan->covers(settings.root_dir);
+            });
+        size_t search = ++search_count;
+        std::shared_ptr<SharedScan> scan;
+        if (itr == scans.end()) {
+          scan = std::make_shared<SharedScan>(settings.root_dir);
+          scans.push_back(scan);
+          threads.emplace_back([scan]() {
+            scan->run();
+            logger.info(std::format("scan of \"{}\" finished ({} files)",
+                                    scan->root.string(), scan->size()));
+          });
+        } else {
+          scan = *itr;
+          logger.info(std::format("search {} joins the scan of \"{}\"",
+                                  search, scan->root.string()));
+        }
+        threads.emplace_back([scan, settings, search]() {
+          SearchResultContainer container(settings.substrings);
+          run_shared_search(*scan, settings.root_dir, settings.substrings,
+                            &container);
+          logger.info(std::format("search {} finished", search));
+          container.dump();
+        });
+      } else {
+        std::osyncstream(std::cout)
+            << "unknown command \"" << line << "\"" << std::endl;
+      }
+    } catch (const ArgumentException &exception) {
+      std::osyncstream(std::cout) << exception.what() << std::endl;
+    }
+  }
+
+  // At the end of input, searches in progress still run to completion.
+  logger.info("ending");
+  if (stopped) {
+    for (std::shared_ptr<SharedScan> &scan : scans) {
+      scan->stop();
+    }
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  return EXIT_SUCCESS;
+}
+
+int do_interactive(InteractiveCommand command) {
+  logger.debug("do_interactive");
+  auto start = std::chrono::steady_clock::now();
+  EntryTable table = EntryTable::scan(command.root_dir);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  logger.info(std::format("loaded {} files in {:.0f} ms", table.size(),
+                          elapsed.count()));
+
+  constexpr size_t shown = 20;
+  InteractiveSearch search(&table);
+  std::string line;
+  while (std::getline(std::cin, line)) {
+    if (line == "end" || line == "Exit") {
+      break;
+    }
+    start = std::chrono::steady_clock::now();
+    const std::vector<uint32_t> &matches = search.update(line);
+    elapsed = std::chrono::steady_clock::now() - start;
+    std::stringstream ss;
+    for (size_t i = 0; i < std::min(shown, matches.size()); ++i) {
+      ss << table.path(matches[i]) << "\n";
+    }
+    if (matches.size() > shown) {
+      ss << "...\n";
+    }
+    std::osyncstream(std::cout) << ss.str();
+    logger.info(std::format("{} matches ({} checked) in {:.2f} ms",
+                            matches.size(), search.checked,
+                            elapsed.count()));
+  }
+  logger.info("ending");
+  return EXIT_SUCCESS;
+}
+
+int do_estimate(EstimateCommand command) {
+  logger.debug("do_estimate");
+  TreeEstimator estimator(command.root_dir, command.substrings);
+  MatchEstimate estimate = estimator.run(command.percent);
+  logger.info(std::format("estimated from {} probes, {} folders read",
+                          estimate.probes, estimate.folders_read));
+  std::stringstream ss;
+  for (size_t metric = 0; metric < estimate.counts.size(); ++metric) {
+    std::string name = metric < command.substrings.size()
+                           ? std::format("\"{}\"", command.substrings[metric])
+                           : "any";
+    ss << std::format("{}\t~{:.0f} files (+/- {:.0f})\t~{:.0f} bytes (+/- "
+                      "{:.0f})\n",
+                      name, estimate.counts[metric],
+                      estimate.count_errors[metric], estimate.bytes[metric],
+                      estimate.byte_errors[metric]);
+  }
+  std::osyncstream(std::cout) << ss.str();
+  return EXIT_SUCCESS;
+}
+
+int do_worker(WorkerCommand command) {
+#if defined(FILE_FINDER_POSIX)
+  // Standard output carries frames only.
+  logger.logging_level = Logger::Level::Silent;
+  return ShardWorker(STDIN_FILENO, STDOUT_FILENO).run();
+#else
+  return EXIT_FAILURE;
+#endif
+}
+
+int do_coordinator(CoordinatorCommand command) {
+  logger.debug("do_coordinator");
+#if defined(FILE_FINDER_POSIX)
+  SearchResultContainer container(command.substrings);
+  Coordinator coordinator(command.executable, command.root_dir,
+                          command.substrings, &container);
+  coordinator.run(command.processes);
+  container.dump();
+  logger.info(std::format("{} shards searched, {} of them split off",
+                          coordinator.shards_assigned, coordinator.splits));
+#endif
+  return EXIT_SUCCESS;
+}
+
+int do_tests(); // todo: Remove forward declaration when tests are split into
+                // separate file.
+struct ArgVisitor {
+  int operator()(SearchSettings settings) { return do_main(settings); }
+  int operator()(TestCommand _) { return do_tests(); }
+  int operator()(IndexBuildCommand command) { return do_index_build(command); }
+  int operator()(IndexRefreshCommand command) {
+    return do_index_refresh(command);
+  }
+  int operator()(IndexQueryCommand command) { return do_index_query(command); }
+  int operator()(IndexServeCommand command) { return do_index_serve(command); }
+  int operator()(IndexExportCommand command) {
+    return do_index_export(command);
+  }
+  int operator()(IndexImportCommand command) {
+    return do_index_import(command);
+  }
+  int operator()(ServeCommand command) { return do_serve(command); }
+  int operator()(InteractiveCommand command) {
+    return do_interactive(command);
+  }
+  int operator()(EstimateCommand command) { return do_estimate(command); }
+  int operator()(WorkerCommand command) { return do_worker(command); }
+  int operator()(CoordinatorCommand command) {
+    return do_coordinator(command);
+  }
+  int operator()(HelpCommand help) {
+    std::cout << help.to_string() << std::endl;
+    return EXIT_SUCCESS;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  ArgParser parser;
+  try {
+    Command args = parser.parse_args({argv, argv + argc});
+    return std::visit(ArgVisitor{}, args);
+  } catch (const ArgumentException &exception) {
+    std::cout << exception.what() << std::endl;
+    return EXIT_FAILURE;
+  } catch (const IndexException &exception) {
+    std::cout << exception.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}
+
+#pragma region Tests
+
+struct TestContainer : SearchResultContainer {
+  using SearchResultContainer::SearchResultContainer;
+
+  struct Result {
+    fs::path path;
+    PatternMask patterns;
+  };
+
+  std::map<EntryId, Result> get_store() {
+    std::map<EntryId, Result> results;
+    for (const auto &[id, match] : this->store) {
+      results[id] = {this->path(match), match.patterns};
+    }
+    return results;
+  }
+};
+
+struct TestResult {
+
+  TestResult(std::string name) : name(name) {}
+
+  bool passed() { return this->errors.size() == 0; }
+
+  std::string name;
+  std::vector<std::string> errors;
+};
+
+TestResult test_logging_prefix() {
+  TestResult result("test_logging_prefix");
+  Logger logger{Logger::Level::Debug};
+  std::map<Logger::Level, std::string> map{
+      {Logger::Level::Silent, "[SILENT]"},   {Logger::Level::Error, "[ERROR]"},
+      {Logger::Level::Warning, "[WARNING]"}, {Logger::Level::Info, "[INFO]"},
+      {Logger::Level::Debug, "[DEBUG]"},
+  };
+  for (auto &[key, value] : map) {
+    std::string prefix = logger.get_prefix(key);
+    if (prefix != value) {
+      result.errors.emplace_back(
+          std::format("Expected '{}'. Found '{}'", value, prefix));
+    }
+  }
+  return result;
+}
+
+void expect_argument_exception(TestResult &result,
+                               const std::vector<std::string> &args) {
+  ArgParser parser;
+  try {
+    parser.parse_args(args);
+  } catch (ArgumentException &exception) {
+    return;
+  } catch (std::exception &e) {
+    std::cout << "other exception" << e.what() << std::endl;
+  }
+  result.errors.emplace_back("Expected ArgumentException!");
+}
+
+TestResult test_no_args() {
+  TestResult result("test_no_args");
+  expect_argument_exception(result, {});
+  return result;
+}
+
+TestResult test_too_few_args() {
+  TestResult result("test_too_few_args");
+  expect_argument_exception(result, {"exe_name"});
+  expect_argument_exception(result, {"exe_name", "root_dir"});
+  return result;
+}
+
+TestResult test_help() {
+  TestResult result("test_help");
+  ArgParser parser;
+  auto args = parser.parse_args({"exe_name", "--help"});
+  if (!std::holds_alternative<HelpCommand>(args)) {
+    result.errors.emplace_back("Expected HelpCommand.");
+    return result;
+  }
+
+  int help_return = std::visit(ArgVisitor{}, args);
+  if (help_return != 0) {
+    result.errors.emplace_back(std::format(
+        "Expected help command to return 0. Instead found {}", help_return));
+  }
+
+  return result;
+}
+
+TestResult test_root_dne() {
+  TestResult result{"test_root_dne"};
+  ArgParser parser;
+
+  try {
+    parser.parse_args({"exe_name", "root_dne", "arg1"});
+  } catch (ArgumentException &exception) {
+    std::string expected_error = "Root path doesn't exist! (\"root_dne\")";
+    if (exception.what() != expected_error) {
+      result.errors.emplace_back(std::format(
+          "Expected error message: '{}'\tFound error message: '{}'\t",
+          expected_error, exception.what()));
+    }
+    return result;
+  }
+  result.errors.emplace_back("No exception thrown. Expected ArgumentException");
+  return result;
+}
+
+TestResult test_processor_find() {
+  TestResult result("test_processor_find");
+  TestContainer container({"foo", "Alice", "Bob", "txt"});
+  std::vector<Processor> processors;
+  processors.emplace_back(&container, 0, "foo");
+  processors.emplace_back(&container, 1, "Alice");
+  processors.emplace_back(&container, 2, "Bob");
+  processors.emplace_back(&container, 3, "txt");
+
+  fs::path path = fs::path("E:") / "Alice" / "Bob" / "foo.txt";
+  fs::directory_entry entry{path};
+  for (Processor &proc : processors) {
+    proc.push(7, entry);
+    proc.process();
+  }
+
+  if (container.get_store().size() != 1) {
+    result.errors.emplace_back(
+        std::format("Expected exactly one result. Instead found: {}",
+                    container.get_store().size()));
+    return result;
+  }
+
+  // Folder names don't match, and both file name matches share one record.
+  auto [key, value] = *container.get_store().begin();
+  if (key != 7 || value.path != path) {
+    result.errors.emplace_back("Incorrect path was pushed into container.");
+  }
+  if (value.patterns != PatternMask{0b1001}) {
+    result.errors.emplace_back("Expected \"foo\" and \"txt\" to match.");
+  }
+
+  // Searches for more than 64 substrings spill the mask past its first word.
+  std::vector<std::string> args{"exe_name", "."};
+  for (size_t i = 0; i < 200; ++i) {
+    args.push_back(std::format("s{}", i));
+  }
+  if (!std::holds_alternative<SearchSettings>(ArgParser().parse_args(args))) {
+    result.errors.emplace_back("Expected 200 substrings to be accepted.");
+  }
+  PatternMask wide;
+  wide.set(3);
+  wide.set(130);
+  ByteWriter out;
+  wide.write(out);
+  ByteReader in(out.out);
+  if (!wide.test(3) || !wide.test(130) || wide.test(66) || wide.test(500) ||
+      PatternMask::read(in) != wide || wide == PatternMask{0b1000}) {
+    result.errors.emplace_back("Expected a mask of more than 64 patterns.");
+  }
+
+  return result;
+}
+
+/// @brief Creates an empty directory for a test under the system temporary
+/// directory, populated with empty files at the given relative paths.
+fs::path make_test_tree(std::string name,
+                        const std::vector<std::string> &files) {
+  fs::path root = fs::temp_directory_path() / "file_finder_tests" / name;
+  fs::remove_all(root);
+  fs::create_directories(root);
+  for (const std::string &file : files) {
+    fs::path path = root / file;
+    fs::create_directories(path.parent_path());
+    std::ofstream(path) << file;
+  }
+  return root;
+}
+
+TestResult test_index_query() {
+  TestResult result("test_index_query");
+  fs::path root = make_test_tree(
+      "index_query", {"alice/report.doc", "alice/notes.txt", "bob/report.txt",
+                      "bob/zzz.bin", "carol/book_report.doc", "top.txt"});
+  fs::create_directories(root / "alice" / "report_folder");
+  fs::path index_path = root.parent_path() / "index_query.idx";
+  PathIndex::write(index_path, root, IndexTree::scan(root), 2);
+  PathIndex index(index_path);
+
+  IndexQueryStats stats;
+  auto matches = index.query({"", {"report", "txt"}}, &stats);
+  std::map<std::string, PatternMask> found;
+  for (const IndexMatch &match : matches) {
+    found[match.path] = match.patterns;
+  }
+  std::map<std::string, PatternMask> expected{
+      {"alice/notes.txt", PatternMask{0b10}},
+      {"alice/report.doc", PatternMask{0b01}},
+      {"bob/report.txt", PatternMask{0b11}},
+      {"carol/book_report.doc", PatternMask{0b01}},
+      {"top.txt", PatternMask{0b10}}};
+  if (found != expected) {
+    result.errors.emplace_back(
+        std::format("Expected {} matches. Found {}", expected.size(),
+                    found.size()));
+  }
+
+  // "zzz" only occurs in one block, every other block is skipped unread.
+  stats = {};
+  matches = index.query({"", {"zzz"}}, &stats);
+  if (matches.size() != 1 || stats.blocks_scanned != 1) {
+    result.errors.emplace_back(std::format(
+        "Expected one match from one block. Found {} from {} blocks",
+        matches.size(), stats.blocks_scanned));
+  }
+
+  return result;
+}
+
+TestResult test_index_subtree_query() {
+  TestResult result("test_index_subtree_query");
+  fs::path root = make_test_tree(
+      "index_subtree", {"a-b/report.txt", "a/b/report.txt", "a/report.txt",
+                        "a/b/c/report.txt", "b/report.txt", "report.txt"});
+  fs::path index_path = root.parent_path() / "index_subtree.idx";
+  PathIndex::write(index_path, root, IndexTree::scan(root), 1);
+  PathIndex index(index_path);
+
+  IndexQueryStats stats;
+  auto matches = index.query(
+      {index.relative_prefix(root / "a" / "b"), {"report"}}, &stats);
+  std::vector<std::string> found;
+  for (const IndexMatch &match : matches) {
+    found.push_back(match.path);
+  }
+  std::vector<std::string> expected{"a/b/report.txt", "a/b/c/report.txt"};
+  if (found != expected) {
+    result.errors.emplace_back(std::format(
+        "Expected a/b/report.txt, a/b/c/report.txt. Found {} matches",
+        found.size()));
+  }
+  // One file per block: only the subtree's two blocks and the one before them
+  // (which may hold the subtree's first files) are visited.
+  if (stats.blocks_scanned > 3) {
+    result.errors.emplace_back(std::format(
+        "Expected at most 3 blocks scanned. Found {}", stats.blocks_scanned));
+  }
+
+  try {
+    index.query({"a/missing", {"report"}});
+    result.errors.emplace_back("Expected IndexException for missing folder.");
+  } catch (IndexException &exception) {
+  }
+  return result;
+}
+
+TestResult test_index_broken_link() {
+  TestResult result("test_index_broken_link");
+#if defined(FILE_FINDER_POSIX)
+  fs::path root = make_test_tree(
+      "index_broken_link", {"a/report.txt", "a/b/report.txt", "a/z.txt"});
+  // An entry whose status can't be read doesn't end its folder's listing.
+  fs::create_symlink(root / "missing", root / "a" / "dangling");
+  IndexTree tree = IndexTree::scan(root);
+  if (tree.files.size() != 4 || tree.directories.size() != 3) {
+    result.errors.emplace_back(std::format(
+        "Expected 4 files and 3 folders next to a broken link. Found {}, {}",
+        tree.files.size(), tree.directories.size()));
+  }
+#endif
+  return result;
+}
+
+TestResult test_subtree_summary() {
+  TestResult result("test_subtree_summary");
+  fs::path root = make_test_tree(
+      "subtree_summary",
+      {"logs/app/error_1.txt", "logs/app/error_2.txt", "logs/web/access.txt",
+       "logs/web/access_old.txt", "src/a.cpp", "src/b.cpp", "src/c/d.cpp"});
+  fs::path index_path = root.parent_path() / "subtree_summary.idx";
+  PathIndex::write(index_path, root, IndexTree::scan(root), 1);
+  PathIndex index(index_path);
+
+  // Neither src nor logs/web has a name with "er", "rr", "ro" or "or".
+  IndexQueryStats stats;
+  auto matches = index.query({"", {"error"}}, &stats);
+  if (matches.size() != 2 || stats.subtrees_skipped != 2 ||
+      stats.blocks_scanned != 2) {
+    result.errors.emplace_back(std::format(
+        "Expected 2 matches with 2 subtrees skipped. Found {} with {} skipped",
+        matches.size(), stats.subtrees_skipped));
+  }
+  // A substring with a pair in every subtree, and one too short to have a
+  // pair, skip nothing.
+  stats = {};
+  if (index.query({"", {"cp"}}, &stats).size() != 3 ||
+      index.query({"logs", {"t"}}, &stats).size() != 4 ||
+      stats.subtrees_skipped != 1) {
+    result.errors.emplace_back("Expected only logs skipped for \"cp\".");
+  }
+  return result;
+}
+
+TestResult test_index_range_query() {
+  TestResult result("test_index_range_query");
+  fs::path root = make_test_tree(
+      "index_range", {"a_backup_old.txt", "b_backup_old.txt", "c_backup.txt",
+                      "d_backup_big.txt"});
+  auto old_time = fs::file_time_type::clock::now() - std::chrono::days{10};
+  fs::last_write_time(root / "a_backup_old.txt", old_time);
+  fs::last_write_time(root / "b_backup_old.txt", old_time);
+  std::ofstream(root / "d_backup_big.txt") << std::string(4096, 'x');
+  fs::path index_path = root.parent_path() / "index_range.idx";
+  PathIndex::write(index_path, root, IndexTree::scan(root), 2);
+  PathIndex index(index_path);
+
+  // The first block only holds old files, so its zone map rules it out.
+  IndexQuery query{"", {"backup"}};
+  query.min_mtime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        (fs::file_time_type::clock::now() -
+                         std::chrono::days{1})
+                            .time_since_epoch())
+                        .count();
+  IndexQueryStats stats;
+  auto matches = index.query(query, &stats);
+  if (matches.size() != 2 || stats.blocks_skipped != 1) {
+    result.errors.emplace_back(std::format(
+        "Expected 2 recent matches, 1 block skipped. Found {}, {} skipped",
+        matches.size(), stats.blocks_skipped));
+  }
+
+  query.min_size = 1024;
+  matches = index.query(query);
+  if (matches.size() != 1 || matches[0].path != "d_backup_big.txt") {
+    result.errors.emplace_back("Expected only d_backup_big.txt >= 1K.");
+  }
+
+  // Rewriting a file in place leaves its folder's time alone, but a refresh
+  // still picks up the file's new time.
+  fs::path index_dir = root.parent_path() / "index_range.index";
+  fs::remove_all(index_dir);
+  ShardedIndex::build(index_dir, root);
+  std::ofstream(root / "a_backup_old.txt") << "rewritten";
+  ShardedIndex::refresh(index_dir);
+  IndexQuery recent{"", {"backup"}};
+  recent.min_mtime = query.min_mtime;
+  if (ShardedIndex(index_dir).query(recent).size() != 3) {
+    result.errors.emplace_back("Expected the rewritten file to be recent.");
+  }
+
+  // Sizes are scaled by their unit, unless that overflows.
+  auto parse_min_size = [&](const std::string &size) {
+    return ArgParser().parse_args({"exe_name", "--index", index_path.string(),
+                                   "--min-size", size, root.string(),
+                                   "backup"});
+  };
+  Command command = parse_min_size("17179869183G");
+  IndexQueryCommand *parsed = std::get_if<IndexQueryCommand>(&command);
+  if (parsed == nullptr || parsed->min_size != (uint64_t{17179869183} << 30)) {
+    result.errors.emplace_back("Expected the largest size in G to parse.");
+  }
+  try {
+    parse_min_size("17179869184G");
+    result.errors.emplace_back("Expected ArgumentException for 2^64 bytes.");
+  } catch (ArgumentException &exception) {
+  }
+
+  // So are durations, and an age older than the clock rules out nothing.
+  auto parse_within = [&](const std::string &duration) {
+    return ArgParser().parse_index_query(
+        {"query", "--modified-within", duration, ".", "backup"}, 1);
+  };
+  if (parse_within("106751991167300d").modified_within !=
+      std::chrono::days{106751991167300}) {
+    result.errors.emplace_back("Expected the longest duration in d to parse.");
+  }
+  try {
+    parse_within("300000000000000000d");
+    result.errors.emplace_back("Expected ArgumentException for 2^63 s.");
+  } catch (ArgumentException &exception) {
+  }
+  int64_t now = to_nanoseconds(fs::file_time_type::clock::now());
+  int64_t day = int64_t{86400} * 1'000'000'000;
+  if (modified_since(std::chrono::days{1}, now) != now - day ||
+      modified_since(std::chrono::seconds::max(), now) !=
+          std::numeric_limits<int64_t>::min() ||
+      modified_since(std::chrono::seconds::max(),
+                     std::numeric_limits<int64_t>::max()) !=
+          std::numeric_limits<int64_t>::min()) {
+    result.errors.emplace_back("Expected ages to clamp at the oldest time.");
+  }
+  return result;
+}
+
+std::vector<std::string>
+index_match_paths(const std::vector<IndexMatch> &matches) {
+  std::vector<std::string> paths;
+  for (const IndexMatch &match : matches) {
+    paths.push_back(match.path);
+  }
+  return paths;
+}
+
+TestResult test_sharded_index() {
+  TestResult result("test_sharded_index");
+  fs::path root = make_test_tree(
+      "sharded", {"a/log.txt", "a/deep/log.txt", "b/log.txt", "c/log.txt",
+                  "log.txt"});
+  fs::path index_dir = root.parent_path() / "sharded.index";
+  fs::remove_all(index_dir);
+  ShardedIndex::build(index_dir, root);
+
+  auto paths = index_match_paths;
+  {
+    ShardedIndex index(index_dir);
+    std::vector<std::string> expected{"log.txt", "a/log.txt",
+                                      "a/deep/log.txt", "b/log.txt",
+                                      "c/log.txt"};
+    if (index.shards.size() != 4 ||
+        paths(index.query({"", {"log"}})) != expected) {
+      result.errors.emplace_back("Expected 4 shards and 5 matches in order.");
+    }
+    expected = {"a/deep/log.txt"};
+    if (paths(index.query({"a/deep", {"log"}})) != expected) {
+      result.errors.emplace_back("Expected only a/deep/log.txt below a/deep.");
+    }
+  }
+
+  std::ofstream(root / "b" / "new_log.txt") << "new";
+  IndexRefreshStats stats = ShardedIndex::refresh(index_dir);
+  if (stats.shards_updated != 1 || stats.shards_kept != 3) {
+    result.errors.emplace_back(std::format(
+        "Expected 1 shard updated, 3 kept. Found {} updated, {} kept",
+        stats.shards_updated, stats.shards_kept));
+  }
+  fs::remove_all(root / "c");
+  stats = ShardedIndex::refresh(index_dir);
+  if (stats.shards_removed != 1) {
+    result.errors.emplace_back("Expected shard of c to be removed.");
+  }
+  ShardedIndex index(index_dir);
+  std::vector<std::string> expected{"b/log.txt", "b/new_log.txt"};
+  if (paths(index.query({"b", {"log"}})) != expected ||
+      index.find_shard("c") != nullptr) {
+    result.errors.emplace_back("Expected refreshed b and no c.");
+  }
+
+  // Appending to a file leaves its folder's time alone; the refresh still
+  // updates the file's shard, and only that one.
+  std::ofstream(root / "a" / "deep" / "log.txt", std::ios::app) << "grown";
+  stats = ShardedIndex::refresh(index_dir);
+  IndexQuery large{"", {"log"}};
+  large.min_size = 16;
+  expected = {"a/deep/log.txt"};
+  if (stats.shards_updated != 1 ||
+      paths(ShardedIndex(index_dir).query(large)) != expected) {
+    result.errors.emplace_back("Expected the appended file's new size.");
+  }
+  return result;
+}
+
+TestResult test_index_compaction() {
+  TestResult result("test_index_compaction");
+  fs::path root = make_test_tree(
+      "compaction", {"a/one.log", "a/two.log", "a/deep/three.log"});
+  fs::path index_dir = root.parent_path() / "compaction.index";
+  fs::remove_all(index_dir);
+  ShardedIndex::build(index_dir, root);
+  ShardedIndex before(index_dir);
+
+  // Each refresh adds a segment to a's shard: a re-listed folder, a new
+  // folder and a removed subtree.
+  fs::remove(root / "a" / "one.log");
+  ShardedIndex::refresh(index_dir);
+  fs::create_directories(root / "a" / "new");
+  std::ofstream(root / "a" / "new" / "four.log") << "four";
+  ShardedIndex::refresh(index_dir);
+  fs::remove_all(root / "a" / "deep");
+  ShardedIndex::refresh(index_dir);
+
+  std::vector<std::string> expected{"a/two.log", "a/new/four.log"};
+  ShardedIndex layered(index_dir);
+  if (layered.find_shard("a")->layers.size() != 4 ||
+      index_match_paths(layered.query({"", {"log"}})) != expected) {
+    result.errors.emplace_back("Expected 4 layers with two.log, four.log.");
+  }
+
+  if (ShardedIndex::compact(index_dir) != 1) {
+    result.errors.emplace_back("Expected a's shard to be compacted.");
+  }
+  ShardedIndex compacted(index_dir);
+  if (compacted.find_shard("a")->layers.size() != 1 ||
+      compacted.epoch != layered.epoch + 1 ||
+      index_match_paths(compacted.query({"", {"log"}})) != expected) {
+    result.errors.emplace_back("Expected 1 layer with two.log, four.log.");
+  }
+  // A refresh after compaction finds nothing left to do.
+  if (ShardedIndex::refresh(index_dir).shards_updated != 0) {
+    result.errors.emplace_back("Expected compacted shard to be current.");
+  }
+  // A file rewritten in place gets a segment, and the service's next
+  // snapshot answers with its new size.
+  IndexService service(index_dir);
+  uint64_t epoch = service.snapshot()->epoch;
+  std::ofstream(root / "a" / "two.log") << "rewritten, and longer";
+  IndexRefreshStats stats = service.refresh();
+  IndexQuery large{"", {"log"}};
+  large.min_size = 16;
+  if (stats.shards_updated != 1 ||
+      service.snapshot()->epoch != epoch + 1 ||
+      index_match_paths(service.snapshot()->query(large)) !=
+          std::vector<std::string>{"a/two.log"}) {
+    result.errors.emplace_back("Expected a segment for the rewritten file.");
+  }
+
+  // Snapshots opened earlier still answer from their own epoch.
+  expected = {"a/one.log", "a/two.log", "a/deep/three.log"};
+  if (index_match_paths(before.query({"", {"log"}})) != expected) {
+    result.errors.emplace_back("Expected the first snapshot to be unchanged.");
+  }
+  return result;
+}
+
+TestResult test_content_index() {
+  TestResult result("test_content_index");
+  fs::path root = make_test_tree("content_index", {});
+  fs::create_directories(root / "src");
+  std::ofstream(root / "src" / "a.cpp") << "void needle_in_a() {}";
+  std::ofstream(root / "src" / "b.cpp") << "void other() {}";
+  std::ofstream(root / "src" / "c.cpp") << "// needs a needle";
+  std::ofstream(root / "top.cpp") << "needle";
+  std::ofstream(root / "src" / "blob.cpp") << std::string("needle\0", 7);
+  // Too large to index; the text is at the end.
+  std::ofstream(root / "src" / "big.cpp")
+      << std::string(ContentIndex::max_file_size, ' ') << "needle_in_big";
+  fs::path index_dir = root.parent_path() / "content_index.index";
+  fs::remove_all(index_dir);
+  ShardedIndex::build(index_dir, root, true);
+
+  // Only files with every trigram of "needle_", and the files that weren't
+  // indexed, are read to confirm.
+  auto query = [&](std::string_view text, size_t *read) {
+    ShardedIndex index(index_dir);
+    IndexQueryStats stats;
+    std::vector<std::string> paths =
+        index_match_paths(index.query_content({"", {".cpp"}}, text, &stats));
+    *read = stats.files_read;
+    return paths;
+  };
+  size_t read = 0;
+  std::vector<std::string> expected{"src/a.cpp", "src/big.cpp"};
+  if (query("needle_", &read) != expected || read != 3) {
+    result.errors.emplace_back("Expected a.cpp and the skipped files read.");
+  }
+  expected = {"top.cpp", "src/a.cpp", "src/big.cpp", "src/blob.cpp",
+              "src/c.cpp"};
+  if (query("needle", &read) != expected || read != 5) {
+    result.errors.emplace_back("Expected 5 files with \"needle\".");
+  }
+
+  // A refresh indexes the contents of the folders that changed.
+  fs::create_directories(root / "src" / "new");
+  std::ofstream(root / "src" / "new" / "d.cpp") << "needle_in_d";
+  fs::remove(root / "src" / "a.cpp");
+  ShardedIndex::refresh(index_dir);
+  expected = {"src/big.cpp", "src/new/d.cpp"};
+  if (query("needle_", &read) != expected || read != 3) {
+    result.errors.emplace_back("Expected d.cpp after the refresh.");
+  }
+  // Compaction merges the layers' postings.
+  ShardedIndex::compact(index_dir);
+  ShardedIndex compacted(index_dir);
+  const ShardedIndex::Shard *src = compacted.find_shard("src");
+  if (src->layers.size() != 1 || !compacted.has_contents() ||
+      query("needle_", &read) != expected || read != 3) {
+    result.errors.emplace_back("Expected one content indexed layer.");
+  }
+  size_t tri_files = std::ranges::count_if(
+      fs::directory_iterator(index_dir), [](const fs::directory_entry &entry) {
+        return entry.path().extension() == ".tri";
+      });
+  if (tri_files != compacted.shards.size()) {
+    result.errors.emplace_back("Expected old content indexes to be deleted.");
+  }
+
+  // A file rewritten in place is indexed again, though its folder's time
+  // didn't change.
+  std::ofstream(root / "src" / "c.cpp") << "// now with fresh_text";
+  ShardedIndex::refresh(index_dir);
+  expected = {"src/c.cpp"};
+  if (query("fresh_text", &read) != expected) {
+    result.errors.emplace_back("Expected the new text of c.cpp to be found.");
+  }
+  expect_argument_exception(result, {"exe_name", "--index", index_dir.string(),
+                                     "--content", "", root.string(), ".cpp"});
+  return result;
+}
+
+TestResult test_fleet_index() {
+  TestResult result("test_fleet_index");
+  fs::path alpha = make_test_tree("fleet_alpha", {"a/app.log", "b/db.log"});
+  fs::path beta = make_test_tree("fleet_beta", {"a/web.log", "top.log"});
+  fs::path work = alpha.parent_path() / "fleet";
+  fs::remove_all(work);
+  fs::create_directories(work);
+  ShardedIndex::build(work / "alpha.index", alpha);
+  ShardedIndex::build(work / "beta.index", beta);
+  ShardedIndex::export_bundle(work / "alpha.index", work / "alpha-1.bundle",
+                              "alpha");
+  ShardedIndex::export_bundle(work / "beta.index", work / "beta-1.bundle",
+                              "beta");
+  fs::path fleet_dir = work / "fleet.index";
+  size_t updated = ShardedIndex::import_bundles(
+      fleet_dir, {work / "alpha-1.bundle", work / "beta-1.bundle"});
+
+  std::vector<std::string> expected{"alpha/a/app.log", "alpha/b/db.log",
+                                    "beta/top.log", "beta/a/web.log"};
+  if (updated != 2 ||
+      index_match_paths(ShardedIndex(fleet_dir).query({"", {"log"}})) !=
+          expected) {
+    result.errors.emplace_back("Expected both hosts in the fleet index.");
+  }
+
+  // A delta only carries the segment of the changed shard.
+  std::ofstream(alpha / "a" / "new.log") << "new";
+  fs::remove_all(alpha / "b");
+  ShardedIndex::refresh(work / "alpha.index");
+  ShardedIndex::Bundle delta = ShardedIndex::export_bundle(
+      work / "alpha.index", work / "alpha-2.bundle", "alpha", 1);
+  auto a = std::ranges::find(delta.shards, "a",
+                             &ShardedIndex::Bundle::Shard::name);
+  if (delta.shards.size() != 2 || a == delta.shards.end() || a->replace ||
+      a->layers.size() != 1) {
+    result.errors.emplace_back("Expected a delta with one segment of a.");
+  }
+  // Bundles that were imported before are skipped.
+  updated = ShardedIndex::import_bundles(
+      fleet_dir, {work / "alpha-2.bundle", work / "alpha-1.bundle"});
+  expected = {"alpha/a/app.log", "alpha/a/new.log"};
+  if (updated != 1 ||
+      index_match_paths(ShardedIndex(fleet_dir).query({"alpha", {"log"}})) !=
+          expected) {
+    result.errors.emplace_back("Expected alpha's delta to be merged.");
+  }
+
+  // A delta that doesn't follow on from the last import is refused.
+  ShardedIndex::refresh(work / "beta.index");
+  std::ofstream(beta / "other.log") << "other";
+  ShardedIndex::refresh(work / "beta.index");
+  ShardedIndex::export_bundle(work / "beta.index", work / "beta-3.bundle",
+                              "beta", 2);
+  try {
+    ShardedIndex::import_bundles(fleet_dir, {work / "beta-3.bundle"});
+    result.errors.emplace_back("Expected a gap in beta's epochs to throw.");
+  } catch (const IndexException &) {
+  }
+
+  // A bundle from a host of the other byte order is refused.
+  std::string bytes(MappedFile(work / "alpha-1.bundle").bytes());
+  bytes[ShardedIndex::Bundle::magic.size()] ^= 'L' ^ 'B';
+  std::ofstream(work / "swapped.bundle", std::ios::binary) << bytes;
+  try {
+    ShardedIndex::import_bundles(fleet_dir, {work / "swapped.bundle"});
+    result.errors.emplace_back("Expected another byte order to throw.");
+  } catch (const IndexException &) {
+  }
+  return result;
+}
+
+/// @brief Returns a tar header block for a file of `size` bytes.
+std::string tar_header(const std::string &name, size_t size,
+                       char type = '0') {
+  std::string header(512, '\0');
+  header.replace(0, name.size(), name);
+  header.replace(100, 7, "0000644");
+  header.replace(124, 11, std::format("{:011o}", size));
+  header.replace(148, 8, "        ");
+  header[156] = type;
+  header.replace(257, 8, std::string("ustar\0" "00", 8));
+  unsigned checksum = 0;
+  for (char c : header) {
+    checksum += static_cast<uint8_t>(c);
+  }
+  header.replace(148, 7, std::format("{:06o}", checksum) + '\0');
+  return header;
+}
+
+/// @brief Returns a zip holding only the central directory of `names`.
+std::string zip_directory(const std::vector<std::string> &names) {
+  ByteWriter directory;
+  for (const std::string &name : names) {
+    directory.out.append("PK\x01\x02", 4);
+    directory.out.append(24, '\0');
+    directory.fixed<uint16_t>(static_cast<uint16_t>(name.size()));
+    directory.out.append(16, '\0');
+    directory.out.append(name);
+  }
+  ByteWriter end;
+  end.out.append("PK\x05\x06", 4);
+  end.out.append(6, '\0');
+  end.fixed<uint16_t>(static_cast<uint16_t>(names.size()));
+  end.fixed<uint32_t>(static_cast<uint32_t>(directory.out.size()));
+  end.fixed<uint32_t>(0);
+  end.out.append(2, '\0');
+  return directory.out + end.out;
+}
+
+TestResult test_archive_search() {
+  TestResult result("test_archive_search");
+  fs::path root = make_test_tree("archive_search", {"plain_report.txt"});
+  {
+    std::ofstream tar(root / "backup.tar", std::ios::binary);
+    std::string contents(1000, 'x'); // Spans two blocks, which are skipped.
+    std::string long_name = "deep/" + std::string(120, 'd') + "/report.md";
+    tar << tar_header("docs/report.txt", contents.size())
+        << contents << std::string(24, '\0')
+        << tar_header("docs/", 0, '5')
+        << tar_header("././@LongLink", long_name.size() + 1, 'L')
+        << long_name << std::string(512 - long_name.size(), '\0')
+        << tar_header("ignored", 0) << tar_header("other.bin", 0)
+        << std::string(1024, '\0');
+  }
+  std::ofstream(root / "photos.ZIP", std::ios::binary)
+      << zip_directory({"2023/", "2023/report.jpg", "2023/beach.jpg"});
+  std::ofstream(root / "broken.zip") << "not a zip";
+  // Claims two entries, and an extra field that runs past the directory.
+  std::string corrupt = zip_directory({"a_report.jpg"});
+  corrupt[30] = '\xFF';
+  corrupt[corrupt.size() - 12] = 2;
+  std::ofstream(root / "corrupt.zip", std::ios::binary) << corrupt;
+  try {
+    ArchiveLister::list(root / "corrupt.zip",
+                        [](std::string_view) { return true; });
+    result.errors.emplace_back("Expected the corrupt zip to be refused.");
+  } catch (const IndexException &) {
+  }
+
+  std::vector<std::string> members;
+  ArchiveLister::list(root / "backup.tar", [&](std::string_view member) {
+    members.emplace_back(member);
+    return true;
+  });
+  std::vector<std::string> expected{
+      "docs/report.txt", "deep/" + std::string(120, 'd') + "/report.md",
+      "other.bin"};
+  if (members != expected) {
+    result.errors.emplace_back("Expected the files of the tar in order.");
+  }
+
+  TestContainer container({"report"});
+  ArchiveLister archives(&container, {"report"}, 2);
+  PathFinder finder;
+  finder.archives = &archives;
+  std::vector<Processor> processors;
+  processors.emplace_back(&container, 0, "report");
+  finder.list_paths(root, &processors, fs::directory_options::none);
+  archives.finish();
+  processors[0].process();
+
+  std::set<std::string> paths;
+  for (const auto &[id, match] : container.get_store()) {
+    paths.insert(match.path.generic_string().substr(
+        root.generic_string().size() + 1));
+  }
+  std::set<std::string> expected_paths{
+      "plain_report.txt", "backup.tar!/docs/report.txt",
+      "backup.tar!/deep/" + std::string(120, 'd') + "/report.md",
+      "photos.ZIP!/2023/report.jpg"};
+  if (paths != expected_paths) {
+    result.errors.emplace_back(std::format(
+        "Expected matches in the tar and zip, found {}", paths.size()));
+  }
+  if (archives.archives_listed != 2) {
+    result.errors.emplace_back("Expected the broken zip to be skipped.");
+  }
+  return result;
+}
+
+TestResult test_magic_filter() {
+  TestResult result("test_magic_filter");
+  MagicClassifier classifier;
+  std::string tar(512, '\0');
+  tar.replace(257, 5, "ustar");
+  auto type = [&classifier](std::string_view head) {
+    const MagicSignature *signature = classifier.classify(head);
+    return signature == nullptr ? std::string_view("") : signature->type;
+  };
+  if (type("%PDF-1.7\n") != "pdf" || type("GIF89a...") != "gif" ||
+      type("\x7F" "ELF\x02") != "elf" || type(tar) != "tar" ||
+      type("MZ") != "pe" || type("M") != "" || type("plain text") != "") {
+    result.errors.emplace_back("Expected signatures to be classified.");
+  }
+
+  fs::path root = make_test_tree("magic_filter", {});
+  std::ofstream(root / "report.pdf") << "%PDF-1.4 report";
+  std::ofstream(root / "fake_report.pdf") << "\x89PNG\r\n\x1A\n....";
+  std::ofstream(root / "report.png") << "\x89PNG\r\n\x1A\n....";
+  std::ofstream(root / "report.txt") << "%PDF-1.4 renamed";
+  std::ofstream(root / "notes.pdf") << "%PDF-1.4 notes";
+
+  std::vector<std::string> patterns{"report", "pdf"};
+  TestContainer container(patterns);
+  FileFilter filter(&container, MagicClassifier::check({"application/pdf"}),
+                    2);
+  // Held until both processors posted, so that each file is checked once.
+  Throttle throttle;
+  throttle.pause();
+  filter.throttle = &throttle;
+  std::vector<Processor> processors;
+  processors.reserve(patterns.size());
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    processors.emplace_back(&container, i, patterns[i]);
+    processors.back().filter = &filter;
+  }
+  PathFinder finder;
+  finder.list_paths(root, &processors, fs::directory_options::none);
+  for (Processor &processor : processors) {
+    processor.process();
+  }
+  throttle.resume();
+  filter.finish();
+
+  std::map<std::string, PatternMask> matches;
+  for (const auto &[id, match] : container.get_store()) {
+    matches[match.path.filename().string()] = match.patterns;
+  }
+  if (matches.size() != 3 || matches["report.pdf"].count() != 2 ||
+      matches["report.txt"].count() != 1 ||
+      matches["notes.pdf"].count() != 1) {
+    result.errors.emplace_back(
+        "Expected only the PDFs among the name matches.");
+  }
+  // Files matching both substrings are read once; notes.pdf only matched
+  // "pdf" and report.png only "report".
+  if (filter.files_checked != 5) {
+    result.errors.emplace_back(std::format(
+        "Expected 5 files read, found {}", filter.files_checked.load()));
+  }
+  // Checked files are forgotten; posting one again checks it again.
+  size_t pending = filter.pending();
+  filter.post(SearchResult{container.get_store().begin()->first, 0},
+              container.get_store().begin()->second.path);
+  filter.finish();
+  if (pending != 0 || filter.pending() != 0 || filter.files_checked != 6) {
+    result.errors.emplace_back("Expected checked files to be forgotten.");
+  }
+  return result;
+}
+
+TestResult test_content_cache() {
+  TestResult result("test_content_cache");
+  fs::path root = make_test_tree("content_cache", {});
+  std::ofstream(root / "a.cpp") << "int main() { return 0; }";
+  std::ofstream(root / "b.cpp") << "// TODO: main";
+  std::ofstream(root / "c.cpp") << "nothing here";
+  std::ofstream(root / "d.txt") << "TODO, but not a .cpp";
+  fs::path cache_dir = root.parent_path() / "content_cache.cache";
+  fs::remove_all(cache_dir);
+
+  // Searches for .cpp files containing `text`, with a fresh view of the
+  // cache, and returns the names found.
+  auto search = [&](ContentCache &cache, const std::string &text = "main") {
+    std::vector<std::string> patterns{".cpp"};
+    TestContainer container(patterns);
+    FileFilter filter(&container, content_check(text, &cache), 2);
+    std::vector<Processor> processors;
+    processors.emplace_back(&container, 0, ".cpp");
+    processors.back().filter = &filter;
+    PathFinder finder;
+    finder.list_paths(root, &processors, fs::directory_options::none);
+    processors[0].process();
+    filter.finish();
+    std::set<std::string> names;
+    for (const auto &[id, match] : container.get_store()) {
+      names.insert(match.path.filename().string());
+    }
+    return names;
+  };
+
+  std::set<std::string> expected{"a.cpp", "b.cpp"};
+  {
+    ContentCache cache(cache_dir, "main");
+    if (search(cache) != expected || cache.misses != 3 || cache.hits != 0) {
+      result.errors.emplace_back("Expected 3 files read on the first run.");
+    }
+    cache.save();
+  }
+  {
+    ContentCache cache(cache_dir, "main");
+    if (search(cache) != expected || cache.misses != 0 || cache.hits != 3) {
+      result.errors.emplace_back("Expected every file answered from cache.");
     }
-    ready &= container->should_continue;
+    cache.save();
+  }
+  // A changed file is read again; the others aren't.
+  std::ofstream(root / "c.cpp") << "int main; // now longer than before";
+  {
+    ContentCache cache(cache_dir, "main");
+    expected = {"a.cpp", "b.cpp", "c.cpp"};
+    if (search(cache) != expected || cache.misses != 1 || cache.hits != 2) {
+      result.errors.emplace_back("Expected only c.cpp to be read again.");
+    }
+  }
+  // Another text has a cache of its own.
+  ContentCache other(cache_dir, "TODO");
+  expected = {"b.cpp"};
+  if (search(other, "TODO") != expected || other.misses != 3) {
+    result.errors.emplace_back("Expected a separate cache per text.");
   }
 
-  std::thread ui_thread([&]() {
-    while (should_continue) {
-      std::string command;
-      std::getline(std::cin, command);
+  // A record count that doesn't fit the file (here one whose size in bytes
+  // wraps around to 0) makes the cache be ignored.
+  ByteWriter corrupt;
+  corrupt.out.append(ContentCache::magic);
+  corrupt.fixed<uint64_t>(uint64_t{1} << 63);
+  std::ofstream(cache_dir / std::format("{:016x}.content", fnv1a("main")),
+                std::ios::binary)
+      << corrupt.out;
+  ContentCache ignored(cache_dir, "main");
+  expected = {"a.cpp", "b.cpp", "c.cpp"};
+  if (search(ignored) != expected || ignored.misses != 3) {
+    result.errors.emplace_back("Expected a corrupt cache to be ignored.");
+  }
+  return result;
+}
 
-      if (command == "end" || command == "Exit") {
-        stop_func();
-      } else if (command == "dump" || command == "Dump") {
-        container->dump();
-      } else {
-        std::osyncstream(std::cout)
-            << "unknown command \"" << command << "\"" << std::endl;
+TestResult test_compressed_content() {
+  TestResult result("test_compressed_content");
+  fs::path root = make_test_tree("compressed_content", {});
+  // A marker across the boundary of the first two chunks of the search.
+  std::string bytes(600 * 1024, '.');
+  bytes.replace(256 * 1024 - 3, 6, "MARKER");
+  std::ofstream(root / "plain.log", std::ios::binary) << bytes;
+
+  auto contains = [&](const fs::path &path, std::string_view text) {
+    std::string head(8, '\0');
+    head.resize(std::ifstream(path, std::ios::binary)
+                    .read(head.data(), head.size())
+                    .gcount());
+    DecompressedFile file(path, DecompressedFile::detect(head));
+    return stream_contains(file, text);
+  };
+  if (DecompressedFile::detect(bytes) != Codec::None ||
+      !contains(root / "plain.log", "MARKER") ||
+      contains(root / "plain.log", "MISSING")) {
+    result.errors.emplace_back("Expected a marker split across chunks.");
+  }
+#if defined(FILE_FINDER_ZLIB)
+  // Two gzip members, as appending to a compressed log leaves them.
+  fs::path gz = root / "rotated.log.gz";
+  for (std::string member : {bytes, std::string("SECOND")}) {
+    gzFile out = gzopen(gz.string().c_str(), "ab");
+    gzwrite(out, member.data(), static_cast<unsigned>(member.size()));
+    gzclose(out);
+  }
+  if (!contains(gz, "MARKER") || !contains(gz, "SECOND") ||
+      contains(gz, "MISSING")) {
+    result.errors.emplace_back("Expected both gzip members searched.");
+  }
+  std::vector<char> verdicts =
+      content_check("SECOND", nullptr)({gz, root / "plain.log"});
+  if (verdicts != std::vector<char>{1, 0}) {
+    result.errors.emplace_back("Expected --content to see through gzip.");
+  }
+#endif
+  return result;
+}
+
+TestResult test_batch_matcher() {
+  TestResult result("test_batch_matcher");
+  // Random short names over a small alphabet, so that patterns often occur
+  // and often straddle two names, which mustn't count.
+  std::mt19937 random(7);
+  auto random_text = [&](size_t max_length) {
+    std::string text(random() % (max_length + 1), ' ');
+    for (char &c : text) {
+      c = "abc."[random() % 4];
+    }
+    return text;
+  };
+  for (int round = 0; round < 200; ++round) {
+    NameChunk chunk;
+    std::vector<std::string> names;
+    chunk.bytes = random_text(5); // Not part of any name.
+    size_t begin = chunk.bytes.size();
+    for (size_t i = random() % 150; i > 0; --i) {
+      names.push_back(random_text(20));
+      chunk.add(names.back());
+    }
+    std::string pattern = random_text(6);
+    std::vector<uint64_t> matches =
+        BatchMatcher(pattern).match(chunk.bytes, chunk.ends, begin);
+    for (size_t i = 0; i < names.size(); ++i) {
+      bool expected = names[i].find(pattern) != std::string::npos;
+      if (((matches[i / 64] >> (i % 64) & 1) != 0) != expected) {
+        result.errors.emplace_back(std::format(
+            "Expected \"{}\" in \"{}\" to be {}", pattern, names[i],
+            expected ? "found" : "not found"));
+        return result;
       }
     }
-  });
+  }
+  return result;
+}
 
-  while (should_continue && !(search_future.wait_for(std::chrono::milliseconds(
-                                  150)) == std::future_status::ready)) {
+TestResult test_path_glob() {
+  TestResult result("test_path_glob");
+  auto matches = [](std::string_view glob, std::string_view path) {
+    PathGlob automaton(glob);
+    return automaton.accepts(automaton.step(automaton.start(), path));
+  };
+  if (!matches("**/foo", "foo") || !matches("**/foo", "a/b/foo") ||
+      matches("**/foo", "xfoo") || matches("**/foo", "a/xfoo") ||
+      !matches("a/**", "a/b/c") || matches("*.txt", "a/b.txt") ||
+      !matches("?/*.t?t", "a/b.txt") || matches("?", "/") ||
+      !matches("a/**/b/*", "a/b/c") || matches("a/**/b/*", "a/cb/c")) {
+    result.errors.emplace_back("Expected globs to match whole paths.");
   }
 
-  // Search thread finished, but we may still have some processing to do.
-  while (should_continue && std::transform_reduce(
-              processors->begin(), processors->end(), 0, std::plus<>{},
-              [](Processor &proc) { return proc.queue_size(); }) > 0) {
-    // There is at least one processor with items to process.
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  fs::path root = make_test_tree(
+      "path_glob",
+      {"a/logs/x/error1.txt", "a/logs/x/info.txt", "a/logs/y/z/error2.txt",
+       "a/logs/x/deep/error3.txt", "b/src/error.txt", "logs/error0.txt"});
+  auto walk = [&](std::string_view pattern, size_t *pruned) {
+    PathGlob glob(pattern);
+    PathFinder finder;
+    finder.glob = &glob;
+    std::set<std::string> found;
+    finder.walk(root, fs::directory_options::none,
+                [&](EntryId, const fs::directory_entry &entry) {
+                  found.insert(
+                      entry.path().lexically_relative(root).generic_string());
+                });
+    *pruned = finder.folders_pruned;
+    return found;
+  };
+  // b/src, a/logs/x/deep and a/logs/y/z can't match and aren't read.
+  size_t pruned = 0;
+  if (walk("*/logs/*/error*.txt", &pruned) !=
+          std::set<std::string>{"a/logs/x/error1.txt"} ||
+      pruned != 3) {
+    result.errors.emplace_back(std::format(
+        "Expected a/logs/x/error1.txt with 3 folders pruned. {} pruned",
+        pruned));
   }
-  container->dump();
+  std::set<std::string> expected{"logs/error0.txt", "a/logs/x/error1.txt",
+                                 "a/logs/y/z/error2.txt",
+                                 "a/logs/x/deep/error3.txt"};
+  if (walk("**/logs/**/error*.txt", &pruned) != expected || pruned != 0) {
+    result.errors.emplace_back("Expected every error*.txt below a logs.");
+  }
+  return result;
+}
 
-  stop_func();
-  search_thread.join();
-  for (std::thread &thread : processor_threads) {
-    thread.join();
+TestResult test_name_dictionary() {
+  TestResult result("test_name_dictionary");
+  NameDictionary names;
+  std::vector<NameId> ids(8);
+  parallel_for(ids.size(), [&](size_t i) {
+    ids[i] = names.intern(i % 2 == 0 ? "index.js" : "__init__.py");
+  });
+  if (names.size() != 2 || ids[0] != ids[6] || ids[1] != ids[7] ||
+      ids[0] == ids[1] || names.name(ids[1]) != "__init__.py") {
+    result.errors.emplace_back("Expected one id per distinct name.");
+  }
+  // Threads racing for the last ids across shards never get one past the
+  // capacity.
+  NameDictionary small(100);
+  std::vector<NameId> taken(1000);
+  parallel_for(taken.size(), [&](size_t i) {
+    taken[i] = small.intern(std::format("name_{}", i));
+  });
+  size_t interned = std::ranges::count_if(
+      taken, [](NameId id) { return id != no_name && id < 100; });
+  if (interned != 100 || small.size() != 100 ||
+      std::ranges::count(taken, no_name) != 900) {
+    result.errors.emplace_back(std::format(
+        "Expected 100 names interned. Found {} of size {}", interned,
+        small.size()));
   }
-  dump_thread.join();
-  ui_thread.detach();
 
-  std::osyncstream(std::cout).flush();
+  fs::path root = make_test_tree(
+      "name_dictionary", {"a/index.js", "b/index.js", "c/index.js",
+                          "a/main.js", "b/index.txt", "c/d/index.js"});
+  std::vector<std::string> patterns{"index", ".js"};
+  TestContainer container(patterns);
+  NameDictionary dictionary;
+  NameDictionary folders;
+  std::vector<Processor> processors;
+  processors.reserve(patterns.size());
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    processors.emplace_back(&container, i, patterns[i]);
+    processors.back().names = &dictionary;
+    processors.back().folders = &folders;
+  }
+  PathFinder finder;
+  finder.names = &dictionary;
+  finder.folders = &folders;
+  finder.list_paths(root, &processors, fs::directory_options::none);
+  // The entries are queued as ids only.
+  if (processors[0].queue.size() != 0 || processors[0].interned.size() != 6 ||
+      folders.size() != 4) {
+    result.errors.emplace_back("Expected 6 entries queued by id.");
+  }
+  for (Processor &processor : processors) {
+    processor.process();
+  }
+  size_t both = 0;
+  for (const auto &[id, match] : container.get_store()) {
+    both += match.patterns.count() == 2;
+  }
+  // Matches get their full path back.
+  if (container.get_store().empty() ||
+      !fs::exists(container.get_store().begin()->second.path)) {
+    result.errors.emplace_back("Expected the matches' paths rebuilt.");
+  }
+  // Three distinct names, each matched once per pattern.
+  if (container.get_store().size() != 6 || both != 4 ||
+      dictionary.size() != 3 || dictionary.scans != 6) {
+    result.errors.emplace_back(std::format(
+        "Expected 6 matches from 6 scans of 3 names. Found {} from {} of {}",
+        container.get_store().size(), dictionary.scans.load(),
+        dictionary.size()));
+  }
+  return result;
+}
 
-  delete path_finder;
-  delete processors;
-  delete container;
+// todo: Add test for: Only filenames. E:\alice\bob\foo (folder) shouldn't be
+// counted. Note: This check is done in the finder, not the processor.
 
-  return EXIT_SUCCESS;
-}
+TestResult test_cached_search() {
+  TestResult result("test_cached_search");
+  fs::path root = make_test_tree(
+      "cached_search", {"a/report.txt", "a/b/notes.txt", "c/report.doc",
+                        "c/other.bin", "top.txt"});
+  fs::path cache_dir = root.parent_path() / "cached_search.cache";
+  fs::remove_all(cache_dir);
 
-int do_tests(); // todo: Remove forward declaration when tests are split into
-                // separate file.
-struct ArgVisitor {
-  int operator()(SearchSettings settings) { return do_main(settings); }
-  int operator()(TestCommand _) { return do_tests(); }
-  int operator()(HelpCommand help) {
-    std::cout << help.to_string() << std::endl;
-    return EXIT_SUCCESS;
+  // Runs a search for "report" and "txt", reusing and updating the cache.
+  auto search = [&](size_t *reused, size_t *read) {
+    std::vector<std::string> patterns{"txt", "report"};
+    TestContainer container(patterns);
+    ResultCache cache(cache_dir, root, patterns, "", &container);
+    container.on_push = [&cache](SearchResult match, const fs::path &path) {
+      cache.record(match, path);
+    };
+    std::vector<Processor> processors;
+    processors.emplace_back(&container, 0, "txt");
+    processors.emplace_back(&container, 1, "report");
+    PathFinder finder;
+    finder.list_paths(root, &processors,
+                      fs::directory_options::skip_permission_denied, &cache);
+    for (Processor &processor : processors) {
+      processor.process();
+    }
+    cache.save();
+    *reused = cache.folders_reused;
+    *read = cache.folders_read;
+    std::map<std::string, PatternMask> found;
+    for (auto &[id, match] : container.get_store()) {
+      found[match.path.lexically_relative(root).generic_string()] =
+          match.patterns;
+    }
+    return found;
+  };
+
+  std::map<std::string, PatternMask> expected{
+      {"a/report.txt", PatternMask{0b11}},
+      {"a/b/notes.txt", PatternMask{0b01}},
+      {"c/report.doc", PatternMask{0b10}},
+      {"top.txt", PatternMask{0b01}}};
+  size_t reused = 0;
+  size_t read = 0;
+  auto found = search(&reused, &read);
+  if (found != expected || reused != 0 || read != 4) {
+    result.errors.emplace_back(std::format(
+        "First search: expected 4 matches from 4 folders read. Found {} "
+        "matches, {} folders read",
+        found.size(), read));
   }
-};
 
-int main(int argc, char *argv[]) {
-  ArgParser parser;
-  try {
-    std::variant<SearchSettings, TestCommand, HelpCommand> args =
-        parser.parse_args({argv, argv + argc});
-    return std::visit(ArgVisitor{}, args);
-  } catch (const ArgumentException &exception) {
-    std::cout << exception.what() << std::endl;
-    return EXIT_FAILURE;
+  // Nothing changed: every folder is replayed from the cache.
+  found = search(&reused, &read);
+  if (found != expected || reused != 4 || read != 0) {
+    result.errors.emplace_back(std::format(
+        "Second search: expected 4 matches from 4 cached folders. Found {} "
+        "matches, {} folders reused",
+        found.size(), reused));
   }
-}
 
-#pragma region Tests
+  // Only the folder with a new file is read again.
+  std::ofstream(root / "c" / "report.txt") << "new";
+  expected["c/report.txt"] = PatternMask{0b11};
+  found = search(&reused, &read);
+  if (found != expected || reused != 3 || read != 1) {
+    result.errors.emplace_back(std::format(
+        "Third search: expected 5 matches, 1 folder read. Found {} matches, "
+        "{} folders read",
+        found.size(), read));
+  }
+  return result;
+}
 
-struct TestContainer : SearchResultContainer {
-  std::unordered_map<fs::path, std::vector<ResultValue>> get_store() {
-    return this->store;
+TestResult test_shared_scan() {
+  TestResult result("test_shared_scan");
+  fs::path root = make_test_tree(
+      "shared_scan", {"a/report.txt", "a/b/report.doc", "ab/report.txt",
+                      "c/notes.txt", "report.md"});
+  SharedScan scan(root);
+  if (!scan.covers(root / "a") || scan.covers(root.parent_path())) {
+    result.errors.emplace_back("Expected the scan to cover only its root.");
   }
-};
 
-struct TestResult {
+  auto paths = [&](TestContainer &container) {
+    std::set<std::string> found;
+    for (auto &[id, match] : container.get_store()) {
+      found.insert(match.path.lexically_relative(root).generic_string());
+    }
+    return found;
+  };
 
-  TestResult(std::string name) : name(name) {}
+  // One search attaches before the scan runs, one after it finished and is
+  // backfilled entirely. The scan only lists each file once.
+  TestContainer early({"report"});
+  std::thread early_search([&]() {
+    run_shared_search(scan, root / "a", {"report"}, &early);
+  });
+  scan.run();
+  early_search.join();
+  TestContainer late({"txt"});
+  run_shared_search(scan, root, {"txt"}, &late);
 
-  bool passed() { return this->errors.size() == 0; }
+  std::set<std::string> expected{"a/report.txt", "a/b/report.doc"};
+  if (paths(early) != expected) {
+    result.errors.emplace_back(std::format(
+        "Expected the 2 reports below a. Found {} matches",
+        paths(early).size()));
+  }
+  expected = {"a/report.txt", "ab/report.txt", "c/notes.txt"};
+  if (paths(late) != expected) {
+    result.errors.emplace_back(std::format(
+        "Expected 3 txt files. Found {} matches", paths(late).size()));
+  }
+  if (scan.size() != 5) {
+    result.errors.emplace_back(
+        std::format("Expected 5 scanned files. Found {}", scan.size()));
+  }
 
-  std::string name;
-  std::vector<std::string> errors;
-};
+  // --serve searches only match names: options are refused, not ignored.
+  ArgParser parser;
+  std::string dir = root.string();
+  SearchSettings search = parser.parse_serve_search({"search", dir, "txt"});
+  if (search.root_dir != root || search.substrings.size() != 1) {
+    result.errors.emplace_back("Expected a plain search to be accepted.");
+  }
+  std::vector<std::vector<std::string>> refused{
+      {"search", "--content", "x", dir, "txt"},
+      {"search", "--walkers", "4", dir, "txt"},
+      {"search", "--archives", dir, "txt"},
+      {"search", "--cache", dir, dir, "txt"}};
+  for (const std::vector<std::string> &args : refused) {
+    try {
+      parser.parse_serve_search(args);
+      result.errors.emplace_back(
+          std::format("Expected \"{}\" to be refused.", args[1]));
+    } catch (const ArgumentException &) {
+    }
+  }
+  return result;
+}
 
-TestResult test_logging_prefix() {
-  TestResult result("test_logging_prefix");
-  Logger logger{Logger::Level::Debug};
-  std::map<Logger::Level, std::string> map{
-      {Logger::Level::Silent, "[SILENT]"},   {Logger::Level::Error, "[ERROR]"},
-      {Logger::Level::Warning, "[WARNING]"}, {Logger::Level::Info, "[INFO]"},
-      {Logger::Level::Debug, "[DEBUG]"},
+TestResult test_interactive_search() {
+  TestResult result("test_interactive_search");
+  fs::path root = make_test_tree(
+      "interactive_search", {"a/report.txt", "a/b/repair.doc", "b/reply.md",
+                             "b/notes.txt", "top_report.md"});
+  EntryTable table = EntryTable::scan(root);
+  if (table.size() != 5) {
+    result.errors.emplace_back(
+        std::format("Expected 5 files in the table. Found {}", table.size()));
+  }
+  InteractiveSearch search(&table);
+
+  // Each step states the query, the expected matches and the entries that
+  // should have been checked to find them.
+  struct Step {
+    std::string query;
+    std::set<std::string> expected;
+    size_t checked;
   };
-  for (auto &[key, value] : map) {
-    std::string prefix = logger.get_prefix(key);
-    if (prefix != value) {
-      result.errors.emplace_back(
-          std::format("Expected '{}'. Found '{}'", value, prefix));
+  std::vector<Step> steps{
+      {"re", {"a/report.txt", "a/b/repair.doc", "b/reply.md",
+              "top_report.md"}, 5},
+      {"rep", {"a/report.txt", "a/b/repair.doc", "b/reply.md",
+               "top_report.md"}, 4},
+      {"repo", {"a/report.txt", "top_report.md"}, 4},
+      {"repa", {"a/b/repair.doc"}, 5}, // Not an extension: checks everything.
+  };
+  for (const Step &step : steps) {
+    std::set<std::string> found;
+    for (uint32_t entry : search.update(step.query)) {
+      found.insert(
+          table.path(entry).lexically_relative(root).generic_string());
+    }
+    if (found != step.expected || search.checked != step.checked) {
+      result.errors.emplace_back(std::format(
+          "\"{}\": expected {} matches from {} entries. Found {} from {}",
+          step.query, step.expected.size(), step.checked, found.size(),
+          search.checked));
     }
   }
   return result;
 }
 
-void expect_argument_exception(TestResult &result,
-                               const std::vector<std::string> &args) {
+TestResult test_throttle() {
+  TestResult result("test_throttle");
+  Throttle throttle;
+  auto time = [&throttle](size_t count) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      throttle.acquire();
+    }
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  // Unlimited by default.
+  if (double elapsed = time(1000); elapsed > 50) {
+    result.errors.emplace_back(std::format(
+        "Expected no limit by default. 1000 ops took {:.0f} ms", elapsed));
+  }
+  // A full bucket lets 100 through at once, the next 20 take ~200 ms.
+  throttle.set_ops_per_second(100);
+  if (double elapsed = time(120); elapsed < 150) {
+    result.errors.emplace_back(std::format(
+        "Expected 120 ops at 100/s to take 200 ms. Took {:.0f} ms", elapsed));
+  }
+  throttle.set_ops_per_second(0);
+  if (double elapsed = time(1000); elapsed > 50) {
+    result.errors.emplace_back(std::format(
+        "Expected the limit to be lifted. 1000 ops took {:.0f} ms", elapsed));
+  }
+
+  // A paused walk finds nothing until it is resumed, then finds everything.
+  fs::path root =
+      make_test_tree("throttle", {"a/1.txt", "a/2.txt", "b/3.txt", "4.txt"});
+  PathFinder finder;
+  finder.throttle = &throttle;
+  std::atomic_size_t found = 0;
+  throttle.pause();
+  std::thread walk([&]() {
+    finder.walk(root, fs::directory_options::none,
+                [&found](EntryId, const fs::directory_entry &) { ++found; });
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  size_t found_paused = found;
+  throttle.resume();
+  walk.join();
+  if (found_paused != 0 || found != 4) {
+    result.errors.emplace_back(std::format(
+        "Expected 0 files while paused, 4 after. Found {} and {}",
+        found_paused, found.load()));
+  }
+
   ArgParser parser;
+  Command command = parser.parse_args({"exe_name", "--max-ops", "50",
+                                       "--idle-io", "--max-cpu", "25", ".",
+                                       "txt"});
+  SearchSettings *settings = std::get_if<SearchSettings>(&command);
+  if (settings == nullptr || settings->max_ops_per_second != 50 ||
+      settings->max_cpu_percent != 25 || !settings->idle_io ||
+      settings->substrings.size() != 1) {
+    result.errors.emplace_back("Throttling options weren't parsed.");
+  }
+  // Options without substrings are missing arguments.
   try {
-    parser.parse_args(args);
+    parser.parse_args({"exe_name", "--max-ops", "50", "."});
+    result.errors.emplace_back("Expected ArgumentException for no substrings.");
   } catch (ArgumentException &exception) {
-    return;
-  } catch (std::exception &e) {
-    std::cout << "other exception" << e.what() << std::endl;
   }
-  result.errors.emplace_back("Expected ArgumentException!");
-}
-
-TestResult test_no_args() {
-  TestResult result("test_no_args");
-  expect_argument_exception(result, {});
   return result;
 }
 
-TestResult test_too_few_args() {
-  TestResult result("test_too_few_args");
-  expect_argument_exception(result, {"exe_name"});
-  expect_argument_exception(result, {"exe_name", "root_dir"});
+TestResult test_folder_reader() {
+  TestResult result("test_folder_reader");
+  FolderReader reader(std::chrono::milliseconds{100});
+  std::atomic_bool should_continue = true;
+
+  // A stuck operation is abandoned at its deadline; the next one runs on a
+  // fresh worker.
+  auto start = std::chrono::steady_clock::now();
+  std::optional<int> stuck = reader.run<int>(
+      []() {
+        std::this_thread::sleep_for(std::chrono::seconds{2});
+        return 1;
+      },
+      should_continue);
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::optional<int> next = reader.run<int>([]() { return 2; },
+                                            should_continue);
+  if (stuck || elapsed.count() > 1000 || next != 2 || reader.abandoned != 1) {
+    result.errors.emplace_back(std::format(
+        "Expected the stuck operation to be abandoned after 100 ms. Took "
+        "{:.0f} ms, {} workers abandoned",
+        elapsed.count(), reader.abandoned));
+  }
+
+  // Walking through a reader finds the same files.
+  fs::path root =
+      make_test_tree("folder_reader", {"a/1.txt", "a/b/2.txt", "3.txt"});
+  PathFinder finder;
+  finder.reader = &reader;
+  size_t found = 0;
+  finder.walk(root, fs::directory_options::none,
+              [&found](EntryId, const fs::directory_entry &) { ++found; });
+  if (found != 3 || !finder.timed_out.empty()) {
+    result.errors.emplace_back(
+        std::format("Expected 3 files, no timeouts. Found {} files, {} "
+                    "timeouts",
+                    found, finder.timed_out.size()));
+  }
   return result;
 }
 
-TestResult test_help() {
-  TestResult result("test_help");
-  ArgParser parser;
-  auto args = parser.parse_args({"exe_name", "--help"});
-  if (!std::holds_alternative<HelpCommand>(args)) {
-    result.errors.emplace_back("Expected HelpCommand.");
-    return result;
+TestResult test_traversal_profile() {
+  TestResult result("test_traversal_profile");
+  std::vector<std::string> files{"small/needle.txt"};
+  for (size_t i = 0; i < 200; ++i) {
+    files.push_back(std::format("big/{}.txt", i));
   }
+  fs::path root = make_test_tree("traversal_profile", files);
+  fs::path profile_path = root.parent_path() / "traversal_profile.prof";
+  fs::remove(profile_path);
 
-  int help_return = std::visit(ArgVisitor{}, args);
-  if (help_return != 0) {
+  // Walks once with a fresh profile and returns the top-level folder of the
+  // first file found.
+  auto first_folder = [&](bool matched_first) {
+    TraversalProfile profile(profile_path, root);
+    profile.matched_first = matched_first;
+    PathFinder finder;
+    finder.profile = &profile;
+    std::vector<fs::path> found;
+    finder.walk(root, fs::directory_options::none,
+                [&](EntryId, const fs::directory_entry &entry) {
+                  found.push_back(entry.path());
+                  if (entry.path().filename() == "needle.txt") {
+                    profile.record_match(entry.path());
+                  }
+                });
+    profile.save();
+    return found.empty() ? std::string{}
+                         : found.front()
+                               .lexically_relative(root)
+                               .begin()
+                               ->string();
+  };
+
+  first_folder(false); // Learn the tree.
+  if (std::string first = first_folder(false); first != "big") {
     result.errors.emplace_back(std::format(
-        "Expected help command to return 0. Instead found {}", help_return));
+        "Expected the biggest subtree first. Started with \"{}\"", first));
+  }
+  if (std::string first = first_folder(true); first != "small") {
+    result.errors.emplace_back(std::format(
+        "Expected the matched subtree first. Started with \"{}\"", first));
   }
 
-  return result;
-}
+  // Parallel walkers find every file once.
+  PathFinder finder;
+  finder.walkers = 4;
+  std::mutex mutex;
+  std::set<EntryId> ids;
+  finder.walk(root, fs::directory_options::none,
+              [&](EntryId id, const fs::directory_entry &) {
+                std::scoped_lock<std::mutex> lock(mutex);
+                ids.insert(id);
+              });
+  if (ids.size() != files.size()) {
+    result.errors.emplace_back(std::format(
+        "Expected {} files from 4 walkers. Found {}", files.size(),
+        ids.size()));
+  }
 
-TestResult test_root_dne() {
-  TestResult result{"test_root_dne"};
-  ArgParser parser;
+  // A root relative to the working directory records the same folders.
+  fs::path relative_path =
+      root.parent_path() / "traversal_profile_relative.prof";
+  fs::remove(relative_path);
+  {
+    fs::path relative = fs::relative(root);
+    TraversalProfile profile(relative_path, relative);
+    profile.record_match(relative / "small" / "needle.txt");
+    profile.save();
+  }
+  TraversalProfile reloaded(relative_path, root);
+  reloaded.matched_first = true;
+  if (reloaded.priority("small").first != 1) {
+    result.errors.emplace_back("Expected the match below a relative root.");
+  }
 
-  try {
-    parser.parse_args({"exe_name", "root_dne", "arg1"});
-  } catch (ArgumentException &exception) {
-    std::string expected_error = "Root path doesn't exist! (\"root_dne\")";
-    if (exception.what() != expected_error) {
-      result.errors.emplace_back(std::format(
-          "Expected error message: '{}'\tFound error message: '{}'\t",
-          expected_error, exception.what()));
-    }
-    return result;
+  // Each flag turns on its own setting only.
+  Command command = ArgParser().parse_args(
+      {"exe_name", "--profile", profile_path.string(), "--matched-first",
+       "--intern-names", ".", "txt"});
+  SearchSettings *settings = std::get_if<SearchSettings>(&command);
+  if (settings == nullptr || !settings->matched_first ||
+      !settings->intern_names || settings->idle_io || settings->archives) {
+    result.errors.emplace_back("Expected --matched-first and --intern-names.");
   }
-  result.errors.emplace_back("No exception thrown. Expected ArgumentException");
   return result;
 }
 
-TestResult test_processor_find() {
-  TestResult result("test_processor_find");
-  result.errors.emplace_back("Error: Not Implemented. todo: implement");
-  return result;
+TestResult test_estimate() {
+  TestResult result("test_estimate");
+  // A regular tree: every descent sees the same counts, so the estimate is
+  // exact after the minimum number of probes.
+  std::vector<std::string> files;
+  for (size_t a = 0; a < 4; ++a) {
+    for (size_t b = 0; b < 5; ++b) {
+      for (std::string name : {"x.tmp", "y.tmp", "z.tmp", "keep.txt"}) {
+        files.push_back(std::format("{}/{}/{}", a, b, name));
+      }
+    }
+  }
+  fs::path root = make_test_tree("estimate", files);
+  TreeEstimator estimator(root, {"tmp", "keep"}, 7);
+  MatchEstimate estimate = estimator.run(5, 30);
+  // Each file holds its relative path: 9 bytes for "a/b/x.tmp", 12 for
+  // "a/b/keep.txt".
+  std::vector<double> counts{60, 20, 80};
+  std::vector<double> bytes{60 * 9, 20 * 12, 60 * 9 + 20 * 12};
+  if (estimate.counts != counts || estimate.bytes != bytes ||
+      estimate.count_errors[2] != 0 || estimate.probes != 30) {
+    result.errors.emplace_back(std::format(
+        "Expected exactly 60 tmp and 20 keep files from 30 probes. Found {} "
+        "and {} from {} probes",
+        estimate.counts[0], estimate.counts[1], estimate.probes));
+  }
+  // Every probe reads at most 3 of the 25 folders, and none twice.
+  if (estimate.folders_read > 25 || estimate.folders_read < 3) {
+    result.errors.emplace_back(std::format(
+        "Expected between 3 and 25 folders read. Read {}",
+        estimate.folders_read));
+  }
 
-  TestContainer container;
-  Processor proc{&container, {"foo"}};
+  // A single match in one of 40 folders: the first probes all miss it, which
+  // is no reason to stop.
+  std::vector<std::string> sparse_files{"f7/needle.txt"};
+  for (size_t i = 0; i < 40; ++i) {
+    sparse_files.push_back(std::format("f{}/x.txt", i));
+  }
+  fs::path sparse = make_test_tree("estimate_sparse", sparse_files);
+  MatchEstimate rare = TreeEstimator(sparse, {"needle"}, 7).run(50, 5);
+  if (rare.counts[1] == 0 || rare.probes <= 5) {
+    result.errors.emplace_back(std::format(
+        "Expected the rare match to be found. Estimated {} from {} probes",
+        rare.counts[1], rare.probes));
+  }
+  // Without any matches, probing goes on to the limit.
+  MatchEstimate none = TreeEstimator(sparse, {"absent"}, 7).run(50, 5, 200);
+  if (none.probes != 200) {
+    result.errors.emplace_back(std::format(
+        "Expected 200 probes without matches. Made {}", none.probes));
+  }
+  return result;
+}
 
-  // todo: Create a std::filesystem::directory_entry
-  // "E:\\Alice\\Bob\\foo.txt". std::filesystem::directory_entry entry{...}
-  // proc.push(entry);
+TestResult test_coordinator() {
+  TestResult result("test_coordinator");
+  Frame frame{Frame::Shard, "payload"};
+  std::string buffer;
+  ByteWriter wire;
+  wire.fixed<uint32_t>(8);
+  buffer = wire.out + "Spayload" + "\x05";
+  std::optional<Frame> taken = Frame::take(buffer);
+  if (!taken || taken->type != frame.type || taken->payload != "payload" ||
+      buffer != "\x05" || Frame::take(buffer)) {
+    result.errors.emplace_back("Expected one complete frame to be taken.");
+  }
 
-  if (container.get_store().size() != 1) {
-    result.errors.emplace_back(
-        std::format("Expected exactly one result. Instead found: {}",
-                    container.get_store().size()));
+#if defined(__linux__)
+  std::vector<std::string> files{"top_report.txt", "a/report.doc",
+                                 "a/b/c/report.txt", "b/notes.txt"};
+  for (size_t i = 0; i < 30; ++i) {
+    files.push_back(std::format("big/{}/{}/report_{}.txt", i % 3, i, i));
+  }
+  fs::path root = make_test_tree("coordinator", files);
+  TestContainer container({"report", "txt"});
+  Coordinator coordinator("/proc/self/exe", root, {"report", "txt"},
+                          &container);
+  coordinator.run(3);
+  std::map<std::string, PatternMask> found;
+  for (auto &[id, match] : container.get_store()) {
+    found[match.path.lexically_relative(root).generic_string()] =
+        match.patterns;
+  }
+  if (found.size() != files.size() ||
+      found["a/report.doc"] != PatternMask{0b01} ||
+      found["b/notes.txt"] != PatternMask{0b10} ||
+      found["big/2/29/report_29.txt"] != PatternMask{0b11}) {
+    result.errors.emplace_back(std::format(
+        "Expected {} matches from 3 workers. Found {}", files.size(),
+        found.size()));
   }
 
-  auto &[key, value] = *container.get_store().begin();
-  if (key.string() != "E:\\Alice\\Bob\\foo.txt") {
-    result.errors.emplace_back("Incorrect path was pushed into container.");
+  // A single shard: the idle worker can only get work by splitting it.
+  std::vector<std::string> deep_files;
+  for (size_t i = 0; i < 200; ++i) {
+    deep_files.push_back(std::format("only/{}/report_{}.txt", i, i));
+  }
+  fs::path deep_root = make_test_tree("coordinator_split", deep_files);
+  TestContainer deep_container({"report"});
+  Coordinator splitting("/proc/self/exe", deep_root, {"report"},
+                        &deep_container);
+  splitting.run(2);
+  if (deep_container.get_store().size() != deep_files.size() ||
+      splitting.splits == 0) {
+    result.errors.emplace_back(std::format(
+        "Expected {} matches with the shard split. Found {}, {} splits",
+        deep_files.size(), deep_container.get_store().size(),
+        splitting.splits));
   }
-  // todo: check value
 
+  // The first worker to start exits at once; its shard goes to the others.
+  fs::path script = root.parent_path() / "coordinator_worker.sh";
+  fs::path died = root.parent_path() / "coordinator_worker.died";
+  fs::remove(died);
+  std::ofstream(script) << std::format(
+      "#!/bin/sh\nmkdir '{}' 2>/dev/null && exit 1\nexec '{}' \"$@\"\n",
+      died.string(), fs::read_symlink("/proc/self/exe").string());
+  fs::permissions(script, fs::perms::owner_all);
+  TestContainer survivor_container({"report", "txt"});
+  Coordinator survivors(script, root, {"report", "txt"}, &survivor_container);
+  survivors.run(3);
+  if (survivor_container.get_store().size() != files.size()) {
+    result.errors.emplace_back(std::format(
+        "Expected {} matches after a worker died. Found {}", files.size(),
+        survivor_container.get_store().size()));
+  }
+  // Without any worker, the search fails rather than waiting forever.
+  TestContainer failed_container({"report"});
+  Coordinator failing(root / "missing_executable", root, {"report"},
+                      &failed_container);
+  try {
+    failing.run(2);
+    result.errors.emplace_back("Expected IndexException without workers.");
+  } catch (const IndexException &) {
+  }
+#endif
   return result;
 }
 
-// todo: Add test for: "E:\alice\bob\foo.txt" doesn't match "alice" or "bob" but
-// does match "foo".
-
-// todo: Add test for: Only filenames. E:\alice\bob\foo (folder) shouldn't be
-// counted. Note: This check is done in the finder, not the processor.
-
 int do_tests() {
   std::vector<TestResult> results;
   std::cout << "running tests" << std::endl;
   for (auto fun : {test_logging_prefix, test_no_args, test_too_few_args,
-                   test_root_dne, test_help, test_processor_find
+                   test_root_dne, test_help, test_processor_find,
+                   test_index_query, test_index_subtree_query,
+                   test_index_broken_link, test_index_range_query,
+                   test_subtree_summary,
+                   test_sharded_index,
+                   test_index_compaction, test_content_index,
+                   test_fleet_index,
+                   test_cached_search,
+                   test_shared_scan, test_interactive_search, test_throttle,
+                   test_folder_reader, test_traversal_profile,
+                   test_estimate, test_coordinator, test_archive_search,
+                   test_magic_filter, test_content_cache,
+                   test_compressed_content, test_name_dictionary,
+                   test_batch_matcher, test_path_glob
 
        }) {
     results.emplace_back(fun());